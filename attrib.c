@@ -1,19 +1,25 @@
 #include "attrib.h"
+#include "style.h"
 #include "hash.h"
 #include "inherit_cache.h"
 #include "intern_cache.h"
+#include "paged_array.h"
+#include "style_index.h"
+#include "style_image.h"
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define DEFAULT_ATTRIB_ARENA_BITS 7
-#define DEFAULT_ATTRIB_ARENA_SIZE (1 << DEFAULT_ATTRIB_ARENA_BITS)
 #define DEFAULT_TUPLE_BITS 7
-#define DEFAULT_TUPLE_SIZE (1 << DEFAULT_TUPLE_BITS)
+#define DEFAULT_BLOB_BITS 5
 #define EMBED_VALUE_SIZE 8
 #define MAX_KEY 128
-#define DELAY_REMOVE 4096
+#define DEFAULT_DELAY_FRAMES 2
+#define DELAY_UNLINKED -2
+#define KV_DIR_RETIRED 32	// the directory of kv pages doubles at most 32 times
 
 // #define VERIFY_ATTRIBID
 
@@ -38,35 +44,95 @@ struct verify_attrib {
 
 #endif
 
+#ifdef STYLE_NO_THREAD
+
+#define KV_LOCK
+typedef uint32_t kv_bits_t;
+typedef void ** kv_dir_t;
+
+#else
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// kv entries (arena, arena_i and blob pool) can be interned from other threads.
+// Readers of existing entries need no lock, because the pages of arena are never moved,
+// and the page directory is published atomically, the old ones are retired until compact.
+// owner is the thread of cache, the ids found by other threads are pinned by a reference.
+#define KV_LOCK pthread_rwlock_t kv_lock; pthread_t owner;
+typedef _Atomic uint32_t kv_bits_t;
+typedef void ** _Atomic kv_dir_t;
+
+#endif
+
+// blob payloads are pooled by content, shared by the kv entries of any key
 struct attrib_blob {
+	int refcount;
+	int id;	// index in blob_pool
+	uint32_t hash;	// content hash without key
 	size_t sz;
 	uint8_t data[1];
 };
 
+union blob_entry {
+	struct attrib_blob *b;
+	int next;
+};
+
+struct blob_pool {
+	int n;
+	int freelist;
+	struct paged_array s;	// union blob_entry
+};
+
+#define POOL_ENTRY(pool, index) PAGED_ARRAY_GET(&(pool)->s, union blob_entry, index)
+
+// borrowed value, not copied
+struct attrib_extern {
+	void *ptr;
+	size_t sz;
+	uint32_t hash;	// passed by user
+	const struct style_extern *ext;
+};
+
+#define KV_BLOB 1
+#define KV_EXT 2
+#define KV_KEY_SHIFT 2
+#define KV_REF_SHIFT 9
+#define KV_REF (1u << KV_REF_SHIFT)
+
+// bits : blob(1) ext(1) key(7) refcount(23), in one word because the owner thread changes
+// refcount without lock while other threads pin the entry
 struct attrib_kv {
-	uint32_t blob:1;
-	uint32_t k:7;
-	uint32_t refcount:24;
+	kv_bits_t bits;
 	uint32_t hash;
 	union {
 		uint8_t buffer[EMBED_VALUE_SIZE];
 		struct attrib_blob *ptr;
+		struct attrib_extern *ext;
 		int next;
 	} v;
 };
 
 struct attrib_arena {
 	int n;
-	int cap;
 	int freelist;
-	struct attrib_kv *e;
+	struct paged_array e;	// struct attrib_kv
+	kv_dir_t dir;	// e.page for the readers
+	int retired_n;
+	struct {
+		void **page;
+		int cap;
+	} retired[KV_DIR_RETIRED];
 };
 
+#define ARENA_KV(arena, index) ((struct attrib_kv *)dir_load(&(arena)->dir)[(index) >> PAGED_ARRAY_BITS] + ((index) & PAGED_ARRAY_MASK))
+
 struct attrib_array {
 	int refcount;
 	int n;
 	uint32_t hash;
-	int data[1];
+	style_index_t data[1];
 };
 
 union attrib_tuple_entry {
@@ -76,15 +142,42 @@ union attrib_tuple_entry {
 
 struct attrib_tuple {
 	int n;
-	int cap;
 	int freelist;
-	union attrib_tuple_entry *s;
+	struct paged_array s;	// union attrib_tuple_entry
+};
+
+#define TUPLE_ENTRY(tuple, index) PAGED_ARRAY_GET(&(tuple)->s, union attrib_tuple_entry, index)
+
+struct delay_link {
+	int prev;	// DELAY_UNLINKED : not parked
+	int next;
+	unsigned int frame;
+	unsigned int tick;
 };
 
-struct delay_removed {
+// zero-ref items are parked in LRU order (holding one reference), the head is the oldest one.
+// An item is unlinked when it's referenced again, and released by delay_collect()
+struct delay_list {
 	int head;
 	int tail;
-	int removed[DELAY_REMOVE];
+	int base;	// ids below base are in the base layer, they are never parked
+	size_t bytes;
+	struct paged_array link;	// struct delay_link, indexed by kv entry id or tuple handle - base
+};
+
+#define DELAY_LINK(l, index) PAGED_ARRAY_GET(&(l)->link, struct delay_link, (index) - (l)->base)
+
+// Read only kv entries and tuples shared by caches. The pages of kv entries are used in place,
+// the blob pointers in them are offsets from .image. Tuple pointers are resolved when it's opened.
+struct attrib_base {
+	uint8_t *image;
+	size_t sz;
+	int kv_n;
+	int tuple_n;
+	struct paged_array kv;	// struct attrib_kv
+	struct paged_array tuple;	// union attrib_tuple_entry
+	struct intern_cache kv_i;
+	struct intern_cache tuple_i;
 };
 
 struct attrib_state {
@@ -92,11 +185,23 @@ struct attrib_state {
 	struct intern_cache arena_i;
 	struct attrib_tuple tuple;
 	struct intern_cache tuple_i;
+	struct blob_pool pool;
+	struct intern_cache pool_i;
 	struct inherit_cache icache;
-	struct delay_removed kv_removed;
-	struct delay_removed tuple_removed;
+	struct delay_list kv_delay;
+	struct delay_list tuple_delay;
+	unsigned int frame;
+	unsigned int tick;
+	int delay_frames;
+	size_t delay_bytes;
+	int collecting;
+	struct style_image_reader image;	// blobs and tuple arrays in the image are not freed
+	const struct attrib_base *base;
+	int base_kv;	// entry ids [0, base_kv) and tuples [0, base_tuple) are in base, they have no reference count
+	int base_tuple;
 	unsigned char inherit_mask[128];
 	VERIFY_ATTRIB
+	KV_LOCK
 };
 
 
@@ -165,174 +270,404 @@ static inline int verify_attribid(struct attrib_state *A, int id) { return id; }
 
 #endif
 
+#ifdef STYLE_NO_THREAD
+
+static inline void kv_lock_init(struct attrib_state *A) {}
+static inline int kv_foreign(struct attrib_state *A) { return 0; }
+static inline void kv_lock_deinit(struct attrib_state *A) {}
+static inline void kv_rdlock(struct attrib_state *A) {}
+static inline void kv_wrlock(struct attrib_state *A) {}
+static inline void kv_unlock(struct attrib_state *A) {}
+static inline uint32_t bits_load(kv_bits_t *b) { return *b; }
+static inline void bits_store(kv_bits_t *b, uint32_t v) { *b = v; }
+static inline void bits_add(kv_bits_t *b, uint32_t v) { *b += v; }
+static inline void bits_and(kv_bits_t *b, uint32_t v) { *b &= v; }
+static inline void ** dir_load(kv_dir_t *d) { return *d; }
+static inline void dir_store(kv_dir_t *d, void **v) { *d = v; }
 
-static int
-delay_remove(struct delay_removed *removed, int index) {
-	int tail = removed->tail;
-	// push index, delay delete
-	removed->removed[tail] = index;
-	if (++tail >= DELAY_REMOVE) {
-		tail -= DELAY_REMOVE;
-	}
-	removed->tail = tail;
-	if (tail == removed->head) {
-		// delay queue is full
-		int removed_index = removed->removed[removed->head];
-		int head = removed->head + 1;
-		if (head >= DELAY_REMOVE)
-			head -= DELAY_REMOVE;
-		removed->head = head;
-		return removed_index;
+#else
+
+static inline void kv_lock_init(struct attrib_state *A) { pthread_rwlock_init(&A->kv_lock, NULL); A->owner = pthread_self(); }
+static inline int kv_foreign(struct attrib_state *A) { return !pthread_equal(pthread_self(), A->owner); }
+static inline void kv_lock_deinit(struct attrib_state *A) { pthread_rwlock_destroy(&A->kv_lock); }
+static inline void kv_rdlock(struct attrib_state *A) { pthread_rwlock_rdlock(&A->kv_lock); }
+static inline void kv_wrlock(struct attrib_state *A) { pthread_rwlock_wrlock(&A->kv_lock); }
+static inline void kv_unlock(struct attrib_state *A) { pthread_rwlock_unlock(&A->kv_lock); }
+static inline uint32_t bits_load(kv_bits_t *b) { return atomic_load_explicit(b, memory_order_relaxed); }
+static inline void bits_store(kv_bits_t *b, uint32_t v) { atomic_store_explicit(b, v, memory_order_relaxed); }
+static inline void bits_add(kv_bits_t *b, uint32_t v) { atomic_fetch_add_explicit(b, v, memory_order_relaxed); }
+static inline void bits_and(kv_bits_t *b, uint32_t v) { atomic_fetch_and_explicit(b, v, memory_order_relaxed); }
+static inline void ** dir_load(kv_dir_t *d) { return atomic_load_explicit(d, memory_order_acquire); }
+static inline void dir_store(kv_dir_t *d, void **v) { atomic_store_explicit(d, v, memory_order_release); }
+
+#endif
+
+static inline int kv_key(struct attrib_kv *kv) { return (bits_load(&kv->bits) >> KV_KEY_SHIFT) & 0x7f; }
+static inline int kv_isblob(struct attrib_kv *kv) { return bits_load(&kv->bits) & KV_BLOB; }
+static inline int kv_isext(struct attrib_kv *kv) { return (bits_load(&kv->bits) & KV_EXT) != 0; }
+static inline int kv_refcount(struct attrib_kv *kv) { return bits_load(&kv->bits) >> KV_REF_SHIFT; }
+
+// An entry found (or created) by another thread holds one reference for it (a pin), with the kv lock held.
+// So it's not freed before the id is passed to the owner thread, which releases the pin.
+static inline void
+kv_pin(struct attrib_state *A, int id) {
+	if (kv_foreign(A))
+		bits_add(&ARENA_KV(&A->arena, id)->bits, KV_REF);
+}
+
+
+static void
+delay_init(struct delay_list *l, int base) {
+	l->head = -1;
+	l->tail = -1;
+	l->base = base;
+	l->bytes = 0;
+	paged_array_init(&l->link, sizeof(struct delay_link));
+}
+
+static void
+delay_deinit(struct delay_list *l, struct style_cache *C) {
+	paged_array_deinit(&l->link, C);
+}
+
+// make link[index] addressable, new links are unlinked
+static void
+delay_reserve(struct delay_list *l, int index, struct style_cache *C) {
+	int cap = paged_array_cap(&l->link);
+	index -= l->base;
+	if (index < cap)
+		return;
+	paged_array_reserve(&l->link, index + 1, C);
+	int i;
+	for (i=cap;i<paged_array_cap(&l->link);i++) {
+		PAGED_ARRAY_GET(&l->link, struct delay_link, i)->prev = DELAY_UNLINKED;
 	}
-	return -1;
+}
+
+static inline int
+delay_parked(struct delay_list *l, int index) {
+	// links of kv entries are reserved when they are parked
+	return index - l->base < paged_array_cap(&l->link) && DELAY_LINK(l, index)->prev != DELAY_UNLINKED;
 }
 
 static void
-delay_remove_init(struct delay_removed *r) {
-	r->head = 0;
-	r->tail = 0;
+delay_link(struct delay_list *l, int index, unsigned int frame, unsigned int tick, size_t sz) {
+	struct delay_link *n = DELAY_LINK(l, index);
+	n->prev = l->tail;
+	n->next = -1;
+	n->frame = frame;
+	n->tick = tick;
+	if (l->tail >= 0)
+		DELAY_LINK(l, l->tail)->next = index;
+	else
+		l->head = index;
+	l->tail = index;
+	l->bytes += sz;
+}
+
+static void
+delay_unlink(struct delay_list *l, int index, size_t sz) {
+	struct delay_link *n = DELAY_LINK(l, index);
+	if (n->prev >= 0)
+		DELAY_LINK(l, n->prev)->next = n->next;
+	else
+		l->head = n->next;
+	if (n->next >= 0)
+		DELAY_LINK(l, n->next)->prev = n->prev;
+	else
+		l->tail = n->prev;
+	n->prev = DELAY_UNLINKED;
+	l->bytes -= sz;
 }
 
 static void
 tuple_init(struct attrib_tuple *tuple, struct style_cache *C) {
 	tuple->n = 0;
-	tuple->cap = DEFAULT_TUPLE_SIZE;
-	tuple->s = (union attrib_tuple_entry *)style_malloc(C, DEFAULT_TUPLE_SIZE * sizeof(union attrib_tuple_entry));
+	paged_array_init(&tuple->s, sizeof(union attrib_tuple_entry));
 	tuple->freelist = -1;
 }
 
 static inline size_t
 attrib_array_size(int n) {
-	return sizeof(struct attrib_array) + n * sizeof(int) - sizeof(int);
+	return sizeof(struct attrib_array) + n * sizeof(style_index_t) - sizeof(style_index_t);
+}
+
+static inline void
+copy_index(int *output, const style_index_t *data, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		output[i] = data[i];
+	}
+}
+
+static inline int
+equal_index(const int *buf, const style_index_t *data, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		if (buf[i] != data[i])
+			return 0;
+	}
+	return 1;
 }
 
 static void
 clear_freelist(struct attrib_tuple *tuple) {
 	int index = tuple->freelist;
 	while (index >= 0) {
-		int next = tuple->s[index].next;
-		tuple->s[index].a = NULL;
+		int next = TUPLE_ENTRY(tuple, index)->next;
+		TUPLE_ENTRY(tuple, index)->a = NULL;
 		index = next;
 	}
 }
 
+static inline void
+free_array(const struct style_image_reader *image, struct attrib_array *a, struct style_cache *C) {
+	if (!image_contains(image, a))
+		style_free(C, a, attrib_array_size(a->n));
+}
+
 static void
-tuple_deinit(struct attrib_tuple *tuple, struct style_cache *C) {
+tuple_deinit(struct attrib_tuple *tuple, int base, const struct style_image_reader *image, struct style_cache *C) {
 	int i;
 	clear_freelist(tuple);
-	for (i=0;i<tuple->n;i++) {
-		struct attrib_array *a = tuple->s[i].a;
+	for (i=base;i<tuple->n;i++) {
+		struct attrib_array *a = TUPLE_ENTRY(tuple, i)->a;
 		if (a) {
-			style_free(C, a, attrib_array_size(a->n));
+			free_array(image, a, C);
 		}
 	}
-	style_free(C, tuple->s, tuple->cap * sizeof(union attrib_tuple_entry));
+	paged_array_deinit(&tuple->s, C);
 }
 
 static int
 tuple_new(struct attrib_tuple *tuple, struct attrib_array *data, struct style_cache *C) {
 	int index = tuple->freelist;
 	if (index >= 0) {
-		tuple->freelist = tuple->s[index].next;
+		tuple->freelist = TUPLE_ENTRY(tuple, index)->next;
 	} else {
 		index = tuple->n++;
-		if (index >= tuple->cap) {
-			int newcap = tuple->cap * 3 / 2;
-			tuple->s = (union attrib_tuple_entry *)style_realloc(C, tuple->s, tuple->cap * sizeof(union attrib_tuple_entry), newcap * sizeof(union attrib_tuple_entry));
-			assert(tuple->s != NULL);
-			tuple->cap = newcap;
-		}
+		paged_array_reserve(&tuple->s, tuple->n, C);
 	}
-	tuple->s[index].a = data;
+	TUPLE_ENTRY(tuple, index)->a = data;
 	return index;
 }
 
 static void
-tuple_delete(struct attrib_tuple *tuple, int index, struct style_cache *C) {
+tuple_delete(struct attrib_tuple *tuple, int index, const struct style_image_reader *image, struct style_cache *C) {
 	assert(index >=0 && index < tuple->n);
-	struct attrib_array *a = tuple->s[index].a;
-	style_free(C, a, attrib_array_size(a->n));
-	tuple->s[index].a = NULL;
-	tuple->s[index].next = tuple->freelist;
+	struct attrib_array *a = TUPLE_ENTRY(tuple, index)->a;
+	free_array(image, a, C);
+	TUPLE_ENTRY(tuple, index)->a = NULL;
+	TUPLE_ENTRY(tuple, index)->next = tuple->freelist;
 	tuple->freelist = index;
 }
 
 static void
 arena_init(struct attrib_arena *arena, struct style_cache *C) {
-	arena->e = (struct attrib_kv *)style_malloc(C, DEFAULT_ATTRIB_ARENA_SIZE * sizeof(struct attrib_kv));
+	paged_array_init(&arena->e, sizeof(struct attrib_kv));
+	dir_store(&arena->dir, NULL);
+	arena->retired_n = 0;
 	arena->n = 0;
-	arena->cap = DEFAULT_ATTRIB_ARENA_SIZE;
 	arena->freelist = -1;
 }
 
+// publish the directory of arena->e after it's replaced
 static inline void
-free_blob(struct attrib_kv *kv, struct style_cache *C) {
-	if (kv->blob) {
-		style_free(C, kv->v.ptr, kv->v.ptr->sz + sizeof(struct attrib_blob) - 1);
-		kv->blob = 0;
-	}
+arena_publish(struct attrib_arena *arena) {
+	dir_store(&arena->dir, arena->e.page);
 }
 
+// free the directories retired by arena_reserve(), no other threads can read them
 static void
-arena_deinit(struct attrib_arena *arena, struct style_cache *C) {
+arena_free_retired(struct attrib_arena *arena, struct style_cache *C) {
 	int i;
-	for (i=0;i<arena->n;i++) {
-		free_blob(&arena->e[i], C);
+	for (i=0;i<arena->retired_n;i++) {
+		style_free(C, arena->retired[i].page, arena->retired[i].cap * sizeof(void *));
+	}
+	arena->retired_n = 0;
+}
+
+// Like paged_array_reserve(), but the old directory is kept alive because other threads may still
+// read it without lock. It is freed by arena_free_retired().
+static void
+arena_reserve(struct attrib_arena *arena, int n, struct style_cache *C) {
+	struct paged_array *p = &arena->e;
+	if (paged_array_cap(p) >= n)
+		return;
+	while (paged_array_cap(p) < n) {
+		if (p->npage >= p->dircap) {
+			int cap = p->dircap == 0 ? 16 : p->dircap * 2;
+			void **page = (void **)style_malloc(C, cap * sizeof(void *));
+			assert(page != NULL);
+			if (p->page) {
+				memcpy(page, p->page, p->npage * sizeof(void *));
+				assert(arena->retired_n < KV_DIR_RETIRED);
+				arena->retired[arena->retired_n].page = p->page;
+				arena->retired[arena->retired_n].cap = p->dircap;
+				++arena->retired_n;
+			}
+			p->page = page;
+			p->dircap = cap;
+		}
+		void *page = style_malloc(C, p->esize * PAGED_ARRAY_PAGE);
+		assert(page != NULL);
+		p->page[p->npage++] = page;
 	}
-	style_free(C, arena->e, arena->cap * sizeof(struct attrib_kv));
+	arena_publish(arena);
+}
+
+static void
+pool_init(struct blob_pool *pool) {
+	pool->n = 0;
+	pool->freelist = -1;
+	paged_array_init(&pool->s, sizeof(union blob_entry));
+}
+
+static void
+pool_deinit(struct blob_pool *pool, struct style_cache *C) {
+	// all the blobs are released with kv entries
+	paged_array_deinit(&pool->s, C);
+}
+
+static uint32_t
+blob_hash_(uint32_t index, void *p) {
+	struct blob_pool *pool = (struct blob_pool *)p;
+	return POOL_ENTRY(pool, index)->b->hash;
+}
+
+#define BLOB_HASH(A) blob_hash_, &A->pool
+
+static inline size_t
+blob_size(size_t sz) {
+	return sizeof(struct attrib_blob) - 1 + sz;
 }
 
 static struct attrib_blob *
-blob_new(void *ptr, size_t sz, struct style_cache *C) {
-	struct attrib_blob * b = (struct attrib_blob *)style_malloc(C, sizeof(*b) - 1 + sz);
+blob_find(struct attrib_state *A, void *ptr, size_t sz, uint32_t hash) {
+	struct intern_cache_iterator iter;
+	if (intern_cache_find(&A->pool_i, hash, &iter, BLOB_HASH(A))) {
+		do {
+			struct attrib_blob *b = POOL_ENTRY(&A->pool, iter.result)->b;
+			if (b->sz == sz && memcmp(ptr, b->data, sz) == 0)
+				return b;
+		} while (intern_cache_find_next(&A->pool_i, &iter, BLOB_HASH(A)));
+	}
+	return NULL;
+}
+
+static struct attrib_blob *
+blob_new(struct attrib_state *A, void *ptr, size_t sz, uint32_t hash, struct style_cache *C) {
+	struct blob_pool *pool = &A->pool;
+	struct attrib_blob * b = (struct attrib_blob *)style_malloc(C, blob_size(sz));
+	b->refcount = 1;
+	b->hash = hash;
 	b->sz = sz;
 	memcpy(b->data, ptr, sz);
+	int index = pool->freelist;
+	if (index >= 0) {
+		pool->freelist = POOL_ENTRY(pool, index)->next;
+	} else {
+		index = pool->n++;
+		paged_array_reserve(&pool->s, pool->n, C);
+	}
+	POOL_ENTRY(pool, index)->b = b;
+	b->id = index;
+	intern_cache_insert(&A->pool_i, index, BLOB_HASH(A), C);
 	return b;
 }
 
+static void
+blob_release(struct attrib_state *A, struct attrib_blob *b, struct style_cache *C) {
+	if (--b->refcount > 0)
+		return;
+	struct blob_pool *pool = &A->pool;
+	int index = b->id;
+	intern_cache_remove(&A->pool_i, index, BLOB_HASH(A));
+	POOL_ENTRY(pool, index)->next = pool->freelist;
+	pool->freelist = index;
+	if (!image_contains(&A->image, b))
+		style_free(C, b, blob_size(b->sz));
+}
+
+static inline void
+free_blob(struct attrib_state *A, struct attrib_kv *kv, struct style_cache *C) {
+	if (kv_isblob(kv)) {
+		blob_release(A, kv->v.ptr, C);
+		bits_and(&kv->bits, ~KV_BLOB);
+	} else if (kv_isext(kv)) {
+		struct attrib_extern *e = kv->v.ext;
+		if (e->ext->release)
+			e->ext->release(e->ext->ud, e->ptr, e->sz);
+		style_free(C, e, sizeof(*e));
+		bits_and(&kv->bits, ~KV_EXT);
+	}
+}
+
+static void
+arena_deinit(struct attrib_state *A, struct style_cache *C) {
+	struct attrib_arena *arena = &A->arena;
+	int i;
+	for (i=A->base_kv;i<arena->n;i++) {
+		free_blob(A, ARENA_KV(arena, i), C);
+	}
+	paged_array_deinit(&arena->e, C);
+	arena_free_retired(arena, C);
+}
+
+// the value is set by caller
 static int
-arena_create(struct attrib_arena *arena, int key, void *value, size_t sz, uint32_t hash, struct style_cache *C) {
+arena_create(struct attrib_arena *arena, int key, int flags, uint32_t hash, struct style_cache *C) {
 	struct attrib_kv *kv;
 	int index;
 	if (arena->freelist >= 0) {
 		index = arena->freelist;
-		kv = &arena->e[index];
+		kv = ARENA_KV(arena, index);
 		arena->freelist = kv->v.next;
 	} else {
-		if (arena->n >= arena->cap) {
-			int newcap = arena->cap * 3 / 2;
-			arena->e = (struct attrib_kv *)style_realloc(C, arena->e, arena->cap * sizeof(struct attrib_kv), newcap * sizeof(struct attrib_kv));
-			assert(arena->e != NULL);
-			arena->cap = newcap;
-		}
 		index = arena->n++;
-		kv = &arena->e[index];
+		arena_reserve(arena, arena->n, C);
+		kv = ARENA_KV(arena, index);
 	}
 	assert(key >= 0 && key <=127);
-	kv->k = key;
-	kv->refcount = 0;
+	bits_store(&kv->bits, key << KV_KEY_SHIFT | flags);
 	kv->hash = hash;
-	if (sz > EMBED_VALUE_SIZE) {
-		kv->blob = 1;
-		kv->v.ptr = blob_new(value, sz, C);
-	} else {
-		kv->blob = 0;
-		kv->v.ptr = NULL;
-		memcpy(kv->v.buffer, value, sz);
-	}
+	// embedded values are compared with the padding
+	memset(&kv->v, 0, sizeof(kv->v));
 	return index;
 }
 
 struct attrib_state *
-attrib_newstate(const unsigned char inherit_mask[128], struct style_cache *C) {
+attrib_newstate(const unsigned char inherit_mask[128], const struct attrib_base *base, struct style_cache *C) {
 	struct attrib_state *A = (struct attrib_state *)style_malloc(C, sizeof(*A));
 	arena_init(&A->arena, C);
 	tuple_init(&A->tuple, C);
+	A->base = base;
+	if (base) {
+		// the ids of the cache start after the pages of base
+		paged_array_borrow(&A->arena.e, &base->kv, C);
+		arena_publish(&A->arena);
+		paged_array_borrow(&A->tuple.s, &base->tuple, C);
+		A->arena.n = paged_array_cap(&A->arena.e);
+		A->tuple.n = paged_array_cap(&A->tuple.s);
+	}
+	A->base_kv = A->arena.n;
+	A->base_tuple = A->tuple.n;
 	inherit_cache_init(&A->icache);
-	delay_remove_init(&A->kv_removed);
-	delay_remove_init(&A->tuple_removed);
+	delay_init(&A->kv_delay, A->base_kv);
+	delay_init(&A->tuple_delay, A->base_tuple);
+	A->frame = 0;
+	A->tick = 0;
+	A->delay_frames = DEFAULT_DELAY_FRAMES;
+	A->delay_bytes = 0;
+	A->collecting = 0;
+	A->image.base = NULL;
+	A->image.sz = 0;
+	A->image.offset = 0;
+	kv_lock_init(A);
 	intern_cache_init(C, &A->arena_i, DEFAULT_ATTRIB_ARENA_BITS);
 	intern_cache_init(C, &A->tuple_i, DEFAULT_TUPLE_BITS);
+	pool_init(&A->pool);
+	intern_cache_init(C, &A->pool_i, DEFAULT_BLOB_BITS);
 	verify_attrib_init(A);
 
 	if (inherit_mask == NULL) {
@@ -346,48 +681,263 @@ attrib_newstate(const unsigned char inherit_mask[128], struct style_cache *C) {
 
 void
 attrib_close(struct attrib_state *A, struct style_cache *C) {
-	arena_deinit(&A->arena, C);
-	tuple_deinit(&A->tuple, C);
+	arena_deinit(A, C);
+	pool_deinit(&A->pool, C);
+	intern_cache_deinit(C, &A->pool_i);
+	tuple_deinit(&A->tuple, A->base_tuple, &A->image, C);
 	inherit_cache_deinit(C, &A->icache);
 	intern_cache_deinit(C, &A->arena_i);
 	intern_cache_deinit(C, &A->tuple_i);
+	delay_deinit(&A->kv_delay, C);
+	delay_deinit(&A->tuple_delay, C);
+	kv_lock_deinit(A);
 	style_free(C, A, sizeof(*A));
 }
 
 static uint32_t
 attrib_kv_hash_(uint32_t index, void *a) {
-	struct attrib_kv *e = (struct attrib_kv *)a;
-	return e[index].hash;
+	struct attrib_arena *arena = (struct attrib_arena *)a;
+	return ARENA_KV(arena, index)->hash;
 }
 
-#define ATTRIB_KV_HASH(A) attrib_kv_hash_, A->arena.e
+#define ATTRIB_KV_HASH(A) attrib_kv_hash_, &A->arena
 
-int
-attrib_entryid(struct attrib_state *A, int key, void *ptr, size_t sz, struct style_cache *C) {
-	uint32_t hash = kv_hash(key, ptr, sz);
+#define BASE_KV(B, index) PAGED_ARRAY_GET(&(B)->kv, struct attrib_kv, index)
+#define BASE_TUPLE(B, index) PAGED_ARRAY_GET(&(B)->tuple, union attrib_tuple_entry, index)->a
+
+static inline struct attrib_blob *
+base_blob(const struct attrib_base *B, const struct attrib_kv *kv) {
+	return (struct attrib_blob *)(B->image + (uintptr_t)kv->v.ptr);
+}
+
+// the blob of entry id, the entries of base keep offsets
+static inline struct attrib_blob *
+kv_blob(struct attrib_state *A, int id, struct attrib_kv *kv) {
+	return id < A->base_kv ? base_blob(A->base, kv) : kv->v.ptr;
+}
+
+static uint32_t
+base_kv_hash_(uint32_t index, void *ud) {
+	return BASE_KV((struct attrib_base *)ud, index)->hash;
+}
+
+static uint32_t
+base_tuple_hash_(uint32_t index, void *ud) {
+	return BASE_TUPLE((struct attrib_base *)ud, index)->hash;
+}
+
+// base is immutable, so it needs no lock
+static int
+base_find_entry(const struct attrib_base *B, int key, void *ptr, size_t sz, uint32_t hash, int blob) {
+	struct attrib_base *base = (struct attrib_base *)B;
+	struct intern_cache_iterator iter;
+	if (intern_cache_find(&base->kv_i, hash, &iter, base_kv_hash_, base)) {
+		do {
+			struct attrib_kv *kv = BASE_KV(B, iter.result);
+			if (kv_key(kv) != key || kv_isblob(kv) != blob)
+				continue;
+			if (blob) {
+				struct attrib_blob *b = base_blob(B, kv);
+				if (b->sz == sz && memcmp(ptr, b->data, sz) == 0)
+					return iter.result;
+			} else if (memcmp(ptr, kv->v.buffer, sz) == 0) {
+				return iter.result;
+			}
+		} while (intern_cache_find_next(&base->kv_i, &iter, base_kv_hash_, base));
+	}
+	return -1;
+}
+
+// return -1 if not found, read only
+static int
+blob_find_entry(struct attrib_state *A, int key, struct attrib_blob *b, uint32_t hash) {
 	struct intern_cache_iterator iter;
 	if (intern_cache_find(&A->arena_i, hash, &iter, ATTRIB_KV_HASH(A))) {
 		do {
-			struct attrib_kv *kv = &A->arena.e[iter.result];
-			if (kv->k == key) {
-				if (kv->blob) {
-					if (kv->v.ptr->sz == sz && memcmp(ptr, kv->v.ptr->data, sz) == 0) {
-						return iter.result;
-					}
-				} else {
-					if (sz <= EMBED_VALUE_SIZE && memcmp(ptr, kv->v.buffer, sz) == 0) {
-						return iter.result;
-					}
-				}
+			struct attrib_kv *kv = ARENA_KV(&A->arena, iter.result);
+			if (kv_key(kv) == key && kv_isblob(kv) && kv->v.ptr == b) {
+				return iter.result;
 			}
 		} while (intern_cache_find_next(&A->arena_i, &iter,  ATTRIB_KV_HASH(A)));
 	}
-	// new entry
-	int	new_index = arena_create(&A->arena, key, ptr, sz, hash, C);
+	return -1;
+}
+
+static int
+blob_entryid(struct attrib_state *A, int key, void *ptr, size_t sz, struct style_cache *C) {
+	uint32_t bhash = kv_hash(0, ptr, sz);
+	uint32_t hash = kv_hash(key, &bhash, sizeof(bhash));
+	kv_rdlock(A);
+	struct attrib_blob *b = blob_find(A, ptr, sz, bhash);
+	int id = b ? blob_find_entry(A, key, b, hash) : -1;
+	if (id >= 0)
+		kv_pin(A, id);
+	kv_unlock(A);
+	if (id >= 0)
+		return id;
+	if (A->base && (id = base_find_entry(A->base, key, ptr, sz, hash, 1)) >= 0)
+		return id;
+	kv_wrlock(A);
+	// it may be added by another thread before wrlock
+	b = blob_find(A, ptr, sz, bhash);
+	if (b) {
+		id = blob_find_entry(A, key, b, hash);
+		if (id >= 0) {
+			kv_pin(A, id);
+			kv_unlock(A);
+			return id;
+		}
+	}
+	int new_index = arena_create(&A->arena, key, KV_BLOB, hash, C);
+	if (b)
+		++b->refcount;
+	else
+		b = blob_new(A, ptr, sz, bhash, C);
+	ARENA_KV(&A->arena, new_index)->v.ptr = b;
 	intern_cache_insert(&A->arena_i, new_index, ATTRIB_KV_HASH(A), C);
+	kv_pin(A, new_index);
+	kv_unlock(A);
 	return new_index;
 }
 
+// return -1 if not found, read only
+static int
+embed_find_entry(struct attrib_state *A, int key, void *ptr, size_t sz, uint32_t hash) {
+	struct intern_cache_iterator iter;
+	if (intern_cache_find(&A->arena_i, hash, &iter, ATTRIB_KV_HASH(A))) {
+		do {
+			struct attrib_kv *kv = ARENA_KV(&A->arena, iter.result);
+			if (kv_key(kv) == key && !kv_isext(kv) && !kv_isblob(kv) && memcmp(ptr, kv->v.buffer, sz) == 0) {
+				return iter.result;
+			}
+		} while (intern_cache_find_next(&A->arena_i, &iter,  ATTRIB_KV_HASH(A)));
+	}
+	return -1;
+}
+
+static int
+embed_entryid(struct attrib_state *A, int key, void *ptr, size_t sz, uint32_t hash, struct style_cache *C) {
+	kv_rdlock(A);
+	int id = embed_find_entry(A, key, ptr, sz, hash);
+	if (id >= 0)
+		kv_pin(A, id);
+	kv_unlock(A);
+	if (id >= 0)
+		return id;
+	if (A->base && (id = base_find_entry(A->base, key, ptr, sz, hash, 0)) >= 0)
+		return id;
+	kv_wrlock(A);
+	// it may be added by another thread before wrlock
+	id = embed_find_entry(A, key, ptr, sz, hash);
+	if (id >= 0) {
+		kv_pin(A, id);
+	} else {
+		// new entry
+		id = arena_create(&A->arena, key, 0, hash, C);
+		memcpy(ARENA_KV(&A->arena, id)->v.buffer, ptr, sz);
+		intern_cache_insert(&A->arena_i, id, ATTRIB_KV_HASH(A), C);
+		kv_pin(A, id);
+	}
+	kv_unlock(A);
+	return id;
+}
+
+int
+attrib_entryid(struct attrib_state *A, int key, void *ptr, size_t sz, struct style_cache *C) {
+	if (sz > EMBED_VALUE_SIZE)
+		return blob_entryid(A, key, ptr, sz, C);
+	return embed_entryid(A, key, ptr, sz, kv_hash(key, ptr, sz), C);
+}
+
+int
+attrib_entry_import(struct attrib_state *A, struct attrib_state *from, int id, struct style_cache *C) {
+	if (A == from || (id < from->base_kv && A->base == from->base))
+		return id;
+	struct attrib_kv *kv = ARENA_KV(&from->arena, id);
+	if (kv_isblob(kv)) {
+		struct attrib_blob *b = kv_blob(from, id, kv);
+		return blob_entryid(A, kv_key(kv), b->data, b->sz, C);
+	}
+	if (kv_isext(kv)) {
+		struct attrib_extern *e = kv->v.ext;
+		assert(e->ext->addref);
+		e->ext->addref(e->ext->ud, e->ptr, e->sz);
+		return attrib_entryid_extern(A, kv_key(kv), e->ptr, e->sz, e->hash, e->ext, C);
+	}
+	// the size of embedded value is unknown, reuse the hash and compare the whole buffer
+	return embed_entryid(A, kv_key(kv), kv->v.buffer, EMBED_VALUE_SIZE, kv->hash, C);
+}
+
+int
+attrib_importable(struct attrib_state *from) {
+	struct attrib_arena *arena = &from->arena;
+	int i;
+	for (i=0;i<arena->n;i++) {
+		struct attrib_kv *kv = ARENA_KV(arena, i);
+		if (kv_isext(kv) && kv->v.ext->ext->addref == NULL)
+			return 0;
+	}
+	return 1;
+}
+
+static inline int
+extern_equal(struct attrib_extern *e, void *ptr, size_t sz, const struct style_extern *ext) {
+	if (e->ext != ext || e->sz != sz)
+		return 0;
+	if (e->ptr == ptr)
+		return 1;
+	return ext->equal && ext->equal(ext->ud, e->ptr, ptr, sz);
+}
+
+// return -1 if not found, read only
+static int
+extern_find_entry(struct attrib_state *A, int key, void *ptr, size_t sz, uint32_t hash, const struct style_extern *ext) {
+	struct intern_cache_iterator iter;
+	if (intern_cache_find(&A->arena_i, hash, &iter, ATTRIB_KV_HASH(A))) {
+		do {
+			struct attrib_kv *kv = ARENA_KV(&A->arena, iter.result);
+			if (kv_key(kv) == key && kv_isext(kv) && extern_equal(kv->v.ext, ptr, sz, ext)) {
+				return iter.result;
+			}
+		} while (intern_cache_find_next(&A->arena_i, &iter,  ATTRIB_KV_HASH(A)));
+	}
+	return -1;
+}
+
+int
+attrib_entryid_extern(struct attrib_state *A, int key, void *ptr, size_t sz, uint32_t h, const struct style_extern *ext, struct style_cache *C) {
+	uint32_t hash = kv_hash(key, &h, sizeof(h));
+	kv_rdlock(A);
+	int id = extern_find_entry(A, key, ptr, sz, hash, ext);
+	if (id >= 0)
+		kv_pin(A, id);
+	kv_unlock(A);
+	if (id < 0) {
+		kv_wrlock(A);
+		id = extern_find_entry(A, key, ptr, sz, hash, ext);
+		if (id >= 0) {
+			kv_pin(A, id);
+		} else {
+			id = arena_create(&A->arena, key, KV_EXT, hash, C);
+			struct attrib_extern *e = (struct attrib_extern *)style_malloc(C, sizeof(*e));
+			e->ptr = ptr;
+			e->sz = sz;
+			e->hash = h;
+			e->ext = ext;
+			ARENA_KV(&A->arena, id)->v.ext = e;
+			intern_cache_insert(&A->arena_i, id, ATTRIB_KV_HASH(A), C);
+			kv_pin(A, id);
+			kv_unlock(A);
+			return id;
+		}
+		kv_unlock(A);
+	}
+	// the entry keeps its own pointer, drop the reference passed in
+	if (ext->release)
+		ext->release(ext->ud, ptr, sz);
+	return id;
+}
+
 static struct attrib_array *
 create_attrib_array(int n, uint32_t hash, struct style_cache *C) {
 	struct attrib_array * a = (struct attrib_array *)style_malloc(C, attrib_array_size(n));
@@ -397,51 +947,85 @@ create_attrib_array(int n, uint32_t hash, struct style_cache *C) {
 	return a;
 }
 
+static inline size_t
+kv_bytes(struct attrib_kv *kv) {
+	if (kv_isblob(kv))
+		return sizeof(*kv) + kv->v.ptr->sz;
+	return sizeof(*kv) + (kv_isext(kv) ? sizeof(struct attrib_extern) : 0);
+}
+
+#define DELAY_BUDGET 0	// release the oldest items until the budget is met
+#define DELAY_FRAME 1	// also release items dead for delay_frames
+#define DELAY_ALL 2
+
+static void delay_collect(struct attrib_state *A, int mode, struct style_cache *C);
+
+// drop the reference of delay list, with the write lock held
 static void
 release_kv(struct attrib_state *A, int removed_index, struct style_cache *C) {
 	struct attrib_arena *arena = &(A->arena);
-	struct attrib_kv * kv = &arena->e[removed_index];
-	if (--kv->refcount == 0) {
+	struct attrib_kv * kv = ARENA_KV(arena, removed_index);
+	bits_add(&kv->bits, -KV_REF);
+	// it's pinned by other threads while parked, keep it unparked until they are released
+	if (kv_refcount(kv) == 0) {
 		intern_cache_remove(&A->arena_i, removed_index,  ATTRIB_KV_HASH(A));
-		free_blob(kv, C);
+		free_blob(A, kv, C);
 		kv->v.next = arena->freelist;
 		arena->freelist = removed_index;
 	}
 }
 
+// only the owner thread releases references, other threads may pin the entry at any time
+static void
+entry_release_(struct attrib_state *A, int id, struct style_cache *C) {
+	assert(id >= 0);	// arena.n grows in other threads
+	if (id < A->base_kv)
+		return;
+	struct attrib_kv * kv = ARENA_KV(&A->arena, id);
+	uint32_t bits = bits_load(&kv->bits);
+	assert(bits >> KV_REF_SHIFT > 0);
+	if (bits >> KV_REF_SHIFT > 1) {
+		bits_add(&kv->bits, -KV_REF);
+		return;
+	}
+	// keep the last ref in delay list, it may be pinned again before it's collected
+	delay_reserve(&A->kv_delay, id, C);
+	delay_link(&A->kv_delay, id, A->frame, A->tick++, kv_bytes(kv));
+	delay_collect(A, DELAY_BUDGET, C);
+}
+
+static void
+entry_addref_(struct attrib_state *A, int id) {
+	assert(id >= 0);
+	if (id < A->base_kv)
+		return;
+	struct attrib_kv * kv = ARENA_KV(&A->arena, id);
+	if (delay_parked(&A->kv_delay, id)) {
+		// take over the reference of delay list
+		delay_unlink(&A->kv_delay, id, kv_bytes(kv));
+	} else {
+		bits_add(&kv->bits, KV_REF);
+		assert(kv_refcount(kv) != 0);
+	}
+}
+
 void
 attrib_entry_release(struct attrib_state *A, int id, struct style_cache *C) {
-	struct attrib_arena *arena = &(A->arena);
-	assert(id >= 0 && id < arena->n);
-	struct attrib_kv * kv = &arena->e[id];
-	assert(kv->refcount > 0);
-	int c = --kv->refcount;
-	if (c == 0) {
-		kv->refcount = 1;
-		int removed_index = delay_remove(&A->kv_removed, id);
-		if (removed_index >= 0) {
-			release_kv(A, removed_index, C);
-		}
-	}
+	entry_release_(A, id, C);
 }
 
 void
 attrib_entry_addref(struct attrib_state *A, int id) {
-	struct attrib_arena *arena = &(A->arena);
-	assert(id >= 0 && id < arena->n);
-	struct attrib_kv * kv = &arena->e[id];
-	++kv->refcount;
-	assert(kv->refcount != 0);
+	entry_addref_(A, id);
 }
 
 // add index(kv) into buffer[n]
 static int
 add_kv(struct attrib_state *A, int buffer[MAX_KEY], int n, int index) {
-	struct attrib_kv *kv = &A->arena.e[index];
-	int key = kv->k;
+	int key = kv_key(ARENA_KV(&A->arena, index));
 	int i;
 	for (i=n-1;i>=0;i--) {
-		int bk = A->arena.e[buffer[i]].k;
+		int bk = kv_key(ARENA_KV(&A->arena, buffer[i]));
 		if (key >= bk) {
 			if (key > bk) {
 				// insert index after [i]
@@ -462,8 +1046,16 @@ add_kv(struct attrib_state *A, int buffer[MAX_KEY], int n, int index) {
 
 static inline attrib_t
 addref(struct attrib_state *A, attrib_t handle) {
+	if (handle.idx < A->base_tuple)
+		return handle;
 	int index = verify_attribid(A, handle.idx);
-	A->tuple.s[index].a->refcount++;
+	struct attrib_array *a = TUPLE_ENTRY(&A->tuple, index)->a;
+	if (delay_parked(&A->tuple_delay, handle.idx)) {
+		// take over the reference of delay list
+		delay_unlink(&A->tuple_delay, handle.idx, attrib_array_size(a->n));
+	} else {
+		a->refcount++;
+	}
 	return handle;
 }
 
@@ -477,8 +1069,7 @@ attrib_addref(struct attrib_state *A, attrib_t handle) {
 static uint32_t
 tuple_hash_(uint32_t index, void *t) {
 	struct attrib_state *A = (struct attrib_state *)t;
-	union attrib_tuple_entry *e = A->tuple.s;
-	return e[verify_attribid(A, index)].a->hash;
+	return TUPLE_ENTRY(&A->tuple, verify_attribid(A, index))->a->hash;
 }
 
 #define TUPLE_HASH(A) tuple_hash_, A
@@ -487,11 +1078,11 @@ tuple_hash_(uint32_t index, void *t) {
 
 static uint32_t
 tuple_hash_(uint32_t index, void *t) {
-	union attrib_tuple_entry *e = (union attrib_tuple_entry *)t;
-	return e[index].a->hash;
+	struct attrib_tuple *tuple = (struct attrib_tuple *)t;
+	return TUPLE_ENTRY(tuple, index)->a->hash;
 }
 
-#define TUPLE_HASH(A) tuple_hash_, A->tuple.s
+#define TUPLE_HASH(A) tuple_hash_, &A->tuple
 
 #endif
 
@@ -500,8 +1091,8 @@ tuple_hash_find(struct attrib_state *A, uint32_t hash, int n, int *buf) {
 	struct intern_cache_iterator iter;
 	if (intern_cache_find(&A->tuple_i, hash, &iter, TUPLE_HASH(A))) {
 		do {
-			struct attrib_array *a = A->tuple.s[verify_attribid(A, iter.result)].a;
-			if (n == a->n && memcmp(buf, a->data, n * sizeof(int)) == 0) {
+			struct attrib_array *a = TUPLE_ENTRY(&A->tuple, verify_attribid(A, iter.result))->a;
+			if (n == a->n && equal_index(buf, a->data, n)) {
 				return iter.result;
 			}
 		} while (intern_cache_find_next(&A->tuple_i, &iter, TUPLE_HASH(A)));
@@ -509,6 +1100,21 @@ tuple_hash_find(struct attrib_state *A, uint32_t hash, int n, int *buf) {
 	return -1;
 }
 
+static int
+base_tuple_find(const struct attrib_base *B, uint32_t hash, int n, int *buf) {
+	struct attrib_base *base = (struct attrib_base *)B;
+	struct intern_cache_iterator iter;
+	if (intern_cache_find(&base->tuple_i, hash, &iter, base_tuple_hash_, base)) {
+		do {
+			struct attrib_array *a = BASE_TUPLE(B, iter.result);
+			if (n == a->n && equal_index(buf, a->data, n)) {
+				return iter.result;
+			}
+		} while (intern_cache_find_next(&base->tuple_i, &iter, base_tuple_hash_, base));
+	}
+	return -1;
+}
+
 attrib_t
 attrib_create(struct attrib_state *A, int n, const int e[], struct style_cache *C) {
 	int tmp[MAX_KEY];
@@ -530,15 +1136,20 @@ attrib_create(struct attrib_state *A, int n, const int e[], struct style_cache *
 		attrib_t ret = { index };
 		return addref(A, ret);
 	}
+	if (A->base && (index = base_tuple_find(A->base, hash, n, tmp)) >= 0) {
+		attrib_t ret = { index };
+		return ret;
+	}
 
 	struct attrib_array *a = create_attrib_array(n, hash, C);
 	for (i=0;i<n;i++) {
 		a->data[i] = tmp[i];
-		attrib_entry_addref(A, tmp[i]);
+		entry_addref_(A, tmp[i]);
 	}
 	int id = tuple_new(&A->tuple, a, C);
 
 	attrib_t ret = verify_attrib_alloc(A, id);
+	delay_reserve(&A->tuple_delay, ret.idx, C);
 
 	intern_cache_insert(&A->tuple_i, ret.idx, TUPLE_HASH(A), C);
 
@@ -548,15 +1159,15 @@ attrib_create(struct attrib_state *A, int n, const int e[], struct style_cache *
 static int
 delete_tuple(struct attrib_state *A, int index, struct style_cache *C) {
 	int id = verify_attribid(A, index);
-	struct attrib_array * a = A->tuple.s[id].a;
+	struct attrib_array * a = TUPLE_ENTRY(&A->tuple, id)->a;
 	if (--a->refcount > 0)
 		return 0;
 	int i;
 	for (i=0;i<a->n;i++) {
-		attrib_entry_release(A, a->data[i], C);
+		entry_release_(A, a->data[i], C);
 	}
 	intern_cache_remove(&A->tuple_i, index, TUPLE_HASH(A));
-	tuple_delete(&A->tuple, id, C);
+	tuple_delete(&A->tuple, id, &A->image, C);
 
 	inherit_cache_retirekey(&A->icache, index);
 	return 1;
@@ -566,52 +1177,51 @@ int
 attrib_release(struct attrib_state *A, attrib_t handle, struct style_cache *C) {
 	int index = verify_attribid(A, handle.idx);
 	assert(index >= 0 && index < A->tuple.n);
-	struct attrib_array * a = A->tuple.s[index].a;
-	--a->refcount;
-	if (a->refcount == 0) {
-		a->refcount = 1;	// keep ref in delay queue
-		int removed_index = delay_remove(&A->tuple_removed, handle.idx);
-		if (removed_index >= 0) {
-			if (delete_tuple(A, removed_index, C))
-				verify_attrib_dealloc(A, removed_index);
-		}
-	}
-	return a->refcount;
+	if (index < A->base_tuple)
+		return 1;
+	struct attrib_array * a = TUPLE_ENTRY(&A->tuple, index)->a;
+	if (--a->refcount > 0)
+		return a->refcount;
+	a->refcount = 1;	// keep ref in delay list
+	delay_link(&A->tuple_delay, handle.idx, A->frame, A->tick++, attrib_array_size(a->n));
+	delay_collect(A, DELAY_BUDGET, C);
+	return 0;
 }
 
 static inline struct attrib_array *
 get_array(struct attrib_state *A, attrib_t handle) {
 	int index = verify_attribid(A, handle.idx);
 	assert(index >= 0 && index < A->tuple.n);
-	struct attrib_array * a = A->tuple.s[index].a;
+	struct attrib_array * a = TUPLE_ENTRY(&A->tuple, index)->a;
 	return a;
 }
 
 int
 attrib_get(struct attrib_state *A, attrib_t handle, int output[128]) {
 	struct attrib_array *a = get_array(A, handle);
-	memcpy(output, a->data, a->n * sizeof(int));
+	copy_index(output, a->data, a->n);
 	return a->n;
 }
 
 static inline struct attrib_kv *
 get_kv(struct attrib_state *A, struct attrib_array * a, int index) {
-	return &A->arena.e[a->data[index]];
+	return ARENA_KV(&A->arena, a->data[index]);
 }
 
 int
 attrib_find(struct attrib_state *A, attrib_t handle, uint8_t key) {
 	int index = verify_attribid(A, handle.idx);
 	assert(index >= 0 && index < A->tuple.n);
-	struct attrib_array * a = A->tuple.s[index].a;
+	struct attrib_array * a = TUPLE_ENTRY(&A->tuple, index)->a;
 	int begin = 0;
 	int end = a->n;
 	while (begin < end) {
 		int mid = (begin + end) / 2;
 		struct attrib_kv *kv = get_kv(A, a, mid);
-		if (kv->k == key) {
+		int k = kv_key(kv);
+		if (k == key) {
 			return mid;
-		} else if (kv->k < key) {
+		} else if (k < key) {
 			begin = mid + 1;
 		} else {
 			end = mid;
@@ -620,32 +1230,62 @@ attrib_find(struct attrib_state *A, attrib_t handle, uint8_t key) {
 	return -1;
 }
 
+// output[i] is the entry id of keys[i], -1 == not found
+int
+attrib_find_many(struct attrib_state *A, attrib_t handle, int n, const uint8_t keys[], int output[]) {
+	struct attrib_array * a = get_array(A, handle);
+	int map[MAX_KEY];
+	int i;
+	memset(map, 0xff, sizeof(map));
+	for (i=0;i<a->n;i++) {
+		int id = a->data[i];
+		map[kv_key(ARENA_KV(&A->arena, id))] = id;
+	}
+	int found = 0;
+	for (i=0;i<n;i++) {
+		int id = keys[i] < MAX_KEY ? map[keys[i]] : -1;
+		output[i] = id;
+		if (id >= 0)
+			++found;
+	}
+	return found;
+}
 
 void*
 attrib_entry_get(struct attrib_state *A, int index, uint8_t *key, size_t *sz) {
-	struct attrib_kv *kv = &A->arena.e[index];
-	*key = kv->k;
-	if (sz) {
-		*sz = kv->blob ? kv->v.ptr->sz : EMBED_VALUE_SIZE;
+	struct attrib_kv *kv = ARENA_KV(&A->arena, index);
+	*key = kv_key(kv);
+	if (kv_isext(kv)) {
+		if (sz)
+			*sz = kv->v.ext->sz;
+		return kv->v.ext->ptr;
 	}
-	return kv->blob ? kv->v.ptr->data : kv->v.buffer;
+	if (kv_isblob(kv)) {
+		struct attrib_blob *b = kv_blob(A, index, kv);
+		if (sz)
+			*sz = b->sz;
+		return b->data;
+	}
+	if (sz)
+		*sz = EMBED_VALUE_SIZE;
+	return kv->v.buffer;
 }
 
 int
 attrib_index(struct attrib_state *A, attrib_t handle, int i) {
 	int index = verify_attribid(A, handle.idx);
 	assert(index >= 0 && index < A->tuple.n);
-	struct attrib_array * a = A->tuple.s[index].a;
+	struct attrib_array * a = TUPLE_ENTRY(&A->tuple, index)->a;
 	if (i < 0 || i >= a->n)
 		return -1;
 	return a->data[i];
 }
 
-static attrib_t
-attrib_inherit_(struct attrib_state *A, attrib_t child, attrib_t parent, int with_mask, struct style_cache *C) {
+// merge parent into child, return the size of output, or -1 when the result is child or parent (output[0])
+static int
+inherit_merge_(struct attrib_state *A, attrib_t child, attrib_t parent, int with_mask, int output[MAX_KEY]) {
 	struct attrib_array *child_a = get_array(A, child);
 	struct attrib_array *parent_a = get_array(A, parent);
-	int output[MAX_KEY];
 	int output_index = 0;
 	int dirty = 0;
 	const unsigned char * inherit_mask = A->inherit_mask;
@@ -655,29 +1295,25 @@ attrib_inherit_(struct attrib_state *A, attrib_t child, attrib_t parent, int wit
 			int i;
 			for (i=0;i<parent_a->n;i++) {
 				struct attrib_kv *kv = get_kv(A, parent_a, i);
-				if (inherit_mask[kv->k]) {
+				if (inherit_mask[kv_key(kv)]) {
 					output[output_index++] = parent_a->data[i];
 				} else {
 					dirty = 1;
 				}
 			}
 			if (dirty) {
-				return attrib_create(A, output_index, output, C);
-			} else {
-				addref(A, parent);
-				return parent;
+				return output_index;
 			}
-		} else {
-			addref(A, parent);
-			return parent;
 		}
+		output[0] = parent.idx;
+		return -1;
 	}
 	int child_index = 0;
 	int parent_index = 0;
 	for (;;) {
 		if (parent_index >= parent_a->n) {
 			int n = child_a->n - child_index;
-			memcpy(output+output_index, child_a->data+child_index, n * sizeof(int));
+			copy_index(output+output_index, child_a->data+child_index, n);
 			output_index += n;
 			break;
 		}
@@ -687,14 +1323,14 @@ attrib_inherit_(struct attrib_state *A, attrib_t child, attrib_t parent, int wit
 				int i;
 				for (i=0;i<n;i++) {
 					struct attrib_kv *kv = get_kv(A, parent_a, parent_index+i);
-					if (inherit_mask[kv->k]) {
+					if (inherit_mask[kv_key(kv)]) {
 						output[output_index++] = parent_a->data[parent_index+i];
 						dirty = 1;
 					}
 				}
 			} else {
 				dirty = 1;
-				memcpy(output+output_index, parent_a->data+parent_index, n * sizeof(int));
+				copy_index(output+output_index, parent_a->data+parent_index, n);
 				output_index += n;
 			}
 			break;
@@ -704,8 +1340,8 @@ attrib_inherit_(struct attrib_state *A, attrib_t child, attrib_t parent, int wit
 
 		struct attrib_kv *child_kv = get_kv(A, child_a, child_index);
 		struct attrib_kv *parent_kv = get_kv(A, parent_a, parent_index);
-		int child_k = child_kv->k;
-		int parent_k = parent_kv->k;
+		int child_k = kv_key(child_kv);
+		int parent_k = kv_key(parent_kv);
 
 		if (child_k == parent_k) {
 			// ignore parent
@@ -731,34 +1367,625 @@ attrib_inherit_(struct attrib_state *A, attrib_t child, attrib_t parent, int wit
 		}
 	}
 	if (dirty) {
-		return attrib_create(A, output_index, output, C);
-	} else {
-		addref(A, child);
-		return child;
+		return output_index;
 	}
+	output[0] = child.idx;
+	return -1;
 }
 
-attrib_t
-attrib_inherit(struct attrib_state *A, attrib_t child, attrib_t parent, int withmask, struct style_cache *C) {
+int
+attrib_inherit_prepare(struct attrib_state *A, attrib_t child, attrib_t parent, int withmask, int output[MAX_KEY]) {
 	// check cache
 	int result = inherit_cache_fetch(&A->icache, child.idx, parent.idx, withmask);
 	if (result >= 0) {
-		attrib_t r = { result };
+		output[0] = result;
+		return ATTRIB_INHERIT_CACHED;
+	}
+	return inherit_merge_(A, child, parent, withmask, output);
+}
+
+attrib_t
+attrib_inherit_finish(struct attrib_state *A, attrib_t child, attrib_t parent, int withmask, int n, const int output[], struct style_cache *C) {
+	attrib_t r;
+	if (n == ATTRIB_INHERIT_CACHED) {
+		r.idx = output[0];
+		return addref(A, r);
+	}
+	if (n < 0) {
+		r.idx = output[0];
 		addref(A, r);
-		return r;
+	} else {
+		r = attrib_create(A, n, output, C);
 	}
-	attrib_t r = attrib_inherit_(A, child, parent, withmask, C);
 	inherit_cache_set(&A->icache, child.idx, parent.idx, withmask, r.idx, C);
 	return r;
 }
 
+attrib_t
+attrib_inherit(struct attrib_state *A, attrib_t child, attrib_t parent, int withmask, struct style_cache *C) {
+	int output[MAX_KEY];
+	int n = attrib_inherit_prepare(A, child, parent, withmask, output);
+	return attrib_inherit_finish(A, child, parent, withmask, n, output, C);
+}
+
 int
 attrib_refcount(struct attrib_state *A, attrib_t attr) {
 	int index = verify_attribid(A, attr.idx);
-	struct attrib_array * a = A->tuple.s[index].a;
+	struct attrib_array * a = TUPLE_ENTRY(&A->tuple, index)->a;
 	return a->refcount;
 }
 
+int
+attrib_kv_size(struct attrib_state *A) {
+	return A->arena.n;
+}
+
+int
+attrib_tuple_size(struct attrib_state *A) {
+	return A->tuple.n;
+}
+
+// the least recently parked link of kv entries and tuples
+static inline struct delay_link *
+delay_oldest(struct attrib_state *A, int *is_tuple) {
+	int k = A->kv_delay.head;
+	int t = A->tuple_delay.head;
+	if (k < 0 && t < 0)
+		return NULL;
+	if (k >= 0 && t >= 0) {
+		struct delay_link *kl = DELAY_LINK(&A->kv_delay, k);
+		struct delay_link *tl = DELAY_LINK(&A->tuple_delay, t);
+		*is_tuple = (int)(tl->tick - kl->tick) < 0;
+		return *is_tuple ? tl : kl;
+	}
+	*is_tuple = t >= 0;
+	return *is_tuple ? DELAY_LINK(&A->tuple_delay, t) : DELAY_LINK(&A->kv_delay, k);
+}
+
+static inline int
+delay_expired(struct attrib_state *A, struct delay_link *n, int mode) {
+	if (mode == DELAY_ALL)
+		return 1;
+	if (A->delay_bytes > 0 && A->kv_delay.bytes + A->tuple_delay.bytes > A->delay_bytes)
+		return 1;
+	return mode == DELAY_FRAME && A->delay_frames >= 0 && A->frame - n->frame >= (unsigned int)A->delay_frames;
+}
+
+static void
+delay_collect(struct attrib_state *A, int mode, struct style_cache *C) {
+	// deleting a tuple parks its kv entries, they are handled in this loop
+	if (A->collecting)
+		return;
+	A->collecting = 1;
+	struct delay_link *n;
+	int is_tuple;
+	int locked = 0;
+	while ((n = delay_oldest(A, &is_tuple)) && delay_expired(A, n, mode)) {
+		if (is_tuple) {
+			int index = A->tuple_delay.head;
+			struct attrib_array *a = TUPLE_ENTRY(&A->tuple, verify_attribid(A, index))->a;
+			delay_unlink(&A->tuple_delay, index, attrib_array_size(a->n));
+			if (delete_tuple(A, index, C))
+				verify_attrib_dealloc(A, index);
+		} else {
+			int index = A->kv_delay.head;
+			delay_unlink(&A->kv_delay, index, kv_bytes(ARENA_KV(&A->arena, index)));
+			// freeing kv entries excludes the lookups
+			if (!locked) {
+				kv_wrlock(A);
+				locked = 1;
+			}
+			release_kv(A, index, C);
+		}
+	}
+	if (locked)
+		kv_unlock(A);
+	A->collecting = 0;
+}
+
+void
+attrib_delay_policy(struct attrib_state *A, int frames, size_t bytes) {
+	A->delay_frames = frames;
+	A->delay_bytes = bytes;
+}
+
+void
+attrib_flush(struct attrib_state *A, int frame, struct style_cache *C) {
+	delay_collect(A, DELAY_FRAME, C);
+	if (frame)
+		++A->frame;
+}
+
+static int
+intern_bits(int n) {
+	int bits = DEFAULT_ATTRIB_ARENA_BITS;
+	while ((1 << bits) <= n)
+		++bits;
+	return bits;
+}
+
+void
+attrib_compact(struct attrib_state *A, int n, const attrib_t order[], int kv_remap[], int tuple_remap[], struct style_cache *C) {
+#ifdef VERIFY_ATTRIBID
+	assert(0);	// handles are not tuple ids in verify mode
+#endif
+	delay_collect(A, DELAY_ALL, C);
+	kv_wrlock(A);
+	struct attrib_tuple *tuple = &A->tuple;
+	struct attrib_arena *arena = &A->arena;
+	int i,j;
+	clear_freelist(tuple);
+	// ids in base are not changed
+	for (i=0;i<A->base_tuple;i++) {
+		tuple_remap[i] = i;
+	}
+	for (;i<tuple->n;i++) {
+		tuple_remap[i] = -1;
+	}
+	int tn = A->base_tuple;
+	for (i=0;i<n;i++) {
+		int id = order[i].idx;
+		if (id >= 0 && tuple_remap[id] < 0)
+			tuple_remap[id] = tn++;
+	}
+	for (i=A->base_tuple;i<tuple->n;i++) {
+		if (tuple_remap[i] < 0 && TUPLE_ENTRY(tuple, i)->a != NULL)
+			tuple_remap[i] = tn++;
+	}
+	struct paged_array t;
+	paged_array_init(&t, sizeof(union attrib_tuple_entry));
+	if (A->base)
+		paged_array_borrow(&t, &A->base->tuple, C);
+	paged_array_reserve(&t, tn, C);
+	for (i=A->base_tuple;i<tuple->n;i++) {
+		if (tuple_remap[i] >= 0)
+			PAGED_ARRAY_GET(&t, union attrib_tuple_entry, tuple_remap[i])->a = TUPLE_ENTRY(tuple, i)->a;
+	}
+
+	// kv entries are placed in the order of tuples, free slots are removed.
+	// zero-ref entries are kept, their ids may be held by the user (see style_attrib_id)
+	for (i=0;i<A->base_kv;i++) {
+		kv_remap[i] = i;
+	}
+	for (;i<arena->n;i++) {
+		kv_remap[i] = -1;
+	}
+	for (i=arena->freelist;i>=0;i=ARENA_KV(arena, i)->v.next) {
+		kv_remap[i] = -2;
+	}
+	int kn = A->base_kv;
+	for (i=A->base_tuple;i<tn;i++) {
+		struct attrib_array *a = PAGED_ARRAY_GET(&t, union attrib_tuple_entry, i)->a;
+		for (j=0;j<a->n;j++) {
+			int id = a->data[j];
+			if (kv_remap[id] < 0)
+				kv_remap[id] = kn++;
+		}
+	}
+	for (i=A->base_kv;i<arena->n;i++) {
+		if (kv_remap[i] == -1)
+			kv_remap[i] = kn++;
+		else if (kv_remap[i] == -2)
+			kv_remap[i] = -1;
+	}
+	struct paged_array e;
+	paged_array_init(&e, sizeof(struct attrib_kv));
+	if (A->base)
+		paged_array_borrow(&e, &A->base->kv, C);
+	paged_array_reserve(&e, kn, C);
+	for (i=A->base_kv;i<arena->n;i++) {
+		struct attrib_kv *kv = ARENA_KV(arena, i);
+		if (kv_remap[i] >= 0)
+			*PAGED_ARRAY_GET(&e, struct attrib_kv, kv_remap[i]) = *kv;
+		else
+			free_blob(A, kv, C);
+	}
+	// the hash of tuple depends on kv ids, keys are not changed so the order keeps
+	for (i=A->base_tuple;i<tn;i++) {
+		struct attrib_array *a = PAGED_ARRAY_GET(&t, union attrib_tuple_entry, i)->a;
+		int tmp[MAX_KEY];
+		for (j=0;j<a->n;j++) {
+			a->data[j] = tmp[j] = kv_remap[a->data[j]];
+		}
+		a->hash = array_hash(tmp, a->n);
+	}
+
+	paged_array_deinit(&tuple->s, C);
+	tuple->s = t;
+	tuple->n = tn;
+	tuple->freelist = -1;
+	paged_array_deinit(&arena->e, C);
+	arena_free_retired(arena, C);
+	arena->e = e;
+	arena_publish(arena);
+	arena->n = kn;
+	arena->freelist = -1;
+
+	intern_cache_deinit(C, &A->arena_i);
+	intern_cache_init(C, &A->arena_i, intern_bits(kn - A->base_kv));
+	for (i=A->base_kv;i<kn;i++) {
+		intern_cache_insert(&A->arena_i, i, ATTRIB_KV_HASH(A), C);
+	}
+	intern_cache_deinit(C, &A->tuple_i);
+	intern_cache_init(C, &A->tuple_i, intern_bits(tn - A->base_tuple));
+	for (i=A->base_tuple;i<tn;i++) {
+		intern_cache_insert(&A->tuple_i, i, TUPLE_HASH(A), C);
+	}
+	inherit_cache_deinit(C, &A->icache);
+	inherit_cache_init(&A->icache);
+	// delay lists are empty, shrink the links
+	delay_deinit(&A->kv_delay, C);
+	delay_init(&A->kv_delay, A->base_kv);
+	if (kn > A->base_kv)
+		delay_reserve(&A->kv_delay, kn - 1, C);
+	delay_deinit(&A->tuple_delay, C);
+	delay_init(&A->tuple_delay, A->base_tuple);
+	if (tn > A->base_tuple)
+		delay_reserve(&A->tuple_delay, tn - 1, C);
+	kv_unlock(A);
+}
+
+struct attrib_image {
+	int kv_n;
+	int kv_freelist;
+	int tuple_n;
+	int tuple_freelist;
+	int pool_n;
+	int pool_freelist;
+	int kv_head;
+	int kv_tail;
+	int tuple_head;
+	int tuple_tail;
+	size_t kv_bytes;
+	size_t tuple_bytes;
+	unsigned int frame;
+	unsigned int tick;
+	int delay_frames;
+	size_t delay_bytes;
+	int inherit_n;	// pages of inherit versions, -1 : inherit cache is not saved
+	size_t data_end;	// blobs and tuple arrays are in [sizeof(struct attrib_image), data_end)
+	unsigned char inherit_mask[128];
+};
+
+// live pointers are saved as offsets, and free slots as (next + 1) * 2 + 1
+struct image_patch {
+	uintptr_t *offset;	// 0 means a free slot
+	int n;
+};
+
+static void
+patch_entry(void *ud, void *page, int base) {
+	struct image_patch *p = (struct image_patch *)ud;
+	uintptr_t *e = (uintptr_t *)page;
+	int i;
+	for (i=0;i<PAGED_ARRAY_PAGE && base + i < p->n;i++) {
+		if (p->offset[base + i])
+			e[i] = p->offset[base + i];
+		else
+			e[i] = ((uintptr_t)(*(int *)&e[i] + 1) << 1) | 1;
+	}
+}
+
+static void
+restore_entry(struct paged_array *s, int n, uint8_t *base) {
+	int i;
+	for (i=0;i<n;i++) {
+		uintptr_t *e = PAGED_ARRAY_GET(s, uintptr_t, i);
+		if (*e & 1) {
+			int next = (int)(*e >> 1) - 1;
+			*e = 0;
+			*(int *)e = next;
+		} else {
+			*e = (uintptr_t)(base + *e);
+		}
+	}
+}
+
+static void
+patch_kv(void *ud, void *page, int base) {
+	struct image_patch *p = (struct image_patch *)ud;
+	struct attrib_kv *kv = (struct attrib_kv *)page;
+	int i;
+	for (i=0;i<PAGED_ARRAY_PAGE && base + i < p->n;i++) {
+		if (kv_isblob(&kv[i]))
+			kv[i].v.ptr = (struct attrib_blob *)p->offset[kv[i].v.ptr->id];
+	}
+}
+
+// offsets of live blobs and tuple arrays after a header of hsz bytes, return the end of them
+static size_t
+image_layout(struct attrib_state *A, size_t offset, size_t hsz, struct image_patch *blob, struct image_patch *array, struct style_cache *C) {
+	struct blob_pool *pool = &A->pool;
+	struct attrib_tuple *tuple = &A->tuple;
+	int i;
+	blob->n = pool->n;
+	blob->offset = (uintptr_t *)style_malloc(C, (pool->n + 1) * sizeof(uintptr_t));
+	array->n = tuple->n;
+	array->offset = (uintptr_t *)style_malloc(C, (tuple->n + 1) * sizeof(uintptr_t));
+	struct style_image_writer layout = { NULL, offset, 0 };
+	image_skip(&layout, hsz);
+	for (i=0;i<pool->n;i++) {
+		blob->offset[i] = 1;
+	}
+	for (i=pool->freelist;i>=0;i=POOL_ENTRY(pool, i)->next) {
+		blob->offset[i] = 0;
+	}
+	for (i=0;i<pool->n;i++) {
+		if (blob->offset[i])
+			blob->offset[i] = image_skip(&layout, blob_size(POOL_ENTRY(pool, i)->b->sz));
+	}
+	for (i=0;i<tuple->n;i++) {
+		array->offset[i] = 1;
+	}
+	for (i=tuple->freelist;i>=0;i=TUPLE_ENTRY(tuple, i)->next) {
+		array->offset[i] = 0;
+	}
+	for (i=0;i<tuple->n;i++) {
+		if (array->offset[i])
+			array->offset[i] = image_skip(&layout, attrib_array_size(TUPLE_ENTRY(tuple, i)->a->n));
+	}
+	return layout.offset;
+}
+
+static void
+image_write_data(struct attrib_state *A, struct style_image_writer *w, struct image_patch *blob, struct image_patch *array) {
+	int i;
+	for (i=0;i<A->pool.n;i++) {
+		if (blob->offset[i]) {
+			struct attrib_blob *b = POOL_ENTRY(&A->pool, i)->b;
+			image_write(w, b, blob_size(b->sz));
+		}
+	}
+	for (i=0;i<A->tuple.n;i++) {
+		if (array->offset[i]) {
+			struct attrib_array *a = TUPLE_ENTRY(&A->tuple, i)->a;
+			image_write(w, a, attrib_array_size(a->n));
+		}
+	}
+}
+
+int
+attrib_save(struct attrib_state *A, struct style_image_writer *w, int with_inherit, struct style_cache *C) {
+	struct attrib_arena *arena = &A->arena;
+	struct attrib_tuple *tuple = &A->tuple;
+	struct blob_pool *pool = &A->pool;
+	int i;
+	// base layer is saved by attrib_base_save
+	if (A->base)
+		return -1;
+	for (i=0;i<arena->n;i++) {
+		// borrowed pointers can't be saved
+		if (kv_isext(ARENA_KV(arena, i)))
+			return -1;
+	}
+	static_assert(sizeof(union blob_entry) == sizeof(uintptr_t) && sizeof(union attrib_tuple_entry) == sizeof(uintptr_t), "entry is a pointer");
+	struct attrib_image h;
+	h.kv_n = arena->n;
+	h.kv_freelist = arena->freelist;
+	h.tuple_n = tuple->n;
+	h.tuple_freelist = tuple->freelist;
+	h.pool_n = pool->n;
+	h.pool_freelist = pool->freelist;
+	h.kv_head = A->kv_delay.head;
+	h.kv_tail = A->kv_delay.tail;
+	h.tuple_head = A->tuple_delay.head;
+	h.tuple_tail = A->tuple_delay.tail;
+	h.kv_bytes = A->kv_delay.bytes;
+	h.tuple_bytes = A->tuple_delay.bytes;
+	h.frame = A->frame;
+	h.tick = A->tick;
+	h.delay_frames = A->delay_frames;
+	h.delay_bytes = A->delay_bytes;
+	h.inherit_n = with_inherit ? A->icache.npage : -1;
+	memcpy(h.inherit_mask, A->inherit_mask, sizeof(h.inherit_mask));
+
+	// blob payloads and tuple arrays are used in place after loading, layout them before writing
+	struct image_patch blob, array;
+	h.data_end = image_layout(A, w->offset, sizeof(h), &blob, &array, C);
+	image_write(w, &h, sizeof(h));
+	image_write_data(A, w, &blob, &array);
+	assert(w->offset == h.data_end);
+
+	void *tmp = style_malloc(C, sizeof(struct attrib_kv) * PAGED_ARRAY_PAGE);
+	blob.n = arena->n;
+	image_write_pages(w, &arena->e, patch_kv, &blob, tmp);
+	blob.n = pool->n;
+	image_write_pages(w, &pool->s, patch_entry, &blob, tmp);
+	image_write_pages(w, &tuple->s, patch_entry, &array, tmp);
+	style_free(C, tmp, sizeof(struct attrib_kv) * PAGED_ARRAY_PAGE);
+	style_free(C, blob.offset, (pool->n + 1) * sizeof(uintptr_t));
+	style_free(C, array.offset, (tuple->n + 1) * sizeof(uintptr_t));
+
+	image_write_pages(w, &A->kv_delay.link, NULL, NULL, NULL);
+	image_write_pages(w, &A->tuple_delay.link, NULL, NULL, NULL);
+	image_write_intern(w, &A->arena_i);
+	image_write_intern(w, &A->tuple_i);
+	image_write_intern(w, &A->pool_i);
+	if (with_inherit) {
+		image_write(w, A->icache.s, sizeof(A->icache.s));
+		for (i=0;i<A->icache.npage;i++) {
+			uint16_t *v = A->icache.version[i];
+			int page = v != NULL;
+			image_write(w, &page, sizeof(page));
+			if (page)
+				image_write(w, v, INHERIT_VERSION_PAGE * sizeof(uint16_t));
+		}
+	}
+	return w->err ? -1 : 0;
+}
+
+struct attrib_state *
+attrib_load(struct style_image_reader *r, struct style_cache *C) {
+	struct attrib_image h;
+	image_read_value(r, &h, sizeof(h));
+	struct attrib_state *A = (struct attrib_state *)style_malloc(C, sizeof(*A));
+	A->image = *r;
+	A->base = NULL;
+	A->base_kv = 0;
+	A->base_tuple = 0;
+	uint8_t *base = r->base;
+	int i;
+	// blob payloads and tuple arrays are used in place
+	r->offset = h.data_end;
+
+	struct attrib_arena *arena = &A->arena;
+	arena_init(arena, C);
+	image_read_pages(r, &arena->e, C);
+	arena_publish(arena);
+	arena->n = h.kv_n;
+	arena->freelist = h.kv_freelist;
+	for (i=0;i<arena->n;i++) {
+		struct attrib_kv *kv = ARENA_KV(arena, i);
+		if (kv_isblob(kv))
+			kv->v.ptr = (struct attrib_blob *)(base + (uintptr_t)kv->v.ptr);
+	}
+	paged_array_init(&A->pool.s, sizeof(union blob_entry));
+	image_read_pages(r, &A->pool.s, C);
+	A->pool.n = h.pool_n;
+	A->pool.freelist = h.pool_freelist;
+	restore_entry(&A->pool.s, h.pool_n, base);
+	paged_array_init(&A->tuple.s, sizeof(union attrib_tuple_entry));
+	image_read_pages(r, &A->tuple.s, C);
+	A->tuple.n = h.tuple_n;
+	A->tuple.freelist = h.tuple_freelist;
+	restore_entry(&A->tuple.s, h.tuple_n, base);
+
+	delay_init(&A->kv_delay, 0);
+	image_read_pages(r, &A->kv_delay.link, C);
+	A->kv_delay.head = h.kv_head;
+	A->kv_delay.tail = h.kv_tail;
+	A->kv_delay.bytes = h.kv_bytes;
+	delay_init(&A->tuple_delay, 0);
+	image_read_pages(r, &A->tuple_delay.link, C);
+	A->tuple_delay.head = h.tuple_head;
+	A->tuple_delay.tail = h.tuple_tail;
+	A->tuple_delay.bytes = h.tuple_bytes;
+
+	image_read_intern(r, &A->arena_i, C);
+	image_read_intern(r, &A->tuple_i, C);
+	image_read_intern(r, &A->pool_i, C);
+	inherit_cache_init(&A->icache);
+	if (h.inherit_n >= 0) {
+		image_read_value(r, A->icache.s, sizeof(A->icache.s));
+		for (i=0;i<h.inherit_n;i++) {
+			int page;
+			image_read_value(r, &page, sizeof(page));
+			if (page)
+				image_read_value(r, inherit_cache_page(&A->icache, i, C), INHERIT_VERSION_PAGE * sizeof(uint16_t));
+		}
+	}
+
+	A->frame = h.frame;
+	A->tick = h.tick;
+	A->delay_frames = h.delay_frames;
+	A->delay_bytes = h.delay_bytes;
+	A->collecting = 0;
+	memcpy(A->inherit_mask, h.inherit_mask, sizeof(A->inherit_mask));
+	kv_lock_init(A);
+	verify_attrib_init(A);
+	return A;
+}
+
+struct attrib_base_image {
+	int kv_n;
+	int tuple_n;
+	size_t data_end;	// blobs and tuple arrays
+};
+
+int
+attrib_base_save(struct attrib_state *A, struct style_image_writer *w, struct style_cache *C) {
+	struct attrib_arena *arena = &A->arena;
+	int i;
+	if (A->base)
+		return -1;
+	for (i=0;i<arena->n;i++) {
+		if (kv_isext(ARENA_KV(arena, i)))
+			return -1;
+	}
+	// free slots are kept, so the ids are the same in base
+	struct attrib_base_image h;
+	h.kv_n = arena->n;
+	h.tuple_n = A->tuple.n;
+	struct image_patch blob, array;
+	h.data_end = image_layout(A, w->offset, sizeof(h), &blob, &array, C);
+	image_write(w, &h, sizeof(h));
+	image_write_data(A, w, &blob, &array);
+	assert(w->offset == h.data_end);
+
+	void *tmp = style_malloc(C, sizeof(struct attrib_kv) * PAGED_ARRAY_PAGE);
+	int pool_n = blob.n;
+	blob.n = arena->n;
+	image_write_pages(w, &arena->e, patch_kv, &blob, tmp);
+	image_write_pages(w, &A->tuple.s, patch_entry, &array, tmp);
+	style_free(C, tmp, sizeof(struct attrib_kv) * PAGED_ARRAY_PAGE);
+	style_free(C, blob.offset, (pool_n + 1) * sizeof(uintptr_t));
+	style_free(C, array.offset, (array.n + 1) * sizeof(uintptr_t));
+	image_write_intern(w, &A->arena_i);
+	image_write_intern(w, &A->tuple_i);
+	return w->err ? -1 : 0;
+}
+
+// base is shared by caches, so it's not counted by the allocator of any cache
+static void
+base_dir(struct paged_array *p, size_t esize, int npage) {
+	paged_array_init(p, esize);
+	p->page = (void **)malloc((npage + 1) * sizeof(void *));
+	p->dircap = npage + 1;
+	p->npage = p->borrow = npage;
+}
+
+struct attrib_base *
+attrib_base_open(struct style_image_reader *r) {
+	struct attrib_base_image h;
+	image_read_value(r, &h, sizeof(h));
+	if (h.kv_n < 0 || h.tuple_n < 0 || h.data_end > r->sz || h.data_end < r->offset)
+		return NULL;
+	struct attrib_base *B = (struct attrib_base *)malloc(sizeof(*B));
+	B->image = r->base;
+	B->sz = r->sz;
+	B->kv_n = h.kv_n;
+	B->tuple_n = h.tuple_n;
+	r->offset = h.data_end;
+	int npage, i, j;
+	// kv entries are used in place, the blob pointers are offsets
+	image_read_value(r, &npage, sizeof(npage));
+	assert(npage << PAGED_ARRAY_BITS >= h.kv_n);
+	base_dir(&B->kv, sizeof(struct attrib_kv), npage);
+	for (i=0;i<npage;i++) {
+		B->kv.page[i] = image_read(r, image_page_size(&B->kv));
+	}
+	// tuple pointers are resolved in private pages
+	image_read_value(r, &npage, sizeof(npage));
+	assert(npage << PAGED_ARRAY_BITS >= h.tuple_n);
+	base_dir(&B->tuple, sizeof(union attrib_tuple_entry), npage);
+	for (i=0;i<npage;i++) {
+		const uintptr_t *e = (const uintptr_t *)image_read(r, image_page_size(&B->tuple));
+		union attrib_tuple_entry *t = (union attrib_tuple_entry *)malloc(image_page_size(&B->tuple));
+		for (j=0;j<PAGED_ARRAY_PAGE;j++) {
+			t[j].a = (e[j] & 1 || (i << PAGED_ARRAY_BITS) + j >= h.tuple_n) ? NULL : (struct attrib_array *)(B->image + e[j]);
+		}
+		B->tuple.page[i] = t;
+	}
+	image_borrow_intern(r, &B->kv_i);
+	image_borrow_intern(r, &B->tuple_i);
+	return B;
+}
+
+void
+attrib_base_close(struct attrib_base *B) {
+	if (B == NULL)
+		return;
+	int i;
+	for (i=0;i<B->tuple.npage;i++) {
+		free(B->tuple.page[i]);
+	}
+	free(B->tuple.page);
+	free(B->kv.page);
+	free(B->kv_i.next);
+	free(B->tuple_i.next);
+	free(B);
+}
+
 #ifdef ATTRIB_TEST_MAIN
 
 #include <stdio.h>
@@ -784,7 +2011,7 @@ dump_attrib(struct attrib_state *A, attrib_t handle) {
 int
 main() {
 	struct style_cache *C = style_newcache(NULL, NULL, NULL);
-	struct attrib_state *A = attrib_newstate(NULL, C);
+	struct attrib_state *A = attrib_newstate(NULL, NULL, C);
 	int id1 = KV(A, 1, "hello");
 	int id2 = KV(A, 2, "hello world");
 	int id3 = KV(A, 2, "hello");
@@ -795,6 +2022,12 @@ main() {
 	assert(id2 == id5);
 	assert(id1 != id3);
 
+	// the same blob under different keys shares one payload
+	int shared = KV(A, 3, "hello world");
+	assert(shared != id2);
+	uint8_t key;
+	assert(attrib_entry_get(A, shared, &key, NULL) == attrib_entry_get(A, id2, &key, NULL));
+
 	int tuple[] = { id2, id3, id1 };
 
 	attrib_t handle = attrib_create(A, 3, tuple, C);
@@ -824,7 +2057,64 @@ main() {
 
 	dump_attrib(A, handle4);
 
+	// zero-ref tuple is kept for 1 frame
+	attrib_delay_policy(A, 1, 0);
+	int id6 = KV(A, 3, "delay");
+	attrib_t handle5 = attrib_create(A, 1, &id6, C);
+	uint32_t hash5 = array_hash(&id6, 1);
+	attrib_release(A, handle5, C);
+	attrib_flush(A, 1, C);
+	assert(tuple_hash_find(A, hash5, 1, &id6) == handle5.idx);
+	attrib_flush(A, 1, C);
+	assert(tuple_hash_find(A, hash5, 1, &id6) < 0);
+
+	// over the byte budget, released at once
+	attrib_delay_policy(A, 100, 1);
+	int id7 = KV(A, 3, "budget");
+	attrib_t handle6 = attrib_create(A, 1, &id7, C);
+	uint32_t hash6 = array_hash(&id7, 1);
+	attrib_release(A, handle6, C);
+	assert(tuple_hash_find(A, hash6, 1, &id7) < 0);
+
+	// LRU : resurrected tuple becomes the most recent one
+	attrib_delay_policy(A, 0, 0);
+	attrib_flush(A, 1, C);
+	// room for 2 tuples and the kv entry released by the third one
+	attrib_delay_policy(A, -1, 2 * attrib_array_size(3) + sizeof(struct attrib_kv));
+	int s1 = KV(A, 5, "s1");
+	int s2 = KV(A, 6, "s2");
+	int la[3] = { KV(A, 4, "la"), s1, s2 };
+	int lb[3] = { KV(A, 4, "lb"), s1, s2 };
+	int lc[3] = { KV(A, 4, "lc"), s1, s2 };
+	attrib_t ta = attrib_create(A, 3, la, C);
+	attrib_t tb = attrib_create(A, 3, lb, C);
+	attrib_release(A, ta, C);
+	attrib_release(A, tb, C);
+	attrib_t ta2 = attrib_create(A, 3, la, C);
+	assert(ta2.idx == ta.idx);
+	attrib_release(A, ta2, C);
+	attrib_t tc = attrib_create(A, 3, lc, C);
+	attrib_release(A, tc, C);
+	assert(tuple_hash_find(A, array_hash(lb, 3), 3, lb) < 0);
+	assert(tuple_hash_find(A, array_hash(la, 3), 3, la) == ta.idx);
+	assert(tuple_hash_find(A, array_hash(lc, 3), 3, lc) == tc.idx);
+	attrib_flush(A, 1, C);
+	assert(tuple_hash_find(A, array_hash(la, 3), 3, la) == ta.idx);
+
+	attrib_close(A, C);
+
+#ifndef STYLE_COMPACT_INDEX
+	// no limit of kv entries, the page directory grows
+	A = attrib_newstate(NULL, NULL, C);
+	int i;
+	for (i=0;i<(1<<20)+1;i++) {
+		assert(attrib_entryid(A, 1, &i, sizeof(i), C) == i);
+	}
+	i = 0;
+	assert(attrib_entryid(A, 1, &i, sizeof(i), C) == 0);
+	assert(*(int *)attrib_entry_get(A, 1<<20, &key, NULL) == 1<<20);
 	attrib_close(A, C);
+#endif
 
 	style_deletecache(C);
 	return 0;
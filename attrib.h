@@ -6,21 +6,51 @@
 #include "style_alloc.h"
 
 struct attrib_state;
+struct attrib_base;
+struct style_extern;
+struct style_image_writer;
+struct style_image_reader;
 typedef struct { int idx; } attrib_t;
 
-struct attrib_state * attrib_newstate(const unsigned char inherit_mask[128], struct style_cache *C);
+struct attrib_state * attrib_newstate(const unsigned char inherit_mask[128], const struct attrib_base *base, struct style_cache *C);	// base can be NULL
 void attrib_close(struct attrib_state *, struct style_cache *C);
 
 int attrib_entryid(struct attrib_state *, int key, void *ptr, size_t sz, struct style_cache *C);
+int attrib_entryid_extern(struct attrib_state *, int key, void *ptr, size_t sz, uint32_t hash, const struct style_extern *ext, struct style_cache *C);	// take one reference of ptr
+int attrib_entry_import(struct attrib_state *, struct attrib_state *from, int id, struct style_cache *C);	// extern value takes one more reference
+int attrib_importable(struct attrib_state *from);	// 0 : some extern entries have no addref
 attrib_t attrib_create(struct attrib_state *, int n, const int e[], struct style_cache *C);	// Notice: entryid can be invalid after create
 int attrib_release(struct attrib_state *, attrib_t, struct style_cache *C);
 int attrib_get(struct attrib_state *, attrib_t, int output[128]);	// key is [0,127]
 int attrib_find(struct attrib_state *, attrib_t, uint8_t key);	// -1 == not found
+int attrib_find_many(struct attrib_state *, attrib_t, int n, const uint8_t keys[], int output[]);	// return found count
 int attrib_index(struct attrib_state *A, attrib_t handle, int i);
 attrib_t attrib_inherit(struct attrib_state *, attrib_t child, attrib_t parent, int with_mask, struct style_cache *C);
+// attrib_inherit in two steps. prepare is read only, so it can run in other threads while nothing is changed
+#define ATTRIB_INHERIT_CACHED -2
+int attrib_inherit_prepare(struct attrib_state *, attrib_t child, attrib_t parent, int with_mask, int output[128]);	// return the size of output, or < 0 when output[0] is the result
+attrib_t attrib_inherit_finish(struct attrib_state *, attrib_t child, attrib_t parent, int with_mask, int n, const int output[], struct style_cache *C);
 attrib_t attrib_addref(struct attrib_state *, attrib_t a);
 int attrib_refcount(struct attrib_state *, attrib_t a);
 
+int attrib_kv_size(struct attrib_state *);	// upper bound of entry id
+int attrib_tuple_size(struct attrib_state *);	// upper bound of attrib_t
+// Renumber entries and tuples into dense ranges, tuples in order[] first. remap[old] is the new id, -1 means removed
+void attrib_compact(struct attrib_state *, int n, const attrib_t order[], int kv_remap[], int tuple_remap[], struct style_cache *C);
+
+// Zero-ref entries and tuples are kept in LRU order, released in attrib_flush after some frames, or when they are over budget
+void attrib_delay_policy(struct attrib_state *, int frames, size_t bytes);	// frames < 0 or bytes == 0 means no limit
+void attrib_flush(struct attrib_state *, int frame, struct style_cache *C);	// frame != 0 : the next frame begins
+
+// Blob payloads and tuple arrays are used in place after loading, so the image must outlive the state
+int attrib_save(struct attrib_state *, struct style_image_writer *w, int with_inherit, struct style_cache *C);	// -1 : failed, or extern entries
+struct attrib_state * attrib_load(struct style_image_reader *r, struct style_cache *C);
+
+// Base layer : the entries and tuples are read only, used in place from the image, shared by the states created with it
+int attrib_base_save(struct attrib_state *, struct style_image_writer *w, struct style_cache *C);	// -1 : failed, or extern entries
+struct attrib_base * attrib_base_open(struct style_image_reader *r);	// NULL : invalid image
+void attrib_base_close(struct attrib_base *);
+
 void* attrib_entry_get(struct attrib_state *A, int id, uint8_t *key, size_t *sz);
 void attrib_entry_addref(struct attrib_state *A, int id);
 void attrib_entry_release(struct attrib_state *A, int id, struct style_cache *C);
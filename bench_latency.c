@@ -0,0 +1,111 @@
+// Measure the worst single call time while the cache grows.
+// Usage : bench.exe [n] [runs]
+// Each call is timed in all runs and the best time is kept, so a call preempted by the system
+// doesn't count, but a spike of growth (the same call in each run) does.
+
+#include "style.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MAX_BUCKET 32
+
+struct bucket {
+	int n;
+	double total;
+	double worst;
+};
+
+static double
+now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void
+record(struct bucket b[MAX_BUCKET], int i, double t) {
+	int slot = 0;
+	while ((2 << slot) <= i + 1 && slot < MAX_BUCKET - 1)
+		++slot;
+	b[slot].n++;
+	b[slot].total += t;
+	if (t > b[slot].worst)
+		b[slot].worst = t;
+}
+
+static void
+report(const char *name, int n, const double *best) {
+	struct bucket b[MAX_BUCKET] = { { 0 } };
+	int i;
+	for (i=0;i<n;i++) {
+		if (best[i] >= 0)
+			record(b, i, best[i]);
+	}
+	printf("%s\n", name);
+	printf("%12s %10s %10s %10s\n", "size <", "calls", "avg(us)", "worst(us)");
+	for (i=0;i<MAX_BUCKET;i++) {
+		if (b[i].n > 0) {
+			printf("%12d %10d %10.3f %10.3f\n", 2 << i, b[i].n, b[i].total / b[i].n, b[i].worst);
+		}
+	}
+}
+
+static inline void
+keep_best(double *best, int i, double t) {
+	if (best[i] < 0 || t < best[i])
+		best[i] = t;
+}
+
+static void
+run(int n, style_handle_t *h, double *create_t, double *inherit_t) {
+	struct style_cache *C = style_newcache(NULL, NULL, NULL);
+	int i;
+	for (i=0;i<n;i++) {
+		// every style has an unique value, so each call adds a kv, a tuple and a node
+		uint32_t v = (uint32_t)i;
+		struct style_attrib a = { &v, sizeof(v), (uint8_t)(i & 63) };
+		double t = now_us();
+		int id = style_attrib_id(C, &a);
+		h[i] = style_create(C, 1, &id);
+		keep_best(create_t, i, now_us() - t);
+	}
+	for (i=1;i<n;i++) {
+		double t = now_us();
+		style_handle_t r = style_inherit(C, h[i], h[i-1], 0);
+		keep_best(inherit_t, i, now_us() - t);
+		style_addref(C, r);
+	}
+	for (i=0;i<n;i++) {
+		style_release(C, h[i]);
+	}
+	style_flush(C);
+	style_deletecache(C);
+}
+
+int
+main(int argc, char *argv[]) {
+	int n = 1000000;
+	int runs = 3;
+	if (argc > 1)
+		n = atoi(argv[1]);
+	if (argc > 2)
+		runs = atoi(argv[2]);
+	style_handle_t *h = (style_handle_t *)malloc(n * sizeof(style_handle_t));
+	double *create_t = (double *)malloc(n * sizeof(double));
+	double *inherit_t = (double *)malloc(n * sizeof(double));
+	int i;
+	for (i=0;i<n;i++) {
+		create_t[i] = inherit_t[i] = -1;
+	}
+	for (i=0;i<runs;i++) {
+		run(n, h, create_t, inherit_t);
+	}
+	report("style_attrib_id + style_create", n, create_t);
+	report("style_inherit", n, inherit_t);
+	free(inherit_t);
+	free(create_t);
+	free(h);
+	return 0;
+}
@@ -1,46 +1,98 @@
 #include "dirtylist.h"
+#include "paged_array.h"
+#include "style_index.h"
 
 #include <stdlib.h>
 #include <assert.h>
 
 #define DIRTYLIST_INITSIZE 1024
+#define DIRTYLIST_COMPACT_MIN 256
 
 struct dirtyslot {
 	unsigned int version;
-	int b;
+	style_index_t b;
+	style_index_t next;
+};
+
+// compacted edges, dependents of a node are contiguous in dirtylist.e
+struct dirtyedge {
+	unsigned int version;
+	style_index_t b;
+};
+
+// edges added by dirtylist_add_frame, dropped together by dirtylist_frame_reset.
+// There can be more of them than ids (two for each transient node), so they are linked by int
+struct frameslot {
+	style_index_t b;
 	int next;
 };
 
+// .head : staging list of edges added after last compaction
+// [.begin, .begin + .count) : compacted edges
 struct dirtyhead {
 	unsigned int version;
-	int head;
+	style_index_t head;
+	unsigned int frame;
+	int frame_head;
+	int begin;
+	int count;
 };
 
+// heads and slots are paged, so growing never moves them.
+// compacted edges are rebuilt as a whole by dirtylist_compact().
 struct dirtylist {
 	struct style_cache *C;
-	int cap;
 	int n;
 	int freelist;
 	int maxid;
-	struct dirtyhead *h;
-	struct dirtyslot *p;
+	unsigned int frame;
+	int frame_n;
+	int staged;
+	int edge_cap;
+	int edge_n;
+	int stale;
+	struct paged_array h;	// struct dirtyhead
+	struct paged_array p;	// struct dirtyslot
+	struct paged_array f;	// struct frameslot
+	struct dirtyedge *e;
 };
 
+#define HEAD(D, id) PAGED_ARRAY_GET(&(D)->h, struct dirtyhead, id)
+#define SLOT(D, id) PAGED_ARRAY_GET(&(D)->p, struct dirtyslot, id)
+#define FRAME_SLOT(D, id) PAGED_ARRAY_GET(&(D)->f, struct frameslot, id)
+
+static inline void
+init_head(struct dirtyhead *h) {
+	h->head = -1;
+	h->version = 0;
+	h->frame = 0;
+	h->frame_head = -1;
+	h->begin = 0;
+	h->count = 0;
+}
+
 struct dirtylist *
 dirtylist_create(struct style_cache *C) {
 	struct dirtylist *D = (struct dirtylist *)style_malloc(C, sizeof(*D));
 	D->C = C;
-	D->cap = DIRTYLIST_INITSIZE;
 	D->n = 0;
 	D->freelist = -1;
 	D->maxid = DIRTYLIST_INITSIZE;
-	D->h = (struct dirtyhead *)style_malloc(C, D->maxid * sizeof(struct dirtyhead));
+	D->frame = 1;
+	D->frame_n = 0;
+	D->staged = 0;
+	D->edge_cap = 0;
+	D->edge_n = 0;
+	D->stale = 0;
+	D->e = NULL;
+	paged_array_init(&D->h, sizeof(struct dirtyhead));
+	paged_array_reserve(&D->h, D->maxid, C);
 	int i;
 	for (i=0;i<D->maxid;i++) {
-		D->h[i].head = -1;
-		D->h[i].version = 0;
+		init_head(HEAD(D, i));
 	}
-	D->p = (struct dirtyslot *)style_malloc(C, D->cap * sizeof(struct dirtyslot));
+	paged_array_init(&D->p, sizeof(struct dirtyslot));
+	paged_array_init(&D->f, sizeof(struct frameslot));
 	return D;
 }
 void
@@ -48,63 +100,125 @@ dirtylist_release(struct dirtylist *D) {
 	if (D == NULL)
 		return;
 	struct style_cache *C = D->C;
-	style_free(C, D->h, D->maxid * sizeof(struct dirtyhead));
-	style_free(C, D->p, D->cap * sizeof(struct dirtyslot));
+	paged_array_deinit(&D->h, C);
+	paged_array_deinit(&D->p, C);
+	paged_array_deinit(&D->f, C);
+	style_free(C, D->e, D->edge_cap * sizeof(struct dirtyedge));
 	style_free(C, D, sizeof(*D));
 }
 
 void
-dirtylist_add(struct dirtylist *D, int a, int b) {
-	int maxid = D->maxid;
-	while (a >= maxid || b >= maxid) {
-		maxid = maxid * 3 / 2;
-	}
-	if (maxid > D->maxid) {
-		D->h = (struct dirtyhead *)style_realloc(D->C, D->h, D->maxid * sizeof(struct dirtyhead),
-			maxid * sizeof(struct dirtyhead));
+dirtylist_reserve(struct dirtylist *D, int n) {
+	if (n > D->maxid) {
+		paged_array_reserve(&D->h, n, D->C);
+		int maxid = paged_array_cap(&D->h);
 		int i;
 		for (i=D->maxid;i<maxid;i++) {
-			D->h[i].head = -1;
-			D->h[i].version = 0;
+			init_head(HEAD(D, i));
 		}
 		D->maxid = maxid;
 	}
+}
+
+static inline void
+expand_head(struct dirtylist *D, int a, int b) {
+	int id = a > b ? a : b;
+	dirtylist_reserve(D, id + 1);
+}
+
+static void compact_(struct dirtylist *D);
+
+void
+dirtylist_add(struct dirtylist *D, int a, int b) {
+	expand_head(D, a, b);
+	if (D->freelist < 0 && D->n > STYLE_INDEX_MAX) {
+		// slot index is out of range, move all staging slots into compacted edges
+		compact_(D);
+	}
 	int index = D->freelist;
 	struct dirtyslot * p;
 	if (index >= 0) {
-		p = &D->p[index];
-		D->freelist = p->next;
+		p = SLOT(D, index);
+		D->freelist = style_index_get(p->next);
 	} else {
-		if (D->n >= D->cap) {
-			int cap = D->cap * 3 / 2;
-			D->p = (struct dirtyslot *)style_realloc(D->C, D->p, D->cap * sizeof(struct dirtyslot),
-				cap * sizeof(struct dirtyslot));
-			D->cap = cap;
-		}
 		index = D->n++;
-		p = &D->p[index];
+		paged_array_reserve(&D->p, D->n, D->C);
+		p = SLOT(D, index);
 	}
-	assert(a >= 0 && b >= 0);
-	struct dirtyhead * h = &D->h[a];
-	p->version = D->h[b].version;
+	assert(a >= 0 && b >= 0 && b <= STYLE_INDEX_MAX);
+	struct dirtyhead * h = HEAD(D, a);
+	p->version = HEAD(D, b)->version;
 	p->b = b;
 	p->next = h->head;
 	h->head = index;
+	++D->staged;
+}
+
+void
+dirtylist_add_frame(struct dirtylist *D, int a, int b) {
+	assert(a >= 0 && b >= 0);
+	expand_head(D, a, b);
+	int index = D->frame_n++;
+	paged_array_reserve(&D->f, D->frame_n, D->C);
+	struct frameslot *p = FRAME_SLOT(D, index);
+	struct dirtyhead *h = HEAD(D, a);
+	if (h->frame != D->frame) {
+		h->frame = D->frame;
+		h->frame_head = -1;
+	}
+	p->b = b;
+	p->next = h->frame_head;
+	h->frame_head = index;
+}
+
+void
+dirtylist_frame_reset(struct dirtylist *D) {
+	D->frame_n = 0;
+	if (++D->frame == 0) {
+		// frame counter wraps, clear all heads
+		int i;
+		for (i=0;i<D->maxid;i++) {
+			HEAD(D, i)->frame = 0;
+		}
+		D->frame = 1;
+	}
+}
+
+static int
+get_frame(struct dirtylist *D, struct dirtyhead *h, int n, int *output, int count) {
+	if (h->frame != D->frame)
+		return count;
+	int index = h->frame_head;
+	while (index >= 0) {
+		struct frameslot *p = FRAME_SLOT(D, index);
+		if (count < n)
+			output[count] = p->b;
+		++count;
+		index = p->next;
+	}
+	return count;
 }
 
 void
 dirtylist_clear(struct dirtylist *D, int a) {
-	assert(a >= 0 && a < D->maxid);
-	struct dirtyhead * h = &D->h[a];
+	assert(a >= 0);
+	if (a >= D->maxid) {
+		// never added, neither as a source nor as a dependent
+		return;
+	}
+	struct dirtyhead * h = HEAD(D, a);
 	++h->version;
-	int index = h->head;
+	D->stale += h->count;
+	h->count = 0;
+	int index = style_index_get(h->head);
 	if (index < 0)
 		return;
 	int freelist = index;
 	h->head = -1;
 	for (;;) {
-		struct dirtyslot * p = &D->p[index];
-		index = p->next;
+		struct dirtyslot * p = SLOT(D, index);
+		--D->staged;
+		index = style_index_get(p->next);
 		if (index < 0) {
 			p->next = D->freelist;
 			break;
@@ -115,35 +229,136 @@ dirtylist_clear(struct dirtylist *D, int a) {
 
 static inline int
 alive(struct dirtylist *D, struct dirtyslot * p) {
-	struct dirtyhead * h = &D->h[p->b];
+	struct dirtyhead * h = HEAD(D, p->b);
 	return h->version == p->version;
 }
 
+static inline int
+edge_alive(struct dirtylist *D, struct dirtyedge * e) {
+	return HEAD(D, e->b)->version == e->version;
+}
+
+static int
+get_edge(struct dirtylist *D, struct dirtyhead *h, int n, int *output) {
+	struct dirtyedge *e = D->e + h->begin;
+	int count = 0;
+	int i = 0;
+	while (i < h->count) {
+		if (edge_alive(D, &e[i])) {
+			if (count < n)
+				output[count] = e[i].b;
+			++count;
+			++i;
+		} else {
+			// drop stale edge, the range keeps contiguous
+			e[i] = e[--h->count];
+			++D->stale;
+		}
+	}
+	return count;
+}
+
 int
 dirtylist_get(struct dirtylist *D, int id, int n, int *output) {
-	assert (id >= 0 || id < D->maxid);
-	struct dirtyhead * h = &D->h[id];
-	int index = h->head;
-	if (index < 0)
+	assert(id >= 0);
+	if (id >= D->maxid)
 		return 0;
-	int *list = &h->head;
-	int count = 0;
+	struct dirtyhead * h = HEAD(D, id);
+	int count = get_edge(D, h, n, output);
+	int index = style_index_get(h->head);
+	if (index < 0)
+		return get_frame(D, h, n, output, count);
+	style_index_t *list = &h->head;
 	for (;;) {
-		struct dirtyslot * p = &D->p[index];
+		struct dirtyslot * p = SLOT(D, index);
 		if (alive(D, p)) {
 			if (count < n) {
-				output[count++] = p->b;
+				output[count] = p->b;
 			}
+			++count;
 			list = &p->next;
 		} else {
 			*list = p->next;
 			p->next = D->freelist;
 			D->freelist = index;
+			--D->staged;
 		}
-		index = *list;
+		index = style_index_get(*list);
 		if (index < 0)
-			return count;
+			return get_frame(D, h, n, output, count);
+	}
+}
+
+// move staging lists into compacted edges and drop stale edges
+static void
+compact_(struct dirtylist *D) {
+	int i;
+	int total = 0;
+	// count live edges of each node
+	for (i=0;i<D->maxid;i++) {
+		struct dirtyhead *h = HEAD(D, i);
+		int count = 0;
+		int j;
+		for (j=0;j<h->count;j++) {
+			if (edge_alive(D, &D->e[h->begin + j]))
+				++count;
+		}
+		int index = style_index_get(h->head);
+		while (index >= 0) {
+			struct dirtyslot *p = SLOT(D, index);
+			if (alive(D, p))
+				++count;
+			index = style_index_get(p->next);
+		}
+		total += count;
+	}
+	int cap = total < DIRTYLIST_INITSIZE ? DIRTYLIST_INITSIZE : total;
+	struct dirtyedge *e = (struct dirtyedge *)style_malloc(D->C, cap * sizeof(struct dirtyedge));
+	int n = 0;
+	for (i=0;i<D->maxid;i++) {
+		struct dirtyhead *h = HEAD(D, i);
+		int begin = n;
+		int j;
+		for (j=0;j<h->count;j++) {
+			struct dirtyedge *old = &D->e[h->begin + j];
+			if (edge_alive(D, old))
+				e[n++] = *old;
+		}
+		int index = style_index_get(h->head);
+		while (index >= 0) {
+			struct dirtyslot *p = SLOT(D, index);
+			if (alive(D, p)) {
+				e[n].version = p->version;
+				e[n].b = p->b;
+				++n;
+			}
+			index = style_index_get(p->next);
+		}
+		h->head = -1;
+		h->begin = begin;
+		h->count = n - begin;
 	}
+	assert(n == total);
+	style_free(D->C, D->e, D->edge_cap * sizeof(struct dirtyedge));
+	D->e = e;
+	D->edge_cap = cap;
+	D->edge_n = n;
+	D->stale = 0;
+	// all staging slots are free now
+	D->n = 0;
+	D->freelist = -1;
+	D->staged = 0;
+}
+
+void
+dirtylist_compact(struct dirtylist *D, int force) {
+	if (!force) {
+		int staged = D->staged >= DIRTYLIST_COMPACT_MIN && D->staged * 4 >= D->edge_n;
+		int stale = D->stale >= DIRTYLIST_COMPACT_MIN && D->stale * 2 >= D->edge_n;
+		if (!staged && !stale)
+			return;
+	}
+	compact_(D);
 }
 
 #include <stdio.h>
@@ -152,18 +367,23 @@ void
 dirtylist_dump(struct dirtylist *D) {
 	int i;
 	for (i=0;i<D->maxid;i++) {
-		struct dirtyhead * h = &D->h[i];
-		int index = h->head;
-		if (index >= 0) {
+		struct dirtyhead * h = HEAD(D, i);
+		int index = style_index_get(h->head);
+		if (index >= 0 || h->count > 0) {
 			printf("[%d] : ", i);
-			for (;;) {
-				struct dirtyslot *p = &D->p[index];
+			int j;
+			for (j=0;j<h->count;j++) {
+				struct dirtyedge *e = &D->e[h->begin + j];
+				if (edge_alive(D, e)) {
+					printf("%d ", e->b);
+				}
+			}
+			while (index >= 0) {
+				struct dirtyslot *p = SLOT(D, index);
 				if (alive(D, p)) {
 					printf("%d ", p->b);
 				}
-				index = p->next;
-				if (index < 0)
-					break;
+				index = style_index_get(p->next);
 			}
 			printf("\n");
 		}
@@ -205,13 +425,21 @@ main() {
 	print_list(D, 2);
 	dirtylist_dump(D);
 
+	dirtylist_compact(D, 1);
+	dirtylist_add(D, 0, 4);	// add 0->4
+	print_list(D, 0);
+
 	dirtylist_clear(D, 2);
 
 	print_list(D, 1);
 	print_list(D, 0);
 	dirtylist_dump(D);
 
+	dirtylist_compact(D, 1);
+	dirtylist_dump(D);
+
 	dirtylist_release(D);
+	style_deletecache(C);
 
 	return 0;
 }
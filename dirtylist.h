@@ -7,9 +7,13 @@ struct dirtylist;
 
 struct dirtylist * dirtylist_create(struct style_cache *C);
 void dirtylist_release(struct dirtylist *);
+void dirtylist_reserve(struct dirtylist *, int n);	// heads of id [0, n), grow with the nodes to avoid a large first touch
 void dirtylist_add(struct dirtylist *, int a, int b);
+void dirtylist_add_frame(struct dirtylist *, int a, int b);	// dropped by dirtylist_frame_reset
+void dirtylist_frame_reset(struct dirtylist *);
 void dirtylist_clear(struct dirtylist *, int a);
-int dirtylist_get(struct dirtylist *, int id, int n, int *output);
+int dirtylist_get(struct dirtylist *, int id, int n, int *output);	// return total count, may be larger than n
+void dirtylist_compact(struct dirtylist *, int force);	// compact when there are enough staging or stale edges
 void dirtylist_dump(struct dirtylist *);
 
 #endif
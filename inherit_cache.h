@@ -7,25 +7,30 @@
 #include <assert.h>
 #include "hash.h" 
 #include "style_alloc.h"
+#include "style_index.h"
 
-#define INHERIT_CACHE_INVALID_KEY 0xffffffff
+#define INHERIT_CACHE_INVALID_KEY ((style_uindex_t)~0)
 #define INHERIT_CACHE_SIZE (1<<13)// 8192, 13bits
 #define INHERIT_CACHE_SHIFT (32-13)
 
 struct inherit_entry {
-	uint32_t a;
-	uint32_t b;
-	uint32_t result;
+	style_uindex_t a;
+	style_uindex_t b;
+	style_uindex_t result;
 	uint32_t withmask : 1;
 	uint32_t a_version : 10;
 	uint32_t b_version : 10;
 	uint32_t r_version : 10;
 };
 
+// versions are stored in pages, so the first key of a large cache doesn't allocate (and copy) all of them
+#define INHERIT_VERSION_BITS 10
+#define INHERIT_VERSION_PAGE (1 << INHERIT_VERSION_BITS)
+
 struct inherit_cache {
 	struct inherit_entry s[INHERIT_CACHE_SIZE];
-	uint16_t *version;
-	int n;
+	uint16_t **version;	// NULL pages are not cached yet, all versions are 0
+	int npage;
 };
 
 static inline void
@@ -35,12 +40,43 @@ inherit_cache_init(struct inherit_cache *c) {
 		c->s[i].a = INHERIT_CACHE_INVALID_KEY;
 	}
 	c->version = NULL;
-	c->n = 0;
+	c->npage = 0;
 }
 
 static inline void
 inherit_cache_deinit(struct style_cache *C, struct inherit_cache *c) {
-	style_free(C, c->version, c->n * sizeof(uint16_t));
+	int i;
+	for (i=0;i<c->npage;i++) {
+		if (c->version[i])
+			style_free(C, c->version[i], INHERIT_VERSION_PAGE * sizeof(uint16_t));
+	}
+	style_free(C, c->version, c->npage * sizeof(uint16_t *));
+}
+
+// NULL if no key of the page is cached
+static inline uint16_t *
+inherit_version(struct inherit_cache *c, int key) {
+	int p = key >> INHERIT_VERSION_BITS;
+	if (p >= c->npage || c->version[p] == NULL)
+		return NULL;
+	return &c->version[p][key & (INHERIT_VERSION_PAGE - 1)];
+}
+
+// the page p of versions, allocated at the first use
+static inline uint16_t *
+inherit_cache_page(struct inherit_cache *c, int p, struct style_cache *C) {
+	if (p >= c->npage) {
+		int n = c->npage == 0 ? 16 : c->npage;
+		while (n <= p) n *= 2;
+		c->version = (uint16_t **)style_realloc(C, c->version, c->npage * sizeof(uint16_t *), n * sizeof(uint16_t *));
+		memset(c->version + c->npage, 0, (n - c->npage) * sizeof(uint16_t *));
+		c->npage = n;
+	}
+	if (c->version[p] == NULL) {
+		c->version[p] = (uint16_t *)style_malloc(C, INHERIT_VERSION_PAGE * sizeof(uint16_t));
+		memset(c->version[p], 0, INHERIT_VERSION_PAGE * sizeof(uint16_t));
+	}
+	return c->version[p];
 }
 
 static inline int
@@ -52,15 +88,17 @@ hash_inherit_combined_slot(int a, int b) {
 
 static inline int
 inherit_cache_fetch(struct inherit_cache *c, int a, int b, int withmask) {
-	if (a >= c->n || b >= c->n)
+	uint16_t *va = inherit_version(c, a);
+	uint16_t *vb = inherit_version(c, b);
+	if (va == NULL || vb == NULL)
 		return -1;
 	int v = hash_inherit_combined_slot(a,b);
 	struct inherit_entry *e = &c->s[v];
 
 	if (e->a == a && e->b == b 
-		&& e->a_version == c->version[a]
-		&& e->b_version == c->version[b]
-		&& e->r_version == c->version[e->result]
+		&& e->a_version == *va
+		&& e->b_version == *vb
+		&& e->r_version == *inherit_version(c, e->result)
 		&& e->withmask == withmask)
 		return e->result;
 	return -1;
@@ -78,43 +116,30 @@ clear_entry_with_key(struct inherit_cache *c, int key) {
 
 static inline void
 inherit_cache_retirekey(struct inherit_cache *c, int key) {
-	if (key >= c->n)
+	uint16_t *v = inherit_version(c, key);
+	if (v == NULL)
 		return;
-	if (++c->version[key] == 0) {
+	if (++*v == 0) {
 		clear_entry_with_key(c, key);
 	}
 }
 
-static inline void
-resize_inherit_cache(struct inherit_cache *c, int a, int b, int result, struct style_cache *C) {
-	int size = INHERIT_CACHE_SIZE;
-	if (c->n > size)
-		size = c->n;
-	while (size < a) size *= 2;
-	while (size < b) size *= 2;
-	while (size < result) size *= 2;
-	if (size > c->n) {
-		uint16_t * v = (uint16_t *)style_malloc(C, size * sizeof(uint16_t));
-		memset(v, 0, sizeof(uint16_t) * size);
-		memcpy(v, c->version, sizeof(uint16_t) * c->n);
-		style_free(C, c->version, c->n * sizeof(uint16_t));
-		c->version = v;
-		c->n = size;
-	}
+static inline uint16_t
+inherit_version_set_(struct inherit_cache *c, int key, struct style_cache *C) {
+	return inherit_cache_page(c, key >> INHERIT_VERSION_BITS, C)[key & (INHERIT_VERSION_PAGE - 1)];
 }
 
 static inline void
 inherit_cache_set(struct inherit_cache *c, int a, int b, int withmask, int result, struct style_cache *C) {
-	resize_inherit_cache(c, a, b, result, C);
 	int v = hash_inherit_combined_slot(a,b);
 	struct inherit_entry *e = &c->s[v];
 	e->a = a;
 	e->b = b;
 	e->result = result;
 	e->withmask = withmask;
-	e->a_version = c->version[a];
-	e->b_version = c->version[b];
-	e->r_version = c->version[result];
+	e->a_version = inherit_version_set_(c, a, C);
+	e->b_version = inherit_version_set_(c, b, C);
+	e->r_version = inherit_version_set_(c, result, C);
 }
 
 #endif
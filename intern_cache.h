@@ -8,6 +8,7 @@
 #include <assert.h>
 
 #include "style_alloc.h"
+#include "style_index.h"
 
 // #define TEST_INTERN
 
@@ -28,18 +29,39 @@ struct verify_cache {
 
 #endif
 
-#define INVALID_INDEX (~0)
+#define INVALID_INDEX ((style_uindex_t)~0)
 
-struct intern_cache {
+// the chains are stored in pages of 1 << INTERN_NEXT_BITS indexes, allocated when an index of the page is inserted
+#define INTERN_NEXT_BITS 10
+#define INTERN_NEXT_PAGE (1 << INTERN_NEXT_BITS)
+
+// slots moved from the old table to the new one in each intern_cache_insert()
+#define INTERN_CACHE_MIGRATE_STEP 4
+// slots of the next table cleared in each intern_cache_insert(), it's prepared in the last quarter before growth
+#define INTERN_CACHE_CLEAR_STEP 16
+
+struct intern_table {
 	int size;
 	int shift;
-	int collide_n;
+	style_uindex_t *index;	// 2x n hash map, the head of each chain
+};
+
+// Entries of a slot are chained by next[index], so insert and remove never move other entries.
+// When the cache grows, the old table is kept and moved into the new one a few slots at a time.
+// The new table is cleared a few slots at a time before, so no insert touches a whole table.
+struct intern_cache {
+	struct intern_table t;
+	struct intern_table old;	// valid when migrate >= 0
+	struct intern_table grow;	// valid when clear >= 0
+	int migrate;	// next slot of old table to move, -1 means no migration
+	int clear;	// next slot of grow table to clear, -1 means it's not allocated
 	int n;
-	uint32_t *index;	// 2x n hash map
-	uint32_t *collide;	// n collide array
+	int npage;
+	style_uindex_t **next;	// pages of chains shared by both tables, NULL when no index of the page is inserted
 	VERIFY_INTERN
 };
 
+#define INTERN_NEXT(c, index) (&(c)->next[(index) >> INTERN_NEXT_BITS][(index) & (INTERN_NEXT_PAGE - 1)])
 
 #ifdef TEST_INTERN
 
@@ -84,200 +106,218 @@ static inline void verify_remove(struct intern_cache *C, uint32_t index) {};
 
 struct intern_cache_iterator {
 	uint32_t result;
-	int collide;
+	int old;	// result is in the old table
 };
 
+// the slots are not cleared
 static inline void
-intern_cache_reinit_(struct style_cache *C, struct intern_cache *c, int bits) {
-	c->size =  1 << bits;
-	c->shift = 32 - bits - 1;
-	c->collide = (uint32_t *)style_malloc(C, c->size * 3 * sizeof(uint32_t));
-	c->index = c->collide + c->size;
-	c->collide_n = 0;
-	memset(c->index, 0xff, c->size * 2 * sizeof(uint32_t));
+intern_table_alloc_(struct style_cache *C, struct intern_table *t, int bits) {
+	t->size =  1 << bits;
+	t->shift = 32 - bits - 1;
+	t->index = (style_uindex_t *)style_malloc(C, t->size * 2 * sizeof(style_uindex_t));
+}
+
+static inline void
+intern_table_init_(struct style_cache *C, struct intern_table *t, int bits) {
+	intern_table_alloc_(C, t, bits);
+	memset(t->index, 0xff, t->size * 2 * sizeof(style_uindex_t));
+}
+
+static inline void
+intern_table_deinit_(struct style_cache *C, struct intern_table *t) {
+	style_free(C, t->index, t->size * 2 * sizeof(style_uindex_t));
 }
 
 static inline void
 intern_cache_init(struct style_cache *C, struct intern_cache *c, int bits) {
-	intern_cache_reinit_(C, c, bits);
+	intern_table_init_(C, &c->t, bits);
+	c->migrate = -1;
+	c->clear = -1;
+	c->npage = 0;
+	c->next = NULL;
 	verify_init(c);
 	c->n = 0;
 }
 
 static inline void
 intern_cache_deinit(struct style_cache *C, struct intern_cache *c) {
-	style_free(C, c->collide, c->size * 3 * sizeof(uint32_t));
+	intern_table_deinit_(C, &c->t);
+	if (c->migrate >= 0)
+		intern_table_deinit_(C, &c->old);
+	if (c->clear >= 0)
+		intern_table_deinit_(C, &c->grow);
+	int i;
+	for (i=0;i<c->npage;i++) {
+		if (c->next[i])
+			style_free(C, c->next[i], INTERN_NEXT_PAGE * sizeof(style_uindex_t));
+	}
+	style_free(C, c->next, c->npage * sizeof(style_uindex_t *));
+}
+
+// the page p of chains, allocated at the first use
+static inline style_uindex_t *
+intern_next_page(struct intern_cache *c, int p, struct style_cache *C) {
+	if (p >= c->npage) {
+		int n = c->npage == 0 ? 16 : c->npage;
+		while (n <= p) n *= 2;
+		c->next = (style_uindex_t **)style_realloc(C, c->next, c->npage * sizeof(style_uindex_t *), n * sizeof(style_uindex_t *));
+		memset(c->next + c->npage, 0, (n - c->npage) * sizeof(style_uindex_t *));
+		c->npage = n;
+	}
+	if (c->next[p] == NULL)
+		c->next[p] = (style_uindex_t *)style_malloc(C, INTERN_NEXT_PAGE * sizeof(style_uindex_t));
+	return c->next[p];
 }
 
 typedef uint32_t (*hash_get_func)(uint32_t index, void *ud);
 
-static inline void
-insert_(struct intern_cache *c, uint32_t index, int p) {
-	assert(c->collide_n < c->size);
-	memmove(c->collide + p + 1, c->collide + p, (c->collide_n - p) * sizeof(uint32_t));
-	c->collide[p] = index;
-	++c->collide_n;
+static inline uint32_t
+get_hash_(struct intern_table *t, uint32_t index, hash_get_func hash, void *ud) {
+	return hash(index, ud) >> t->shift;
 }
 
-static inline uint32_t
-get_hash_(struct intern_cache *c, uint32_t index, hash_get_func hash, void *ud) {
-	return hash(index, ud) >> c->shift;
+static inline void
+intern_cache_insert_(struct intern_cache *c, struct intern_table *t, uint32_t index, hash_get_func hash, void *ud) {
+	uint32_t h = get_hash_(t, index, hash, ud);
+	assert(t->index[h] != index);
+	*INTERN_NEXT(c, index) = t->index[h];
+	t->index[h] = index;
 }
 
+// move slot h of the old table (the whole chain) into the new table
 static inline void
-intern_cache_insert_(struct intern_cache *c, uint32_t index, hash_get_func hash, void *ud) {
-	uint32_t h = get_hash_(c, index, hash, ud);
-	if (c->index[h] != INVALID_INDEX) {
-		uint32_t cindex = c->index[h];
-		assert(cindex != index);
-		int begin = 0;
-		int end = c->collide_n;
-		while (begin < end) {
-			int mid = (begin + end) / 2;
-			uint32_t i = c->collide[mid];
-			uint32_t mid_h = get_hash_(c, i, hash, ud);
-			if (h == mid_h) {
-				assert(i != cindex);
-				insert_(c, cindex, mid);
-				c->index[h] = index;
-				return;
-			} else if (h < mid_h) {
-				end = mid;
-			} else {
-				begin = mid + 1;
-			}
-		}
-		insert_(c, cindex, begin);
+migrate_slot_(struct intern_cache *c, uint32_t h, hash_get_func hash, void *ud) {
+	uint32_t v = c->old.index[h];
+	c->old.index[h] = INVALID_INDEX;
+	while (v != INVALID_INDEX) {
+		uint32_t next = *INTERN_NEXT(c, v);
+		intern_cache_insert_(c, &c->t, v, hash, ud);
+		v = next;
 	}
-	c->index[h] = index;
 }
 
+// step < 0 : finish migration
 static inline void
-intern_cache_resize_(struct intern_cache *c, int bits, hash_get_func hash, void *ud, struct style_cache *C) {
-	uint32_t *index = c->index;
-	uint32_t *collide = c->collide;
-	int size = c->size;
-	int collide_n = c->collide_n;
-	intern_cache_reinit_(C, c, bits);
-	int i;
-	for (i=0;i<collide_n;i++) {
-		intern_cache_insert_(c, collide[i], hash, ud);
+intern_cache_migrate_(struct intern_cache *c, int step, hash_get_func hash, void *ud, struct style_cache *C) {
+	int end = c->old.size * 2;
+	while (c->migrate < end && step != 0) {
+		migrate_slot_(c, c->migrate++, hash, ud);
+		--step;
 	}
-	for (i=0;i<size*2;i++) {
-		if (index[i] != INVALID_INDEX) {
-			intern_cache_insert_(c, index[i], hash, ud);
-		}
+	if (c->migrate >= end) {
+		intern_table_deinit_(C, &c->old);
+		c->migrate = -1;
 	}
-	style_free(C, collide, size * 3 * sizeof(uint32_t));
+}
+
+// step < 0 : clear all the rest
+static inline void
+intern_cache_clear_(struct intern_cache *c, int step) {
+	int end = c->grow.size * 2;
+	int n = end - c->clear;
+	if (step >= 0 && n > step)
+		n = step;
+	memset(c->grow.index + c->clear, 0xff, n * sizeof(style_uindex_t));
+	c->clear += n;
 }
 
 static inline void
 intern_cache_insert(struct intern_cache *c, uint32_t index, hash_get_func hash, void *ud, struct style_cache *C) {
+	assert(index <= STYLE_INDEX_MAX);
 	verify_insert(c, index);
 	++c->n;
-	if (c->n >= c->size) {
-		int bits = 31 - c->shift;
-		intern_cache_resize_(c, bits+1, hash, ud, C);
+	intern_next_page(c, index >> INTERN_NEXT_BITS, C);
+	int bits = 31 - c->t.shift;
+	if (c->migrate >= 0) {
+		intern_cache_migrate_(c, INTERN_CACHE_MIGRATE_STEP, hash, ud, C);
+	} else if (c->clear >= 0) {
+		intern_cache_clear_(c, INTERN_CACHE_CLEAR_STEP);
+	} else if (c->n >= c->t.size - c->t.size / 4) {
+		intern_table_alloc_(C, &c->grow, bits+1);
+		c->clear = 0;
+	}
+	if (c->n >= c->t.size) {
+		// the previous migration and clearing should be done before, finish them anyway
+		if (c->migrate >= 0)
+			intern_cache_migrate_(c, -1, hash, ud, C);
+		if (c->clear < 0) {
+			intern_table_alloc_(C, &c->grow, bits+1);
+			c->clear = 0;
+		}
+		intern_cache_clear_(c, -1);
+		c->old = c->t;
+		c->t = c->grow;
+		c->clear = -1;
+		c->migrate = 0;
 	}
-	intern_cache_insert_(c, index, hash, ud);
+	intern_cache_insert_(c, &c->t, index, hash, ud);
 }
 
+// the chain of a slot may have other hashes, the caller compares the values
 static inline int
-lower_bound_(struct intern_cache *c, uint32_t h, int begin, int end, hash_get_func hash, void *ud) {
-	while (begin < end) {
-		int mid = (begin + end) / 2;
-		uint32_t i = c->collide[mid];
-		uint32_t mid_h = get_hash_(c, i, hash, ud);
-		if (h == mid_h) {
-			int bound = lower_bound_(c, h, begin, mid , hash, ud);
-			if (bound >= 0)
-				return bound;
-			else
-				return mid;
-		} else if (h < mid_h) {
-			end = mid;
-		} else {
-			begin = mid + 1;
-		}
-	}
-	return -1;
+intern_table_find_(struct intern_table *t, uint32_t h, struct intern_cache_iterator *iter) {
+	uint32_t v = t->index[h >> t->shift];
+	if (v == INVALID_INDEX)
+		return 0;
+	iter->result = v;
+	return 1;
 }
 
-// return 0 : not found
 static inline int
-intern_cache_find(struct intern_cache *c, uint32_t h, struct intern_cache_iterator *iter, hash_get_func hash, void *ud) {
-	h = h >> c->shift;
-	uint32_t v = c->index[h];
+intern_table_find_next_(struct intern_cache *c, struct intern_cache_iterator *iter) {
+	uint32_t v = *INTERN_NEXT(c, iter->result);
 	if (v == INVALID_INDEX)
 		return 0;
-	if (get_hash_(c, v, hash, ud) == h) {
-		iter->result = v;
-		iter->collide = -1;
+	iter->result = v;
+	return 1;
+}
+
+// return 0 : not found
+static inline int
+intern_cache_find(struct intern_cache *c, uint32_t h, struct intern_cache_iterator *iter, hash_get_func hash, void *ud) {
+	iter->old = 0;
+	if (intern_table_find_(&c->t, h, iter))
 		return 1;
-	}
-	iter->collide = lower_bound_(c, h, 0, c->collide_n, hash, ud);
-	if (iter->collide < 0)
+	if (c->migrate < 0)
 		return 0;
-	iter->result = c->collide[iter->collide];
-	return 1;
+	iter->old = 1;
+	return intern_table_find_(&c->old, h, iter);
 }
 
 static inline int
 intern_cache_find_next(struct intern_cache *c, struct intern_cache_iterator *iter, hash_get_func hash, void *ud) {
-	if (iter->collide < 0) {
-		uint32_t h = get_hash_(c, iter->result, hash, ud);
-		iter->collide = lower_bound_(c, h, 0, c->collide_n, hash, ud);
-		if (iter->collide < 0)
-			return 0;
-		iter->result = c->collide[iter->collide];
+	if (iter->old || c->migrate < 0)
+		return intern_table_find_next_(c, iter);
+	uint32_t h = hash(iter->result, ud);
+	if (intern_table_find_next_(c, iter))
 		return 1;
-	} else {
-		++iter->collide;
-		if (iter->collide >= c->collide_n)
-			return 0;
-		uint32_t h = get_hash_(c, iter->result, hash, ud);
-		iter->result = c->collide[iter->collide];
-		uint32_t nexth = get_hash_(c, iter->result, hash, ud);
-		return (h == nexth);
-	}
+	iter->old = 1;
+	return intern_table_find_(&c->old, h, iter);
 }
 
-static inline void
-remove_collide_(struct intern_cache *c, int cindex) {
-	assert(cindex < c->collide_n);
-	--c->collide_n;
-	memmove(c->collide + cindex, c->collide + cindex + 1, (c->collide_n - cindex) * sizeof(uint32_t));
+// unlink index from its chain in t, return 0 if it's not there
+static inline int
+remove_chain_(struct intern_cache *c, struct intern_table *t, uint32_t index, uint32_t h) {
+	style_uindex_t *link = &t->index[h >> t->shift];
+	while (*link != INVALID_INDEX) {
+		if (*link == index) {
+			*link = *INTERN_NEXT(c, index);
+			return 1;
+		}
+		link = INTERN_NEXT(c, *link);
+	}
+	return 0;
 }
 
 static inline void
 intern_cache_remove(struct intern_cache *c, uint32_t index, hash_get_func hash, void *ud) {
 	verify_remove(c, index);
-	struct intern_cache_iterator iter;
 	uint32_t h = hash(index, ud);
-	int found = 0;
-	if (intern_cache_find(c, h, &iter, hash, ud)) {
-		do {
-			if (iter.result == index) {
-				found = 1;
-				break;
-			}
-		} while (intern_cache_find_next(c, &iter, hash, ud));
-	}
+	int found = remove_chain_(c, &c->t, index, h);
+	if (!found && c->migrate >= 0)
+		found = remove_chain_(c, &c->old, index, h);
 	assert(found);
 	--c->n;
-	if (iter.collide < 0) {
-		uint32_t h = get_hash_(c, iter.result, hash, ud);
-		assert(c->index[h] == iter.result);
-		int cindex = lower_bound_(c, h, 0, c->collide_n, hash, ud);
-		if (cindex < 0) {
-			c->index[h] = INVALID_INDEX;
-		} else {
-			c->index[h] = c->collide[cindex];
-			remove_collide_(c, cindex);
-		}
-	} else {
-		remove_collide_(c, iter.collide);
-	}
 }
 
 #endif
@@ -0,0 +1,99 @@
+#ifndef paged_array_h
+#define paged_array_h
+
+#include <stddef.h>
+#include <assert.h>
+
+#include "style_alloc.h"
+
+// Elements are stored in fixed size pages, so growing never copies or moves them.
+// Only the page directory is reallocated, and it's one pointer per page.
+
+#define PAGED_ARRAY_BITS 10
+#define PAGED_ARRAY_PAGE (1 << PAGED_ARRAY_BITS)
+#define PAGED_ARRAY_MASK (PAGED_ARRAY_PAGE - 1)
+
+struct paged_array {
+	size_t esize;
+	int npage;
+	int dircap;
+	int borrow;	// pages [0, borrow) are borrowed from an image, not freed
+	void **page;
+};
+
+#define PAGED_ARRAY_GET(p, type, index) ((type *)(p)->page[(index) >> PAGED_ARRAY_BITS] + ((index) & PAGED_ARRAY_MASK))
+
+static inline void
+paged_array_init(struct paged_array *p, size_t esize) {
+	p->esize = esize;
+	p->npage = 0;
+	p->dircap = 0;
+	p->borrow = 0;
+	p->page = NULL;
+}
+
+static inline void
+paged_array_deinit(struct paged_array *p, struct style_cache *C) {
+	int i;
+	for (i=p->borrow;i<p->npage;i++) {
+		style_free(C, p->page[i], p->esize * PAGED_ARRAY_PAGE);
+	}
+	style_free(C, p->page, p->dircap * sizeof(void *));
+	p->npage = 0;
+	p->dircap = 0;
+	p->borrow = 0;
+	p->page = NULL;
+}
+
+static inline int
+paged_array_cap(struct paged_array *p) {
+	return p->npage << PAGED_ARRAY_BITS;
+}
+
+// add one page
+static inline void
+paged_array_grow(struct paged_array *p, struct style_cache *C) {
+	if (p->npage >= p->dircap) {
+		int cap = p->dircap == 0 ? 16 : p->dircap * 2;
+		p->page = (void **)style_realloc(C, p->page, p->dircap * sizeof(void *), cap * sizeof(void *));
+		assert(p->page != NULL);
+		p->dircap = cap;
+	}
+	void *page = style_malloc(C, p->esize * PAGED_ARRAY_PAGE);
+	assert(page != NULL);
+	p->page[p->npage++] = page;
+}
+
+// reserve the page directory for n elements without allocating pages.
+// The directory is not moved before it's full, so other threads can read elements while pages are added.
+static inline void
+paged_array_reserve_dir(struct paged_array *p, int n, struct style_cache *C) {
+	int cap = (n + PAGED_ARRAY_PAGE - 1) >> PAGED_ARRAY_BITS;
+	if (cap > p->dircap) {
+		p->page = (void **)style_realloc(C, p->page, p->dircap * sizeof(void *), cap * sizeof(void *));
+		assert(p->page != NULL);
+		p->dircap = cap;
+	}
+}
+
+// share the pages of from, p is empty
+static inline void
+paged_array_borrow(struct paged_array *p, const struct paged_array *from, struct style_cache *C) {
+	assert(p->npage == 0 && p->esize == from->esize);
+	paged_array_reserve_dir(p, from->npage << PAGED_ARRAY_BITS, C);
+	int i;
+	for (i=0;i<from->npage;i++) {
+		p->page[i] = from->page[i];
+	}
+	p->npage = p->borrow = from->npage;
+}
+
+// make sure [0, n) is addressable
+static inline void
+paged_array_reserve(struct paged_array *p, int n, struct style_cache *C) {
+	while (paged_array_cap(p) < n) {
+		paged_array_grow(p, C);
+	}
+}
+
+#endif
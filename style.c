@@ -2,6 +2,12 @@
 #include "attrib.h"
 #include "style_alloc.h"
 #include "dirtylist.h"
+#include "hash.h"
+#include "intern_cache.h"
+#include "paged_array.h"
+#include "style_index.h"
+#include "style_image.h"
+#include "style_journal.h"
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,38 +15,212 @@
 #include <assert.h>
 #include <stdio.h>
 
+#ifndef STYLE_NO_THREAD
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #define INVALID_NODE (~0)
-#define ARENA_DEFAULT_SIZE 1024
 
 #define MAX_KEY 128
+#define BATCH_DEFAULT_BITS 4
+#define INHERIT_DEFAULT_BITS 7
+#define DEFAULT_PARK_FRAMES 2	// the same as attribs
+#define EVAL_CHUNK 4096
+#define EVAL_BATCH 64
+#define EVAL_MAX_THREAD 64
+#define SNAPSHOT_PAGE_BITS 8
+#define SNAPSHOT_PAGE (1 << SNAPSHOT_PAGE_BITS)
+
+// A style is split into parallel arrays : style_cache.value (read by queries),
+// style_cache.edge (inherit graph) and style_cache.node (lifetime bookkeeping).
+
+struct style_edge {
+	style_index_t a;
+	style_index_t b;
+};
 
 // Every styles created in current frame are linked in .prev/.next
 // freelist linked in .next
-struct style {
-	int a;
-	int b;
-	attrib_t value;
-	int prev;
-	int next;
-	int refcount:31;
-	int withmask:1;
+// parked nodes are linked in style_park
+// transient nodes are in frame region, and not linked
+struct style_node {
+	style_index_t prev;
+	style_index_t next;
+	int refcount:29;
+	unsigned int withmask:1;
+	unsigned int parked:1;
+	unsigned int transient:1;
+};
+
+// the staged tuple of a value node, each id in .data holds a reference. .n < 0 : not staged
+struct batch_record {
+	int id;
+	int n;
+	int data[MAX_KEY];
+};
+
+struct style_batch {
+	int depth;
+	int n;
+	int cap;
+	struct batch_record *r;
+	struct intern_cache index;	// id -> record
+};
+
+// Unreferenced inherit nodes are parked in LRU order at style_flush, they keep their values and inputs,
+// so style_inherit can reuse them. They die after .frames flushes, or when they take more than .bytes (0 : no limit)
+struct style_park {
+	int head;	// the newest one
+	int tail;
+	int n;
+	int frames;
+	size_t bytes;
+	unsigned int frame;	// counted by style_flush
+	struct paged_array stamp;	// unsigned int, the frame when the node is parked
+};
+
+#define PARK_NODE_SIZE (sizeof(struct style_node) + sizeof(struct style_edge) + sizeof(attrib_t))
+
+// [base, base+cap) of style_cache.s is reserved for transient inherit nodes
+struct style_frame {
+	int base;
+	int cap;
+	int top;
+};
+
+// style_flush_async reclaims the dead nodes in a worker thread, .pending is guarded by .lock
+struct style_reclaim {
+#ifndef STYLE_NO_THREAD
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	int started;
+	int pending;
+	int quit;
+	int active;	// from style_flush_async to style_flush_wait, used in the thread of cache only
+	int dead;	// the dead list handed to the worker
+	int freelist;	// the slots freed by the worker, joined to C->freelist by style_flush_wait
+	int tail;
+};
+
+// nodes whose values may have changed since the last snapshot, a snapshot created from it reads only them
+struct style_changes {
+	int gen;	// bumped by each snapshot
+	int epoch;	// bumped by style_compact, which moves the handles
+	int limit;	// not recorded beyond it (the handles of the last snapshot), -1 : no snapshot
+	int n;
+	int cap;
+	int *id;
+};
+
+// The first change of a node after style_checkpoint saves its old content, the nodes after .n are new
+struct undo_record {
+	int id;
+	attrib_t value;	// holds a reference
+	struct style_edge edge;
+	struct style_node node;
+};
+
+struct style_undo {
+	int active;
+	int n;
+	int freelist;
+	int live;
+	int dead;
+	int top;
+	int park_head;
+	int park_tail;
+	int park_n;
+	int log_n;
+	int log_cap;
+	struct undo_record *log;
+	struct paged_array mark;	// char, set when the node is saved in .log
+	int mark_n;	// marks [0, mark_n) are initialized
 };
 
 struct style_cache {
 	style_alloc alloc;
 	void * alloc_ud;
 	struct attrib_state *A;
-	struct style *s;
+	struct style_cache *share;	// the next cache sharing A, itself when A is not shared
+	int flushed;	// flushed in the current frame of A
+	struct paged_array value;	// attrib_t
+	struct paged_array edge;	// struct style_edge
+	struct paged_array node;	// struct style_node
 	struct dirtylist *D;
 	style_handle_t empty;
 	int n;
-	int cap;
 	int freelist;
 	int live;
 	int dead;
+	struct style_batch batch;
+	struct intern_cache inherit_i;	// (a, b, withmask) -> inherit node
+	struct style_park park;
+	struct style_frame frame;
+	struct paged_array snapshot;	// struct snapshot_record *, indexed by attrib_t
+	struct style_changes changes;
+	struct paged_array level;	// int, scratch of style_eval_parallel, -1 out of it
+	int level_n;	// levels [0, level_n) are initialized
+	struct style_reclaim reclaim;
+	struct style_journal *journal;	// NULL when changes are not recorded
+	struct style_undo undo;
+	void *image;	// loaded by style_cache_load, the pages of arrays are borrowed from it
+	size_t image_sz;
 	unsigned char mask[MAX_KEY];
 };
 
+// Frozen values of a tuple, shared by snapshots.
+// It holds a reference of the tuple, so the attrib_t can't be reused while the record is alive.
+struct snapshot_record {
+	int refcount;
+	attrib_t a;
+	int n;
+	size_t size;
+	struct style_attrib kv[1];	// values are copied after kv[n]
+};
+
+// pages are copy on write, unchanged pages are shared with the previous snapshot
+struct snapshot_page {
+	int refcount;
+	struct snapshot_record *r[SNAPSHOT_PAGE];
+};
+
+struct snapshot_slot {
+	int id;
+	int i;
+};
+
+// h[] shared by the snapshots created from prev without h[]
+struct snapshot_handles {
+	int refcount;
+	int n;
+	int epoch;
+	style_handle_t *h;
+	struct snapshot_slot *slot;	// sorted by id, NULL until a snapshot reads the changes
+};
+
+struct style_snapshot {
+	struct style_cache *C;
+	struct snapshot_handles *handles;
+	int gen;
+	int n;
+	int npage;
+	struct snapshot_page *page[1];
+};
+
+#define VALUE(C, id) PAGED_ARRAY_GET(&(C)->value, attrib_t, id)
+#define EDGE(C, id) PAGED_ARRAY_GET(&(C)->edge, struct style_edge, id)
+#define NODE(C, id) PAGED_ARRAY_GET(&(C)->node, struct style_node, id)
+
 static void *
 default_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
 	if (nsize == 0) {
@@ -66,32 +246,168 @@ style_realloc(struct style_cache *c, void *ptr, size_t osize, size_t nsize) {
 	return c->alloc(c->alloc_ud, ptr, osize, nsize);
 }
 
+struct style_base {
+	struct attrib_base *A;
+	void *image;
+	size_t sz;
+};
+
+static void
+changes_init(struct style_changes *c) {
+	c->gen = 0;
+	c->epoch = 0;
+	c->limit = -1;
+	c->n = 0;
+	c->cap = 0;
+	c->id = NULL;
+}
+
+static void
+undo_init(struct style_undo *u) {
+	u->active = 0;
+	u->log_n = 0;
+	u->log_cap = 0;
+	u->log = NULL;
+	paged_array_init(&u->mark, sizeof(char));
+	u->mark_n = 0;
+}
+
+static void
+park_init(struct style_park *p) {
+	p->head = -1;
+	p->tail = -1;
+	p->n = 0;
+	p->frames = DEFAULT_PARK_FRAMES;
+	p->bytes = 0;
+	p->frame = 0;
+	paged_array_init(&p->stamp, sizeof(unsigned int));
+}
+
+// c->A is set by caller
+static struct style_cache *
+init_cache(struct style_cache *c) {
+	paged_array_init(&c->value, sizeof(attrib_t));
+	paged_array_init(&c->edge, sizeof(struct style_edge));
+	paged_array_init(&c->node, sizeof(struct style_node));
+	c->D = dirtylist_create(c);
+	c->n = 0;
+	c->freelist = -1;
+	c->live = -1;
+	c->dead = -1;
+	c->batch.depth = 0;
+	c->batch.n = 0;
+	c->batch.cap = 0;
+	c->batch.r = NULL;
+	intern_cache_init(c, &c->batch.index, BATCH_DEFAULT_BITS);
+	intern_cache_init(c, &c->inherit_i, INHERIT_DEFAULT_BITS);
+	park_init(&c->park);
+	c->flushed = 0;
+	c->frame.base = 0;
+	c->frame.cap = 0;
+	c->frame.top = 0;
+	paged_array_init(&c->snapshot, sizeof(struct snapshot_record *));
+	changes_init(&c->changes);
+	paged_array_init(&c->level, sizeof(int));
+	c->level_n = 0;
+	c->reclaim.started = 0;
+	c->reclaim.pending = 0;
+	c->reclaim.quit = 0;
+	c->reclaim.active = 0;
+	c->journal = NULL;
+	undo_init(&c->undo);
+	c->image = NULL;
+	c->image_sz = 0;
+	c->empty = style_create(c, 0, NULL);
+	return c;
+}
+
 struct style_cache *
-style_newcache(const unsigned char inherit_mask[128], style_alloc alloc, void *alloc_ud) {
+style_newcache_base(const unsigned char inherit_mask[128], const struct style_base *base, style_alloc alloc, void *alloc_ud) {
 	if (alloc == NULL) {
 		alloc = default_alloc;
 	}
 	struct style_cache * c = (struct style_cache *)alloc(alloc_ud, NULL, 0, sizeof(*c));
 	c->alloc = alloc;
 	c->alloc_ud = alloc_ud;
-	c->A = attrib_newstate(inherit_mask, c);
-	c->s = (struct style *)style_malloc(c, ARENA_DEFAULT_SIZE * sizeof(struct style));
-	c->D = dirtylist_create(c);
-	c->n = 0;
-	c->cap = ARENA_DEFAULT_SIZE;
-	c->freelist = -1;
-	c->live = -1;
-	c->dead = -1;
-	c->empty = style_create(c, 0, NULL);
+	c->A = attrib_newstate(inherit_mask, base ? base->A : NULL, c);
+	c->share = c;
+	return init_cache(c);
+}
+
+struct style_cache *
+style_newcache_shared(struct style_cache *from) {
+	// the worker of from may release tuples now
+	style_flush_wait(from);
+	struct style_cache * c = (struct style_cache *)from->alloc(from->alloc_ud, NULL, 0, sizeof(*c));
+	c->alloc = from->alloc;
+	c->alloc_ud = from->alloc_ud;
+	c->A = from->A;
+	c->share = from->share;
+	from->share = c;
+	init_cache(c);
+	c->park.frames = from->park.frames;
+	c->park.bytes = from->park.bytes;
 	return c;
 }
 
+struct style_cache *
+style_newcache(const unsigned char inherit_mask[128], style_alloc alloc, void *alloc_ud) {
+	return style_newcache_base(inherit_mask, NULL, alloc, alloc_ud);
+}
+
+static void reclaim_stop(struct style_cache *C);
+static void image_unmap(void *ptr, size_t sz, style_alloc alloc, void *ud);
+
+// A is used by other caches, release the tuples of c and leave the ring
+static void
+unshare(struct style_cache *c) {
+	int i;
+	for (i=0;i<c->n;i++) {
+		attrib_t *v = VALUE(c, i);
+		if (v->idx >= 0)
+			attrib_release(c->A, *v, c);
+	}
+	struct style_cache *prev = c->share;
+	while (prev->share != c)
+		prev = prev->share;
+	prev->share = c->share;
+	// the image of loaded cache is used by A
+	if (c->image) {
+		prev->image = c->image;
+		prev->image_sz = c->image_sz;
+		c->image = NULL;
+	}
+}
+
+static void undo_clear(struct style_cache *C);
+
 void
 style_deletecache(struct style_cache *c) {
 	if (c == NULL)
 		return;
-	style_free(c, c->s, c->cap * sizeof(struct style));
-	attrib_close(c->A, c);
+	reclaim_stop(c);
+	style_journal_release(c->journal);
+	undo_clear(c);
+	paged_array_deinit(&c->undo.mark, c);
+	style_free(c, c->undo.log, c->undo.log_cap * sizeof(struct undo_record));
+	int shared = c->share != c;
+	if (shared)
+		unshare(c);
+	paged_array_deinit(&c->value, c);
+	paged_array_deinit(&c->edge, c);
+	paged_array_deinit(&c->node, c);
+	paged_array_deinit(&c->snapshot, c);
+	style_free(c, c->changes.id, c->changes.cap * sizeof(int));
+	paged_array_deinit(&c->level, c);
+	paged_array_deinit(&c->park.stamp, c);
+	style_free(c, c->batch.r, c->batch.cap * sizeof(struct batch_record));
+	intern_cache_deinit(c, &c->batch.index);
+	intern_cache_deinit(c, &c->inherit_i);
+	if (!shared) {
+		attrib_close(c->A, c);
+		if (c->image)
+			image_unmap(c->image, c->image_sz, c->alloc, c->alloc_ud);
+	}
 	dirtylist_release(c->D);
 	style_free(c, c, sizeof(*c));
 }
@@ -101,29 +417,138 @@ style_null(struct style_cache *C) {
 	return C->empty;
 }
 
+static void
+reserve_style(struct style_cache *c, int n) {
+	int cap = c->n + n;
+	assert(cap - 1 <= STYLE_INDEX_MAX);
+	paged_array_reserve(&c->value, cap, c);
+	paged_array_reserve(&c->edge, cap, c);
+	paged_array_reserve(&c->node, cap, c);
+	dirtylist_reserve(c->D, cap);
+}
+
+// call it when the value of id is dropped or replaced, there may be duplicates
+static inline void
+change_record(struct style_cache *C, int id) {
+	struct style_changes *c = &C->changes;
+	if (c->n > c->limit)
+		return;
+	if (c->n >= c->cap) {
+		int newcap = c->cap == 0 ? 64 : c->cap * 2;
+		if (newcap > c->limit + 1)
+			newcap = c->limit + 1;
+		c->id = (int *)style_realloc(C, c->id, c->cap * sizeof(int), newcap * sizeof(int));
+		c->cap = newcap;
+	}
+	c->id[c->n++] = id;
+}
+
+static void
+undo_save(struct style_cache *C, int id) {
+	struct style_undo *u = &C->undo;
+	char *mark = PAGED_ARRAY_GET(&u->mark, char, id);
+	if (*mark)
+		return;
+	*mark = 1;
+	if (u->log_n >= u->log_cap) {
+		int newcap = u->log_cap == 0 ? 64 : u->log_cap * 3 / 2;
+		u->log = (struct undo_record *)style_realloc(C, u->log, u->log_cap * sizeof(struct undo_record), newcap * sizeof(struct undo_record));
+		u->log_cap = newcap;
+	}
+	struct undo_record *r = &u->log[u->log_n++];
+	r->id = id;
+	r->value = *VALUE(C, id);
+	if (r->value.idx >= 0)
+		attrib_addref(C->A, r->value);
+	r->edge = *EDGE(C, id);
+	r->node = *NODE(C, id);
+}
+
+// call it before the value, edge or node of id is changed
+static inline void
+undo_touch(struct style_cache *C, int id) {
+	if (C->undo.active && id < C->undo.n)
+		undo_save(C, id);
+}
+
 static int
 alloc_style(struct style_cache *c) {
 	if (c->freelist >= 0) {
 		int r = c->freelist;
-		struct style *s = &c->s[r];
-		c->freelist = s->next;
+		undo_touch(c, r);
+		c->freelist = style_index_get(NODE(c, r)->next);
 		return r;
 	}
-	if (c->n >= c->cap) {
-		int newcap = c->cap * 3 / 2;
-		c->s = (struct style *)style_realloc(c, c->s, c->cap * sizeof(struct style), newcap * sizeof(struct style));
-		c->cap = newcap;
-	}
+	reserve_style(c, 1);
 	return c->n++;
 }
 
+static inline int
+in_frame(struct style_cache *C, int id) {
+	return id >= C->frame.base && id < C->frame.base + C->frame.cap;
+}
+
+// slots of promoted nodes are skipped
+static int
+alloc_transient(struct style_cache *C) {
+	struct style_frame *f = &C->frame;
+	while (f->top < f->cap) {
+		int id = f->base + f->top++;
+		if (NODE(C, id)->transient) {
+			undo_touch(C, id);
+			return id;
+		}
+	}
+	return -1;
+}
+
+// between frames (after style_flush), the old region is freed and n == 0 turns frame mode off
+static void
+frame_mode_(struct style_cache *C, int n) {
+	struct style_frame *f = &C->frame;
+	assert(f->top == 0 && n >= 0 && !C->undo.active);
+	int i;
+	for (i=0;i<f->cap;i++) {
+		// promoted nodes are regular nodes from now on
+		int id = f->base + i;
+		struct style_node *s = NODE(C, id);
+		if (s->transient) {
+			s->refcount = -1;
+			s->transient = 0;
+			s->next = C->freelist;
+			C->freelist = id;
+		}
+	}
+	f->cap = 0;
+	if (n == 0)
+		return;
+	reserve_style(C, n);
+	f->base = C->n;
+	f->cap = n;
+	f->top = 0;
+	C->n += n;
+	for (i=0;i<n;i++) {
+		int id = f->base + i;
+		struct style_node *s = NODE(C, id);
+		EDGE(C, id)->a = -1;
+		EDGE(C, id)->b = -1;
+		VALUE(C, id)->idx = -1;
+		s->refcount = 0;
+		s->withmask = 0;
+		s->parked = 0;
+		s->transient = 1;
+	}
+}
+
 static void
 link_to(struct style_cache *C, int id, int *node) {
-	struct style *s = &C->s[id];
+	struct style_node *s = NODE(C, id);
+	undo_touch(C, id);
 	s->prev = -1;
 	s->next = *node;
 	if (*node >= 0) {
-		struct style *last = &C->s[*node];
+		undo_touch(C, *node);
+		struct style_node *last = NODE(C, *node);
 		last->prev = id;
 	}
 	*node = id;
@@ -131,65 +556,215 @@ link_to(struct style_cache *C, int id, int *node) {
 
 static void
 remove_from(struct style_cache *C, int id, int *node) {
-	struct style *s = &C->s[id];
-	if (s->next >= 0) {
-		struct style *n = &C->s[s->next];
+	struct style_node *s = NODE(C, id);
+	if (style_index_get(s->next) >= 0) {
+		undo_touch(C, s->next);
+		struct style_node *n = NODE(C, s->next);
 		n->prev = s->prev;
 	}
-	if (s->prev < 0) {
+	if (style_index_get(s->prev) < 0) {
 		assert(*node == id);
-		*node = s->next;
+		*node = style_index_get(s->next);
 	} else {
-		struct style *p = &C->s[s->prev];
+		undo_touch(C, s->prev);
+		struct style_node *p = NODE(C, s->prev);
 		p->next = s->next;
 	}
 }
 
+static void
+park_link(struct style_cache *C, int id) {
+	struct style_park *p = &C->park;
+	paged_array_reserve(&p->stamp, id + 1, C);
+	*PAGED_ARRAY_GET(&p->stamp, unsigned int, id) = p->frame;
+	link_to(C, id, &p->head);
+	if (p->tail < 0)
+		p->tail = id;
+	NODE(C, id)->parked = 1;
+	++p->n;
+}
+
+static void
+park_unlink(struct style_cache *C, int id) {
+	struct style_park *p = &C->park;
+	struct style_node *s = NODE(C, id);
+	undo_touch(C, id);
+	if (p->tail == id)
+		p->tail = style_index_get(s->prev);
+	remove_from(C, id, &p->head);
+	s->parked = 0;
+	--p->n;
+}
+
+// unlink the oldest parked node if it's expired (or all), return -1 if none
+static int
+park_expired(struct style_cache *C, int all) {
+	struct style_park *p = &C->park;
+	int id = p->tail;
+	if (id < 0)
+		return -1;
+	if (!all && !(p->bytes > 0 && p->n * PARK_NODE_SIZE > p->bytes)
+		&& !(p->frames >= 0 && p->frame - *PAGED_ARRAY_GET(&p->stamp, unsigned int, id) >= (unsigned int)p->frames))
+		return -1;
+	park_unlink(C, id);
+	return id;
+}
+
 int
 style_attrib_id(struct style_cache *C, const struct style_attrib *attrib) {
 	return attrib_entryid(C->A, attrib->key, attrib->data, attrib->sz, C);
 }
 
+int
+style_attrib_extern(struct style_cache *C, uint8_t key, void *ptr, size_t sz, uint32_t hash, const struct style_extern *ext) {
+	return attrib_entryid_extern(C->A, key, ptr, sz, hash, ext, C);
+}
+
 void
 style_attrib_value(struct style_cache *C, int id, struct style_attrib *attrib) {
+	assert(!C->reclaim.active);
 	attrib->data = attrib_entry_get(C->A, id, &attrib->key, &attrib->sz);
 }
 
 void
 style_attrib_addref(struct style_cache *C, int id) {
+	assert(!C->reclaim.active);
 	attrib_entry_addref(C->A, id);
 }
 
 void
 style_attrib_release(struct style_cache *C, int id) {
+	assert(!C->reclaim.active);
 	attrib_entry_release(C->A, id, C);
 }
 
+// The journal holds the attrib ids sent by JOURNAL_KV until JOURNAL_FLUSH (or JOURNAL_COMPACT),
+// so they can't be reused before the replica forgets them.
+struct style_journal {
+	struct style_cache *C;
+	struct journal_buffer b;
+	struct paged_array seen;	// int, indexed by attrib id, >= 0 : sent
+	struct paged_array held;	// int, the attrib ids sent
+	int held_n;
+};
+
+// slots out of cap are -1
+static int *
+map_slot(struct paged_array *p, int index, struct style_cache *C) {
+	int cap = paged_array_cap(p);
+	if (index >= cap) {
+		paged_array_reserve(p, index + 1, C);
+		int i;
+		for (i=cap;i<paged_array_cap(p);i++) {
+			*PAGED_ARRAY_GET(p, int, i) = -1;
+		}
+	}
+	return PAGED_ARRAY_GET(p, int, index);
+}
+
+static void
+journal_values(struct style_cache *C, int n, const int v[]) {
+	struct journal_buffer *b = &C->journal->b;
+	int i;
+	for (i=0;i<n;i++) {
+		journal_write_uint(b, v[i], C);
+	}
+}
+
+static void
+journal_record(struct style_cache *C, int op, int n, const int v[]) {
+	journal_write_uint(&C->journal->b, op, C);
+	journal_values(C, n, v);
+}
+
+static void
+journal_list(struct style_cache *C, int n, const int v[]) {
+	journal_write_uint(&C->journal->b, n, C);
+	journal_values(C, n, v);
+}
+
+// send the attribs not sent yet, before the record uses them
+static void
+journal_attribs(struct style_cache *C, int n, const int id[]) {
+	struct style_journal *J = C->journal;
+	int i;
+	for (i=0;i<n;i++) {
+		int *seen = map_slot(&J->seen, id[i], C);
+		if (*seen >= 0)
+			continue;
+		*seen = 1;
+		style_attrib_addref(C, id[i]);
+		*map_slot(&J->held, J->held_n++, C) = id[i];
+		struct style_attrib a;
+		style_attrib_value(C, id[i], &a);
+		int v[2] = { id[i], a.key };
+		journal_record(C, JOURNAL_KV, 2, v);
+		journal_write_data(&J->b, a.data, a.sz, C);
+	}
+}
+
+static void
+journal_forget(struct style_cache *C, int op) {
+	struct style_journal *J = C->journal;
+	if (op >= 0)
+		journal_record(C, op, 0, NULL);
+	int i;
+	for (i=0;i<J->held_n;i++) {
+		int id = *PAGED_ARRAY_GET(&J->held, int, i);
+		*PAGED_ARRAY_GET(&J->seen, int, id) = -1;
+		style_attrib_release(C, id);
+	}
+	J->held_n = 0;
+}
+
+void
+style_frame_mode(struct style_cache *C, int n) {
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_FRAME, 1, &n);
+	frame_mode_(C, n);
+}
+
 style_handle_t
 style_create(struct style_cache *C, int n, const int tmp[]) {
+	assert(!C->reclaim.active);
 	struct attrib_state *A = C->A;
 	attrib_t attr = attrib_create(A, n, tmp, C);
 	int id = alloc_style(C);
-	struct style *s = &C->s[id];
-	s->a = -1;
-	s->b = -1;
-	s->value = attr;
+	struct style_node *s = NODE(C, id);
+	EDGE(C, id)->a = -1;
+	EDGE(C, id)->b = -1;
+	*VALUE(C, id) = attr;
 	s->refcount = 1;
+	s->withmask = 0;
+	s->transient = 0;
+	s->parked = 0;
 
 	link_to(C, id, &C->live);
 
+	if (C->journal) {
+		journal_attribs(C, n, tmp);
+		journal_record(C, JOURNAL_CREATE, 1, &id);
+		journal_list(C, n, tmp);
+	}
 	style_handle_t r = { id };
 	return r;
 }
 
-static inline struct style *
+static inline struct style_node *
 get_style(struct style_cache *C, int index) {
 	assert(index >= 0 && index < C->n);
-	struct style * s = &C->s[index];
+	struct style_node * s = NODE(C, index);
 	assert(s->refcount >= 0);
 	return s;
 }
 
+static inline attrib_t *
+get_value_(struct style_cache *C, int index) {
+	assert(index >= 0 && index < C->n);
+	return VALUE(C, index);
+}
+
 #define DIRTYLIST_MAX 4096
 
 static void make_dirty_list(struct style_cache *C, int id);
@@ -199,10 +774,12 @@ make_dirty_(struct style_cache *C, int n, const int *array) {
 	int i;
 	for (i=0;i<n;i++) {
 		int index = array[i];
-		struct style *s = get_style(C, index);
-		if (s->value.idx >= 0) {
-			attrib_release(C->A, s->value, C);
-			s->value.idx = -1;
+		attrib_t *v = get_value_(C, index);
+		if (v->idx >= 0) {
+			undo_touch(C, index);
+			change_record(C, index);
+			attrib_release(C->A, *v, C);
+			v->idx = -1;
 			make_dirty_list(C, index);
 		}
 	}
@@ -223,37 +800,44 @@ make_dirty_list(struct style_cache *C, int id) {
 }
 
 static inline void
-make_dirty(struct style_cache *C, struct style *s, int id) {
-	(void)s;	// unused (reserved for debug)
+make_dirty(struct style_cache *C, int id) {
+	change_record(C, id);
 	make_dirty_list(C, id);
-	assert(s->value.idx >= 0);
+	assert(VALUE(C, id)->idx >= 0);
 }
 
 static inline int
-is_value(struct style_cache *C, struct style *s) {
-	return s->a < 0 && s->b < 0 && s->value.idx >= 0;
+is_value(struct style_cache *C, int id) {
+	struct style_edge *e = EDGE(C, id);
+	return style_index_get(e->a) < 0 && style_index_get(e->b) < 0 && VALUE(C, id)->idx >= 0;
 }
 
 static inline int
-is_combination(struct style_cache *C, struct style *s) {
-	return s->a >= 0 && s->b >= 0;
+is_combination(struct style_cache *C, int id) {
+	struct style_edge *e = EDGE(C, id);
+	return style_index_get(e->a) >= 0 && style_index_get(e->b) >= 0;
 }
 
-int
-style_modify(struct style_cache *C, style_handle_t h, int patch_n, int patch[], int removed_n, int removed_key[]) {
+// apply patch and removed_key to tmp[n], return new n or -1 (not changed)
+static int
+patch_attribs(struct style_cache *C, int tmp[MAX_KEY], int n, int patch_n, int patch[], int removed_n, int removed_key[]) {
 	struct attrib_state *A = C->A;
-	struct style *s = get_style(C, h.idx);
-	assert(is_value(C, s));
-	int tmp[MAX_KEY];
-	int n = attrib_get(A, s->value, tmp);
+	int map[MAX_KEY];
 	int i;
+	memset(map, 0xff, sizeof(map));
+	for (i=0;i<n;i++) {
+		uint8_t key;
+		attrib_entry_get(A, tmp[i], &key, NULL);
+		map[key] = i;
+	}
 	int change = 0;
 	for (i=0;i<patch_n;i++) {
-		struct style_attrib attr;
-		style_attrib_value(C, patch[i], &attr);
-		int index = attrib_find(A, s->value, attr.key);
+		uint8_t key;
+		attrib_entry_get(A, patch[i], &key, NULL);
+		int index = map[key];
 		if (index < 0) {
 			// new
+			map[key] = n;
 			tmp[n++] = patch[i];
 			assert(n <= MAX_KEY);
 			patch[i] = 1;
@@ -269,9 +853,11 @@ style_modify(struct style_cache *C, style_handle_t h, int patch_n, int patch[],
 		}
 	}
 	for (i=0;i<removed_n;i++) {
-		int index = attrib_find(A, s->value, removed_key[i]);
+		int key = removed_key[i];
+		int index = (key >= 0 && key < MAX_KEY) ? map[key] : -1;
 		if (index >= 0) {
 			tmp[index] = -1;
+			map[key] = -1;
 			removed_key[i] = 1;
 			change = 1;
 		} else {
@@ -279,7 +865,7 @@ style_modify(struct style_cache *C, style_handle_t h, int patch_n, int patch[],
 		}
 	}
 	if (!change)
-		return 0;
+		return -1;
 	int i2 = 0;
 	int n2 = n;
 	for (i=0;i<n && removed_n > 0;i++) {
@@ -290,77 +876,170 @@ style_modify(struct style_cache *C, style_handle_t h, int patch_n, int patch[],
 			--n2;
 		}
 	}
-	attrib_t new_attr = attrib_create(A, n2, tmp, C);
-	attrib_release(A, s->value, C);
-	s->value = new_attr;
-	make_dirty(C, s, h.idx);
+	return n2;
+}
+
+static struct batch_record * batch_find(struct style_cache *C, int id);
+static struct batch_record * batch_add(struct style_cache *C, int id);
+static void batch_stage(struct style_cache *C, struct batch_record *r, int n, const int data[]);
+
+int
+style_modify(struct style_cache *C, style_handle_t h, int patch_n, int patch[], int removed_n, int removed_key[]) {
+	assert(!C->reclaim.active);
+	struct attrib_state *A = C->A;
+	if (C->journal) {
+		journal_attribs(C, patch_n, patch);
+		journal_record(C, JOURNAL_MODIFY, 1, &h.idx);
+		journal_list(C, patch_n, patch);
+		journal_list(C, removed_n, removed_key);
+	}
+	get_style(C, h.idx);
+	assert(is_value(C, h.idx));
+	attrib_t *value = VALUE(C, h.idx);
+	if (C->batch.depth > 0) {
+		// patch the staging tuple, it will be interned at style_commit()
+		struct batch_record *r = batch_find(C, h.idx);
+		int tmp[MAX_KEY];
+		int n;
+		if (r) {
+			n = r->n;
+			memcpy(tmp, r->data, n * sizeof(int));
+		} else {
+			n = attrib_get(A, *value, tmp);
+		}
+		n = patch_attribs(C, tmp, n, patch_n, patch, removed_n, removed_key);
+		if (n < 0)
+			return 0;
+		if (r == NULL)
+			r = batch_add(C, h.idx);
+		batch_stage(C, r, n, tmp);
+		return 1;
+	}
+	int tmp[MAX_KEY];
+	int n = attrib_get(A, *value, tmp);
+	n = patch_attribs(C, tmp, n, patch_n, patch, removed_n, removed_key);
+	if (n < 0)
+		return 0;
+	attrib_t new_attr = attrib_create(A, n, tmp, C);
+	undo_touch(C, h.idx);
+	attrib_release(A, *value, C);
+	*value = new_attr;
+	make_dirty(C, h.idx);
 	return 1;
 }
 
+static void addref(struct style_cache *C, int index);
+
 void
 style_addref(struct style_cache *C, style_handle_t h) {
-	struct style *s = get_style(C, h.idx);
-	if (++s->refcount == 1) {
-		remove_from(C, h.idx, &C->dead);
-		link_to(C, h.idx, &C->live);
-	}
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_ADDREF, 1, &h.idx);
+	addref(C, h.idx);
 }
 
-void
-style_release(struct style_cache *C, style_handle_t h) {
-	struct style *s = get_style(C, h.idx);
+static void
+release_(struct style_cache *C, int id) {
+	struct style_node *s = get_style(C, id);
+	undo_touch(C, id);
 	if (--s->refcount <= 0) {
 		assert(s->refcount == 0);
-		remove_from(C, h.idx, &C->live);
-		link_to(C, h.idx, &C->dead);
+		remove_from(C, id, &C->live);
+		link_to(C, id, &C->dead);
 	}
 }
 
+void
+style_release(struct style_cache *C, style_handle_t h) {
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_RELEASE, 1, &h.idx);
+	release_(C, h.idx);
+}
+
 static void
 eval_(struct style_cache *C, style_handle_t h) {
-	struct style *s = get_style(C, h.idx);
-	if (s->value.idx >= 0)
+	attrib_t *v = get_value_(C, h.idx);
+	if (v->idx >= 0)
 		return;
-	assert(is_combination(C, s));
-	style_handle_t ah = { s->a };
+	assert(is_combination(C, h.idx));
+	struct style_edge *e = EDGE(C, h.idx);
+	style_handle_t ah = { e->a };
 	eval_(C, ah);
-	style_handle_t bh = { s->b };
+	style_handle_t bh = { e->b };
 	eval_(C, bh);
 
-	struct style *a = get_style(C, ah.idx);
-	struct style *b = get_style(C, bh.idx);
-
-	s->value = attrib_inherit(C->A, a->value, b->value, s->withmask, C);
+	undo_touch(C, h.idx);
+	*v = attrib_inherit(C->A, *VALUE(C, ah.idx), *VALUE(C, bh.idx), NODE(C, h.idx)->withmask, C);
 }
 
 int
 style_compare(struct style_cache *C, style_handle_t h, style_handle_t v) {
-	struct style *s = get_style(C, h.idx);
-	assert(is_value(C, s));
+	assert(!C->reclaim.active);
+	get_style(C, h.idx);
+	assert(is_value(C, h.idx));
 	eval_(C, v);
-	struct style *vv = get_style(C, v.idx);
-	return vv->value.idx != s->value.idx;
+	return VALUE(C, v.idx)->idx != VALUE(C, h.idx)->idx;
+}
+
+int
+style_compare_shared(struct style_cache *C, style_handle_t h, struct style_cache *O, style_handle_t v) {
+	assert(!C->reclaim.active);
+	assert(C->A == O->A);
+	eval_(C, h);
+	eval_(O, v);
+	return VALUE(O, v.idx)->idx != VALUE(C, h.idx)->idx;
 }
 
 int
 style_assign(struct style_cache *C, style_handle_t h, style_handle_t v) {
+	assert(!C->reclaim.active);
+	if (C->journal) {
+		int r[2] = { h.idx, v.idx };
+		journal_record(C, JOURNAL_ASSIGN, 2, r);
+	}
+	if (C->batch.depth > 0) {
+		// stage the tuple of v as style_modify does, it's assigned at style_commit()
+		get_style(C, h.idx);
+		assert(is_value(C, h.idx));
+		eval_(C, v);
+		struct batch_record *r = batch_find(C, h.idx);
+		int tmp[MAX_KEY];
+		int n = attrib_get(C->A, *VALUE(C, v.idx), tmp);
+		if (r == NULL) {
+			if (VALUE(C, v.idx)->idx == VALUE(C, h.idx)->idx)
+				return 0;
+			r = batch_add(C, h.idx);
+		} else if (r->n == n && memcmp(r->data, tmp, n * sizeof(int)) == 0) {
+			return 0;
+		}
+		batch_stage(C, r, n, tmp);
+		return 1;
+	}
 	if (style_compare(C, h, v)) {
-		struct style *vv = get_style(C, v.idx);
-		attrib_t attr = attrib_addref(C->A, vv->value);
-		struct style *s = get_style(C, h.idx);
-		attrib_release(C->A, s->value, C);
-		s->value = attr;
-		make_dirty(C, s, h.idx);
+		attrib_t attr = attrib_addref(C->A, *VALUE(C, v.idx));
+		undo_touch(C, h.idx);
+		attrib_release(C->A, *VALUE(C, h.idx), C);
+		*VALUE(C, h.idx) = attr;
+		make_dirty(C, h.idx);
 		return 1;
 	}
 	return 0;
 }
 
-static inline void
+static void promote(struct style_cache *C, int id);
+
+static void
 addref(struct style_cache *C, int index) {
-	struct style *p = get_style(C, index);
+	struct style_node *p = get_style(C, index);
+	undo_touch(C, index);
+	if (p->transient)
+		promote(C, index);
 	if (++p->refcount == 1) {
-		remove_from(C, index, &C->dead);
+		if (p->parked)
+			park_unlink(C, index);
+		else
+			remove_from(C, index, &C->dead);
 		link_to(C, index, &C->live);
 	}
 }
@@ -372,38 +1051,357 @@ add_affect(struct style_cache *C, int a, int b) {
 	dirtylist_add(C->D, a, b);
 }
 
-style_handle_t
-style_inherit(struct style_cache *C, style_handle_t child, style_handle_t parent, int with_mask) {
-	int id = alloc_style(C);
-	struct style *s = &C->s[id];
-	s->a = child.idx;
-	s->b = parent.idx;
-	s->value.idx = -1;
+static inline uint32_t
+inherit_hash(int a, int b, int withmask) {
+	int v[3] = { a, b, withmask };
+	return array_hash(v, 3);
+}
+
+static uint32_t
+inherit_hash_(uint32_t index, void *ud) {
+	struct style_cache *C = (struct style_cache *)ud;
+	struct style_edge *e = EDGE(C, index);
+	return inherit_hash(e->a, e->b, NODE(C, index)->withmask);
+}
+
+#define INHERIT_HASH(C) inherit_hash_, C
+
+static int
+inherit_find(struct style_cache *C, int a, int b, int withmask) {
+	struct intern_cache_iterator iter;
+	if (intern_cache_find(&C->inherit_i, inherit_hash(a, b, withmask), &iter, INHERIT_HASH(C))) {
+		do {
+			struct style_edge *e = EDGE(C, iter.result);
+			if (e->a == a && e->b == b && NODE(C, iter.result)->withmask == withmask)
+				return iter.result;
+		} while (intern_cache_find_next(&C->inherit_i, &iter, INHERIT_HASH(C)));
+	}
+	return -1;
+}
+
+static style_handle_t
+inherit_(struct style_cache *C, style_handle_t child, style_handle_t parent, int with_mask) {
+	int id = inherit_find(C, child.idx, parent.idx, with_mask);
+	if (id >= 0) {
+		// reuse the node (and its value) created before, a parked one is in use in this frame again
+		if (NODE(C, id)->parked) {
+			park_unlink(C, id);
+			link_to(C, id, &C->dead);
+		}
+		style_handle_t r = { id };
+		return r;
+	}
+	if (C->frame.cap > 0) {
+		id = alloc_transient(C);
+		if (id >= 0) {
+			// transient node holds no reference, it's dropped at style_flush() unless promoted
+			struct style_node *s = NODE(C, id);
+			EDGE(C, id)->a = child.idx;
+			EDGE(C, id)->b = parent.idx;
+			VALUE(C, id)->idx = -1;
+			s->refcount = 0;
+			s->withmask = with_mask;
+			dirtylist_add_frame(C->D, child.idx, id);
+			dirtylist_add_frame(C->D, parent.idx, id);
+			// it's removed at frame_reset()
+			intern_cache_insert(&C->inherit_i, id, INHERIT_HASH(C), C);
+			style_handle_t r = { id };
+			return r;
+		}
+	}
+	id = alloc_style(C);
+	struct style_node *s = NODE(C, id);
+	EDGE(C, id)->a = child.idx;
+	EDGE(C, id)->b = parent.idx;
+	VALUE(C, id)->idx = -1;
 	s->refcount = 0;
 	s->withmask = with_mask;
+	s->transient = 0;
+	s->parked = 0;
 
 	link_to(C, id, &C->dead);
 
 	addref(C, child.idx);
 	addref(C, parent.idx);
 
-	add_affect(C, s->a, id);
-	add_affect(C, s->b, id);
+	add_affect(C, child.idx, id);
+	add_affect(C, parent.idx, id);
+
+	intern_cache_insert(&C->inherit_i, id, INHERIT_HASH(C), C);
 
 	style_handle_t r = { id };
 	return r;
 }
 
-static attrib_t
-get_value(struct style_cache *C, style_handle_t h) {
-	struct style *s = get_style(C, h.idx);
-	if (s->value.idx < 0)
-		eval_(C, h);
-	return s->value;
+// transient node gains a reference, turn it into a regular inherit node (in place)
+static void
+promote(struct style_cache *C, int id) {
+	struct style_node *s = NODE(C, id);
+	struct style_edge *e = EDGE(C, id);
+	assert(s->transient && s->refcount == 0);
+	s->transient = 0;
+	link_to(C, id, &C->dead);
+
+	addref(C, e->a);
+	addref(C, e->b);
+
+	add_affect(C, e->a, id);
+	add_affect(C, e->b, id);
+}
+
+// release the values of transient nodes, and drop all of them.
+// Transient nodes in use (.a >= 0) are keyed in inherit_i.
+// Only the frame edges are dropped at once, the sweep is linear to top (the slots allocated in this frame),
+// it's paid once for each node created by style_inherit, not for the whole region
+static void
+frame_reset(struct style_cache *C) {
+	struct style_frame *f = &C->frame;
+	int i;
+	for (i=0;i<f->top;i++) {
+		int id = f->base + i;
+		if (!NODE(C, id)->transient)
+			continue;
+		attrib_t *v = VALUE(C, id);
+		if (v->idx >= 0) {
+			change_record(C, id);
+			attrib_release(C->A, *v, C);
+			v->idx = -1;
+		}
+		struct style_edge *e = EDGE(C, id);
+		if (style_index_get(e->a) >= 0) {
+			intern_cache_remove(&C->inherit_i, id, INHERIT_HASH(C));
+			e->a = -1;
+		}
+	}
+	f->top = 0;
+	dirtylist_frame_reset(C->D);
+}
+
+static uint32_t
+batch_hash_(uint32_t index, void *ud) {
+	struct style_batch *b = (struct style_batch *)ud;
+	return int32_hash(b->r[index].id);
+}
+
+#define BATCH_HASH(C) batch_hash_, &C->batch
+
+static struct batch_record *
+batch_find(struct style_cache *C, int id) {
+	struct style_batch *b = &C->batch;
+	struct intern_cache_iterator iter;
+	if (intern_cache_find(&b->index, int32_hash(id), &iter, BATCH_HASH(C))) {
+		do {
+			struct batch_record *r = &b->r[iter.result];
+			if (r->id == id)
+				return r;
+		} while (intern_cache_find_next(&b->index, &iter, BATCH_HASH(C)));
+	}
+	return NULL;
+}
+
+static struct batch_record *
+batch_add(struct style_cache *C, int id) {
+	struct style_batch *b = &C->batch;
+	if (b->n >= b->cap) {
+		int newcap = b->cap == 0 ? (1 << BATCH_DEFAULT_BITS) : b->cap * 3 / 2;
+		b->r = (struct batch_record *)style_realloc(C, b->r, b->cap * sizeof(struct batch_record), newcap * sizeof(struct batch_record));
+		b->cap = newcap;
+	}
+	int index = b->n++;
+	struct batch_record *r = &b->r[index];
+	r->id = id;
+	r->n = -1;
+	intern_cache_insert(&b->index, index, BATCH_HASH(C), C);
+	return r;
+}
+
+// the staged ids may be released by their owners before style_commit()
+static void
+batch_stage(struct style_cache *C, struct batch_record *r, int n, const int data[]) {
+	int i;
+	for (i=0;i<n;i++) {
+		attrib_entry_addref(C->A, data[i]);
+	}
+	for (i=0;i<r->n;i++) {
+		attrib_entry_release(C->A, r->data[i], C);
+	}
+	memcpy(r->data, data, n * sizeof(int));
+	r->n = n;
+}
+
+style_handle_t
+style_inherit(struct style_cache *C, style_handle_t child, style_handle_t parent, int with_mask) {
+	assert(!C->reclaim.active);
+	with_mask = (with_mask != 0);
+	style_handle_t r = inherit_(C, child, parent, with_mask);
+	if (C->journal) {
+		int v[4] = { r.idx, child.idx, parent.idx, with_mask };
+		journal_record(C, JOURNAL_INHERIT, 4, v);
+	}
+	return r;
+}
+
+void
+style_begin(struct style_cache *C) {
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_BEGIN, 0, NULL);
+	++C->batch.depth;
+}
+
+void
+style_commit(struct style_cache *C) {
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_COMMIT, 0, NULL);
+	struct style_batch *b = &C->batch;
+	assert(b->depth > 0);
+	if (--b->depth > 0)
+		return;
+	struct attrib_state *A = C->A;
+	int i, j;
+	for (i=0;i<b->n;i++) {
+		struct batch_record *r = &b->r[i];
+		attrib_t *value = get_value_(C, r->id);
+		attrib_t v = attrib_create(A, r->n, r->data, C);
+		for (j=0;j<r->n;j++) {
+			attrib_entry_release(A, r->data[j], C);
+		}
+		if (v.idx == value->idx) {
+			// patched back to the original value
+			attrib_release(A, v, C);
+			continue;
+		}
+		undo_touch(C, r->id);
+		attrib_release(A, *value, C);
+		*value = v;
+		// nodes already dirty are skipped, so each dependent is visited once
+		make_dirty(C, r->id);
+	}
+	for (i=0;i<b->n;i++) {
+		intern_cache_remove(&b->index, i, BATCH_HASH(C));
+	}
+	b->n = 0;
+}
+
+void
+style_checkpoint(struct style_cache *C) {
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_CHECKPOINT, 0, NULL);
+	struct style_undo *u = &C->undo;
+	assert(!u->active && C->batch.depth == 0);
+	// the worker of style_flush_async changes the dead list
+	style_flush_wait(C);
+	paged_array_reserve(&u->mark, C->n, C);
+	int cap = paged_array_cap(&u->mark);
+	for (;u->mark_n < cap;u->mark_n += PAGED_ARRAY_PAGE) {
+		memset(PAGED_ARRAY_GET(&u->mark, char, u->mark_n), 0, PAGED_ARRAY_PAGE);
+	}
+	u->active = 1;
+	u->n = C->n;
+	u->freelist = C->freelist;
+	u->live = C->live;
+	u->dead = C->dead;
+	u->top = C->frame.top;
+	u->park_head = C->park.head;
+	u->park_tail = C->park.tail;
+	u->park_n = C->park.n;
+}
+
+// release the saved values, and forget the log
+static void
+undo_clear(struct style_cache *C) {
+	struct style_undo *u = &C->undo;
+	int i;
+	for (i=0;i<u->log_n;i++) {
+		struct undo_record *r = &u->log[i];
+		*PAGED_ARRAY_GET(&u->mark, char, r->id) = 0;
+		if (r->value.idx >= 0)
+			attrib_release(C->A, r->value, C);
+	}
+	u->log_n = 0;
+	u->active = 0;
+}
+
+void
+style_checkpoint_end(struct style_cache *C) {
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_CHECKPOINT_END, 0, NULL);
+	assert(C->undo.active);
+	undo_clear(C);
+}
+
+// the node is allocated after the checkpoint, drop its dependents and its inherit key
+static void
+undo_drop(struct style_cache *C, int id) {
+	dirtylist_clear(C->D, id);
+	if (style_index_get(EDGE(C, id)->a) >= 0)
+		intern_cache_remove(&C->inherit_i, id, INHERIT_HASH(C));
+}
+
+void
+style_rollback(struct style_cache *C) {
+	assert(!C->reclaim.active);
+	if (C->journal)
+		journal_record(C, JOURNAL_ROLLBACK, 0, NULL);
+	struct style_undo *u = &C->undo;
+	assert(u->active && C->batch.depth == 0);
+	int i;
+	// inherit keys are hashed by the edges, remove them before the edges are restored
+	for (i=u->n;i<C->n;i++) {
+		undo_drop(C, i);
+		attrib_t *v = VALUE(C, i);
+		if (v->idx >= 0) {
+			attrib_release(C->A, *v, C);
+			v->idx = -1;
+		}
+	}
+	for (i=0;i<u->log_n;i++) {
+		struct undo_record *r = &u->log[i];
+		struct style_node *s = NODE(C, r->id);
+		if (r->node.refcount < 0 || (r->node.transient && style_index_get(r->edge.a) < 0)) {
+			undo_drop(C, r->id);
+		} else if (r->node.transient && !s->transient) {
+			// promoted after the checkpoint, it's keyed as a transient node before
+			dirtylist_clear(C->D, r->id);
+		}
+	}
+	for (i=0;i<u->log_n;i++) {
+		struct undo_record *r = &u->log[i];
+		attrib_t *v = VALUE(C, r->id);
+		change_record(C, r->id);
+		if (v->idx >= 0)
+			attrib_release(C->A, *v, C);
+		*v = r->value;
+		r->value.idx = -1;
+		*EDGE(C, r->id) = r->edge;
+		*NODE(C, r->id) = r->node;
+	}
+	C->n = u->n;
+	C->freelist = u->freelist;
+	C->live = u->live;
+	C->dead = u->dead;
+	C->park.head = u->park_head;
+	C->park.tail = u->park_tail;
+	C->park.n = u->park_n;
+	// the frame edges of reverted transient nodes are kept until style_flush, they only dirty the nodes more
+	C->frame.top = u->top;
+	undo_clear(C);
+}
+
+static attrib_t
+get_value(struct style_cache *C, style_handle_t h) {
+	attrib_t *v = get_value_(C, h.idx);
+	if (v->idx < 0)
+		eval_(C, h);
+	return *v;
 }
 
 int
 style_find(struct style_cache *C, style_handle_t h, uint8_t key) {
+	assert(!C->reclaim.active);
 	attrib_t a = get_value(C, h);
 	int index = attrib_find(C->A, a, key);
 	if (index < 0)
@@ -412,149 +1410,3073 @@ style_find(struct style_cache *C, style_handle_t h, uint8_t key) {
 }
 
 static void
-dump_key(int indent, struct style_cache *C, int style_id, uint8_t key, char fmt) {
-	if (style_id < 0)
-		return;
-	printf("%*s[%d] ", indent, "", style_id);
-	struct style *s = get_style(C, style_id);
-	if (s->value.idx < 0) {
-		printf("DIRTY\n");
-	} else {
-		attrib_t a = s->value;
-		int index = attrib_find(C->A, a, key);
-		if (index < 0) {
-			printf("%d\n", a.idx);
-		} else {
-			int id = attrib_index(C->A, a, index);
-			struct style_attrib attr;
-			style_attrib_value(C, id, &attr);
-			void *p = attr.data;
-			printf("%d : ", a.idx);
-			switch (fmt) {
-			case 's':
-				printf("%s", (const char *)p);
-				break;
-			case 'd':
-				printf("%d", *(int *)p);
-				break;
-			case 'x':
-				printf("%p", *(void **)p);
-				break;
-			case 'f':
-				printf("%f", *(float *)p);
-				break;
-			case 'F':
-				printf("%lf", *(double *)p);
-				break;
-			case 'p':
-			default:
-				printf("%p", p);
-				break;
-			}
-			printf("\n");
+dump_key(int indent, struct style_cache *C, int style_id, uint8_t key, char fmt) {
+	if (style_id < 0)
+		return;
+	printf("%*s[%d] ", indent, "", style_id);
+	get_style(C, style_id);
+	attrib_t a = *VALUE(C, style_id);
+	if (a.idx < 0) {
+		printf("DIRTY\n");
+	} else {
+		int index = attrib_find(C->A, a, key);
+		if (index < 0) {
+			printf("%d\n", a.idx);
+		} else {
+			int id = attrib_index(C->A, a, index);
+			struct style_attrib attr;
+			style_attrib_value(C, id, &attr);
+			void *p = attr.data;
+			printf("%d : ", a.idx);
+			switch (fmt) {
+			case 's':
+				printf("%s", (const char *)p);
+				break;
+			case 'd':
+				printf("%d", *(int *)p);
+				break;
+			case 'x':
+				printf("%p", *(void **)p);
+				break;
+			case 'f':
+				printf("%f", *(float *)p);
+				break;
+			case 'F':
+				printf("%lf", *(double *)p);
+				break;
+			case 'p':
+			default:
+				printf("%p", p);
+				break;
+			}
+			printf("\n");
+		}
+	}
+	dump_key(indent+2, C, style_index_get(EDGE(C, style_id)->a), key, fmt);
+	dump_key(indent+2, C, style_index_get(EDGE(C, style_id)->b), key, fmt);
+}
+
+void
+style_dump_key(struct style_cache *C, style_handle_t h, uint8_t key, char fmt) {
+	assert(!C->reclaim.active);
+	dump_key(0, C, h.idx, key, fmt);
+}
+
+int
+style_index(struct style_cache *C, style_handle_t h, int i) {
+	assert(!C->reclaim.active);
+	attrib_t a = get_value(C, h);
+	return attrib_index(C->A, a, i);
+}
+
+int
+style_find_many(struct style_cache *C, style_handle_t h, int n, const uint8_t keys[], int output[]) {
+	assert(!C->reclaim.active);
+	attrib_t a = get_value(C, h);
+	return attrib_find_many(C->A, a, n, keys, output);
+}
+
+int
+style_export(struct style_cache *C, style_handle_t h, struct style_attrib output[MAX_KEY]) {
+	assert(!C->reclaim.active);
+	attrib_t a = get_value(C, h);
+	int tmp[MAX_KEY];
+	int n = attrib_get(C->A, a, tmp);
+	int i;
+	for (i=0;i<MAX_KEY;i++) {
+		output[i].data = NULL;
+		output[i].sz = 0;
+		output[i].key = i;
+	}
+	for (i=0;i<n;i++) {
+		uint8_t key;
+		size_t sz;
+		void *data = attrib_entry_get(C->A, tmp[i], &key, &sz);
+		struct style_attrib *attr = &output[key];
+		attr->data = data;
+		attr->sz = sz;
+	}
+	return n;
+}
+
+struct schema_field {
+	uint8_t key;
+	uint32_t offset;
+	uint32_t sz;
+	uint32_t def;	// offset of default value in defaults
+};
+
+// fields are sorted by key, so style_fetch can merge them with the sorted tuple
+struct style_schema {
+	int n;
+	size_t size;
+	uint8_t *defaults;
+	struct schema_field f[1];
+};
+
+static int
+schema_field_compare(const void *a, const void *b) {
+	const struct schema_field *fa = (const struct schema_field *)a;
+	const struct schema_field *fb = (const struct schema_field *)b;
+	if (fa->key != fb->key)
+		return (int)fa->key - (int)fb->key;
+	// keep the declaration order of the same key (def is increasing)
+	return fa->def < fb->def ? -1 : (fa->def > fb->def);
+}
+
+struct style_schema *
+style_schema_create(struct style_cache *C, int n, const struct style_schema_field f[]) {
+	assert(!C->reclaim.active);
+	size_t defsz = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		assert(f[i].key < MAX_KEY);
+		defsz += f[i].sz;
+	}
+	size_t sz = sizeof(struct style_schema) + n * sizeof(struct schema_field) - sizeof(struct schema_field);
+	struct style_schema *S = (struct style_schema *)style_malloc(C, sz + defsz);
+	S->n = n;
+	S->size = sz + defsz;
+	S->defaults = (uint8_t *)S + sz;
+	defsz = 0;
+	for (i=0;i<n;i++) {
+		struct schema_field *sf = &S->f[i];
+		sf->key = f[i].key;
+		sf->offset = (uint32_t)f[i].offset;
+		sf->sz = (uint32_t)f[i].sz;
+		sf->def = (uint32_t)defsz;
+		if (f[i].def) {
+			memcpy(S->defaults + defsz, f[i].def, f[i].sz);
+		} else {
+			memset(S->defaults + defsz, 0, f[i].sz);
+		}
+		defsz += f[i].sz;
+	}
+	qsort(S->f, n, sizeof(struct schema_field), schema_field_compare);
+	return S;
+}
+
+void
+style_schema_release(struct style_cache *C, struct style_schema *S) {
+	assert(!C->reclaim.active);
+	if (S == NULL)
+		return;
+	style_free(C, S, S->size);
+}
+
+int
+style_fetch(struct style_cache *C, style_handle_t h, const struct style_schema *S, void *dst) {
+	assert(!C->reclaim.active);
+	attrib_t a = get_value(C, h);
+	int tmp[MAX_KEY];
+	int n = attrib_get(C->A, a, tmp);
+	uint8_t *output = (uint8_t *)dst;
+	int found = 0;
+	int i = 0;
+	int j;
+	uint8_t key = 0;
+	size_t sz = 0;
+	void *data = NULL;
+	if (n > 0)
+		data = attrib_entry_get(C->A, tmp[0], &key, &sz);
+	for (j=0;j<S->n;j++) {
+		const struct schema_field *f = &S->f[j];
+		while (i < n && key < f->key) {
+			if (++i < n)
+				data = attrib_entry_get(C->A, tmp[i], &key, &sz);
+		}
+		size_t copy = 0;
+		if (i < n && key == f->key) {
+			copy = sz < f->sz ? sz : f->sz;
+			memcpy(output + f->offset, data, copy);
+			++found;
+		}
+		memcpy(output + f->offset + copy, S->defaults + f->def + copy, f->sz - copy);
+	}
+	return found;
+}
+
+// make snapshot map [0, n) addressable, new slots are NULL
+static void
+snapshot_reserve(struct paged_array *map, int n, struct style_cache *C) {
+	int cap = paged_array_cap(map);
+	if (n <= cap)
+		return;
+	paged_array_reserve(map, n, C);
+	int i;
+	for (i=cap;i<paged_array_cap(map);i++) {
+		*PAGED_ARRAY_GET(map, struct snapshot_record *, i) = NULL;
+	}
+}
+
+static inline size_t
+snapshot_value_size(size_t sz) {
+	// keep values aligned
+	return (sz + 7) & ~(size_t)7;
+}
+
+static struct snapshot_record *
+snapshot_record(struct style_cache *C, attrib_t a) {
+	snapshot_reserve(&C->snapshot, a.idx + 1, C);
+	struct snapshot_record **slot = PAGED_ARRAY_GET(&C->snapshot, struct snapshot_record *, a.idx);
+	struct snapshot_record *r = *slot;
+	if (r) {
+		++r->refcount;
+		return r;
+	}
+	int tmp[MAX_KEY];
+	int n = attrib_get(C->A, a, tmp);
+	size_t header = sizeof(struct snapshot_record) - sizeof(struct style_attrib) + n * sizeof(struct style_attrib);
+	size_t size = snapshot_value_size(header);
+	int i;
+	for (i=0;i<n;i++) {
+		uint8_t key;
+		size_t sz;
+		attrib_entry_get(C->A, tmp[i], &key, &sz);
+		size += snapshot_value_size(sz);
+	}
+	r = (struct snapshot_record *)style_malloc(C, size);
+	r->refcount = 1;
+	r->a = attrib_addref(C->A, a);
+	r->n = n;
+	r->size = size;
+	uint8_t *buffer = (uint8_t *)r + snapshot_value_size(header);
+	for (i=0;i<n;i++) {
+		struct style_attrib *kv = &r->kv[i];
+		void *data = attrib_entry_get(C->A, tmp[i], &kv->key, &kv->sz);
+		memcpy(buffer, data, kv->sz);
+		kv->data = buffer;
+		buffer += snapshot_value_size(kv->sz);
+	}
+	*slot = r;
+	return r;
+}
+
+static void
+snapshot_record_release(struct style_cache *C, struct snapshot_record *r) {
+	if (--r->refcount > 0)
+		return;
+	*PAGED_ARRAY_GET(&C->snapshot, struct snapshot_record *, r->a.idx) = NULL;
+	attrib_release(C->A, r->a, C);
+	style_free(C, r, r->size);
+}
+
+// tuples are renumbered by style_compact
+static void
+snapshot_remap(struct style_cache *C, int n, const int tuple_remap[]) {
+	struct paged_array map;
+	paged_array_init(&map, sizeof(struct snapshot_record *));
+	int cap = paged_array_cap(&C->snapshot);
+	int i;
+	for (i=0;i<cap && i<n;i++) {
+		struct snapshot_record *r = *PAGED_ARRAY_GET(&C->snapshot, struct snapshot_record *, i);
+		if (r) {
+			int id = tuple_remap[i];
+			assert(id >= 0);
+			r->a.idx = id;
+			snapshot_reserve(&map, id + 1, C);
+			*PAGED_ARRAY_GET(&map, struct snapshot_record *, id) = r;
+		}
+	}
+	paged_array_deinit(&C->snapshot, C);
+	C->snapshot = map;
+}
+
+static inline size_t
+snapshot_size(int npage) {
+	return sizeof(struct style_snapshot) + (npage > 0 ? npage - 1 : 0) * sizeof(struct snapshot_page *);
+}
+
+static void
+snapshot_page_release(struct style_cache *C, struct snapshot_page *page) {
+	if (--page->refcount > 0)
+		return;
+	int i;
+	for (i=0;i<SNAPSHOT_PAGE;i++) {
+		if (page->r[i])
+			snapshot_record_release(C, page->r[i]);
+	}
+	style_free(C, page, sizeof(*page));
+}
+
+// the record of prev at slot i if it's still the value v
+static inline struct snapshot_record *
+snapshot_same(const struct style_snapshot *prev, int i, attrib_t v) {
+	if (prev == NULL || i >= prev->n)
+		return NULL;
+	struct snapshot_record *r = prev->page[i >> SNAPSHOT_PAGE_BITS]->r[i & (SNAPSHOT_PAGE - 1)];
+	return r->a.idx == v.idx ? r : NULL;
+}
+
+static struct snapshot_handles *
+snapshot_handles(struct style_cache *C, int n, const style_handle_t h[]) {
+	struct snapshot_handles *H = (struct snapshot_handles *)style_malloc(C, sizeof(*H));
+	H->refcount = 1;
+	H->n = n;
+	H->epoch = C->changes.epoch;
+	H->h = (style_handle_t *)style_malloc(C, n * sizeof(style_handle_t));
+	memcpy(H->h, h, n * sizeof(style_handle_t));
+	H->slot = NULL;
+	return H;
+}
+
+static void
+snapshot_handles_release(struct style_cache *C, struct snapshot_handles *H) {
+	if (--H->refcount > 0)
+		return;
+	style_free(C, H->h, H->n * sizeof(style_handle_t));
+	if (H->slot)
+		style_free(C, H->slot, H->n * sizeof(struct snapshot_slot));
+	style_free(C, H, sizeof(*H));
+}
+
+static int
+slot_compar(const void *a, const void *b) {
+	const struct snapshot_slot *x = (const struct snapshot_slot *)a;
+	const struct snapshot_slot *y = (const struct snapshot_slot *)b;
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return x->i - y->i;
+}
+
+// the first slot of id in H->slot (sorted once)
+static int
+snapshot_slot_find(struct style_cache *C, struct snapshot_handles *H, int id) {
+	int i;
+	if (H->slot == NULL) {
+		H->slot = (struct snapshot_slot *)style_malloc(C, H->n * sizeof(struct snapshot_slot));
+		for (i=0;i<H->n;i++) {
+			H->slot[i].id = H->h[i].idx;
+			H->slot[i].i = i;
+		}
+		qsort(H->slot, H->n, sizeof(struct snapshot_slot), slot_compar);
+	}
+	int begin = 0;
+	int end = H->n;
+	while (begin < end) {
+		int mid = (begin + end) / 2;
+		if (H->slot[mid].id < id)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+// the changes are recorded from now, until there are more than the handles of S
+static struct style_snapshot *
+snapshot_track(struct style_cache *C, struct style_snapshot *S) {
+	struct style_changes *c = &C->changes;
+	S->gen = ++c->gen;
+	c->limit = S->n;
+	c->n = 0;
+	return S;
+}
+
+static struct style_snapshot *
+snapshot_new(struct style_cache *C, struct snapshot_handles *H) {
+	int npage = (H->n + SNAPSHOT_PAGE - 1) >> SNAPSHOT_PAGE_BITS;
+	struct style_snapshot *S = (struct style_snapshot *)style_malloc(C, snapshot_size(npage));
+	S->C = C;
+	S->handles = H;
+	S->n = H->n;
+	S->npage = npage;
+	return S;
+}
+
+// read all the handles, the pages of prev are shared when all their values are the same
+static struct style_snapshot *
+snapshot_full(struct style_cache *C, const struct style_snapshot *prev, struct snapshot_handles *H) {
+	struct style_snapshot *S = snapshot_new(C, H);
+	const style_handle_t *h = H->h;
+	int n = S->n;
+	int p, i;
+	for (p=0;p<S->npage;p++) {
+		int begin = p << SNAPSHOT_PAGE_BITS;
+		int count = n - begin < SNAPSHOT_PAGE ? n - begin : SNAPSHOT_PAGE;
+		attrib_t v[SNAPSHOT_PAGE];
+		int same = prev != NULL && p < prev->npage;
+		for (i=0;i<count;i++) {
+			v[i] = get_value(C, h[begin+i]);
+			if (same && snapshot_same(prev, begin+i, v[i]) == NULL)
+				same = 0;
+		}
+		if (same) {
+			struct snapshot_page *page = prev->page[p];
+			++page->refcount;
+			S->page[p] = page;
+			continue;
+		}
+		struct snapshot_page *page = (struct snapshot_page *)style_malloc(C, sizeof(*page));
+		page->refcount = 1;
+		for (i=0;i<count;i++) {
+			struct snapshot_record *r = snapshot_same(prev, begin+i, v[i]);
+			if (r) {
+				++r->refcount;
+			} else {
+				r = snapshot_record(C, v[i]);
+			}
+			page->r[i] = r;
+		}
+		for (;i<SNAPSHOT_PAGE;i++) {
+			page->r[i] = NULL;
+		}
+		S->page[p] = page;
+	}
+	return snapshot_track(C, S);
+}
+
+// share all the pages of prev, and copy the pages of the changed handles on write
+static struct style_snapshot *
+snapshot_update(struct style_cache *C, const struct style_snapshot *prev) {
+	struct snapshot_handles *H = prev->handles;
+	++H->refcount;
+	struct style_snapshot *S = snapshot_new(C, H);
+	int p, i, k;
+	for (p=0;p<S->npage;p++) {
+		S->page[p] = prev->page[p];
+		++S->page[p]->refcount;
+	}
+	struct style_changes *c = &C->changes;
+	for (k=0;k<c->n;k++) {
+		int id = c->id[k];
+		for (i=snapshot_slot_find(C, H, id);i<H->n && H->slot[i].id == id;i++) {
+			int index = H->slot[i].i;
+			attrib_t v = get_value(C, H->h[index]);
+			struct snapshot_page *page = S->page[index >> SNAPSHOT_PAGE_BITS];
+			struct snapshot_record **r = &page->r[index & (SNAPSHOT_PAGE - 1)];
+			if ((*r)->a.idx == v.idx)
+				continue;
+			if (page == prev->page[index >> SNAPSHOT_PAGE_BITS]) {
+				struct snapshot_page *copy = (struct snapshot_page *)style_malloc(C, sizeof(*copy));
+				copy->refcount = 1;
+				int j;
+				for (j=0;j<SNAPSHOT_PAGE;j++) {
+					copy->r[j] = page->r[j];
+					if (copy->r[j])
+						++copy->r[j]->refcount;
+				}
+				--page->refcount;
+				S->page[index >> SNAPSHOT_PAGE_BITS] = copy;
+				r = &copy->r[index & (SNAPSHOT_PAGE - 1)];
+			}
+			snapshot_record_release(C, *r);
+			*r = snapshot_record(C, v);
+		}
+	}
+	return snapshot_track(C, S);
+}
+
+struct style_snapshot *
+style_snapshot_create(struct style_cache *C, const struct style_snapshot *prev, int n, const style_handle_t h[]) {
+	assert(!C->reclaim.active);
+	assert(prev == NULL || prev->C == C);
+	if (h == NULL) {
+		assert(prev != NULL && prev->handles->epoch == C->changes.epoch);
+		struct style_changes *c = &C->changes;
+		if (prev->gen == c->gen && c->n <= c->limit)
+			return snapshot_update(C, prev);
+		++prev->handles->refcount;
+		return snapshot_full(C, prev, prev->handles);
+	}
+	return snapshot_full(C, prev, snapshot_handles(C, n, h));
+}
+
+void
+style_snapshot_release(struct style_snapshot *S) {
+	if (S == NULL)
+		return;
+	struct style_cache *C = S->C;
+	int i;
+	for (i=0;i<S->npage;i++) {
+		snapshot_page_release(C, S->page[i]);
+	}
+	snapshot_handles_release(C, S->handles);
+	style_free(C, S, snapshot_size(S->npage));
+}
+
+static inline const struct snapshot_record *
+snapshot_get(const struct style_snapshot *S, int i) {
+	assert(i >= 0 && i < S->n);
+	return S->page[i >> SNAPSHOT_PAGE_BITS]->r[i & (SNAPSHOT_PAGE - 1)];
+}
+
+int
+style_snapshot_find(const struct style_snapshot *S, int i, uint8_t key, struct style_attrib *output) {
+	const struct snapshot_record *r = snapshot_get(S, i);
+	// keys are sorted
+	int begin = 0;
+	int end = r->n;
+	while (begin < end) {
+		int mid = (begin + end) / 2;
+		const struct style_attrib *kv = &r->kv[mid];
+		if (kv->key == key) {
+			*output = *kv;
+			return 1;
+		} else if (kv->key < key) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return 0;
+}
+
+int
+style_snapshot_export(const struct style_snapshot *S, int i, struct style_attrib output[MAX_KEY]) {
+	const struct snapshot_record *r = snapshot_get(S, i);
+	int k;
+	for (k=0;k<MAX_KEY;k++) {
+		output[k].data = NULL;
+		output[k].sz = 0;
+		output[k].key = k;
+	}
+	for (k=0;k<r->n;k++) {
+		output[r->kv[k].key] = r->kv[k];
+	}
+	return r->n;
+}
+
+struct eval_task {
+	int id;
+	int n;	// result of attrib_inherit_prepare
+	attrib_t a;
+	attrib_t b;
+	int withmask;
+};
+
+// The workers are started once in style_eval_parallel, and run each chunk when .round changes
+struct eval_job {
+	struct attrib_state *A;
+	struct eval_task *task;
+	int *output;	// MAX_KEY for each task
+	int n;
+#ifdef STYLE_NO_THREAD
+	int next;
+#else
+	atomic_int next;
+	int nthread;	// workers, the main thread is not counted
+	int round;	// guarded by .lock, so do .busy and .quit
+	int busy;
+	int quit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread[EVAL_MAX_THREAD];
+#endif
+};
+
+static inline int
+eval_fetch(struct eval_job *J) {
+#ifdef STYLE_NO_THREAD
+	int r = J->next;
+	J->next += EVAL_BATCH;
+	return r;
+#else
+	return atomic_fetch_add(&J->next, EVAL_BATCH);
+#endif
+}
+
+// read only, tasks are taken in batches by all the threads
+static void
+eval_run(struct eval_job *J) {
+	for (;;) {
+		int begin = eval_fetch(J);
+		if (begin >= J->n)
+			return;
+		int end = begin + EVAL_BATCH < J->n ? begin + EVAL_BATCH : J->n;
+		int i;
+		for (i=begin;i<end;i++) {
+			struct eval_task *t = &J->task[i];
+			t->n = attrib_inherit_prepare(J->A, t->a, t->b, t->withmask, J->output + i * MAX_KEY);
+		}
+	}
+}
+
+#ifndef STYLE_NO_THREAD
+
+static void *
+eval_thread(void *ud) {
+	struct eval_job *J = (struct eval_job *)ud;
+	int round = 0;
+	pthread_mutex_lock(&J->lock);
+	for (;;) {
+		while (J->round == round && !J->quit)
+			pthread_cond_wait(&J->cond, &J->lock);
+		if (J->quit)
+			break;
+		round = J->round;
+		pthread_mutex_unlock(&J->lock);
+		eval_run(J);
+		pthread_mutex_lock(&J->lock);
+		if (--J->busy == 0)
+			pthread_cond_broadcast(&J->cond);
+	}
+	pthread_mutex_unlock(&J->lock);
+	return NULL;
+}
+
+#endif
+
+static void
+eval_start(struct eval_job *J, int nthread) {
+#ifndef STYLE_NO_THREAD
+	J->nthread = 0;
+	J->round = 0;
+	J->busy = 0;
+	J->quit = 0;
+	if (nthread > EVAL_MAX_THREAD + 1)
+		nthread = EVAL_MAX_THREAD + 1;
+	if (nthread <= 1)
+		return;
+	pthread_mutex_init(&J->lock, NULL);
+	pthread_cond_init(&J->cond, NULL);
+	int i;
+	for (i=0;i<nthread-1;i++) {
+		// the main thread does the rest if it fails
+		if (pthread_create(&J->thread[J->nthread], NULL, eval_thread, J) == 0)
+			++J->nthread;
+	}
+#endif
+}
+
+static void
+eval_stop(struct eval_job *J, int nthread) {
+#ifndef STYLE_NO_THREAD
+	if (nthread <= 1)
+		return;
+	pthread_mutex_lock(&J->lock);
+	J->quit = 1;
+	pthread_cond_broadcast(&J->cond);
+	pthread_mutex_unlock(&J->lock);
+	int i;
+	for (i=0;i<J->nthread;i++) {
+		pthread_join(J->thread[i], NULL);
+	}
+	pthread_mutex_destroy(&J->lock);
+	pthread_cond_destroy(&J->cond);
+#endif
+}
+
+// the workers and the main thread take the batches of current chunk
+static void
+eval_parallel_(struct eval_job *J) {
+#ifndef STYLE_NO_THREAD
+	if (J->nthread > 0) {
+		pthread_mutex_lock(&J->lock);
+		atomic_store(&J->next, 0);
+		J->busy = J->nthread;
+		++J->round;
+		pthread_cond_broadcast(&J->cond);
+		pthread_mutex_unlock(&J->lock);
+		eval_run(J);
+		pthread_mutex_lock(&J->lock);
+		while (J->busy > 0)
+			pthread_cond_wait(&J->cond, &J->lock);
+		pthread_mutex_unlock(&J->lock);
+		return;
+	}
+#endif
+	J->next = 0;
+	eval_run(J);
+}
+
+// grown by the dirty nodes visited, not by the cache
+struct eval_buffer {
+	int n;
+	int cap;
+	int *p;
+};
+
+static inline void
+eval_push(struct style_cache *C, struct eval_buffer *b, int id) {
+	if (b->n >= b->cap) {
+		int newcap = b->cap == 0 ? 64 : b->cap * 2;
+		b->p = (int *)style_realloc(C, b->p, b->cap * sizeof(int), newcap * sizeof(int));
+		b->cap = newcap;
+	}
+	b->p[b->n++] = id;
+}
+
+#define LEVEL(C, id) PAGED_ARRAY_GET(&(C)->level, int, id)
+
+// collect dirty nodes needed by id in post order, level of id is the longest path to a clean node
+static void
+eval_order(struct style_cache *C, int id, struct eval_buffer *stack, struct eval_buffer *order) {
+	eval_push(C, stack, id);
+	while (stack->n > 0) {
+		id = stack->p[stack->n-1];
+		struct style_edge *e = EDGE(C, id);
+		int *level = LEVEL(C, id);
+		if (*level == -1) {
+			*level = -2;
+			assert(is_combination(C, id));
+			if (VALUE(C, e->b)->idx < 0 && *LEVEL(C, e->b) == -1)
+				eval_push(C, stack, e->b);
+			if (VALUE(C, e->a)->idx < 0 && *LEVEL(C, e->a) == -1)
+				eval_push(C, stack, e->a);
+		} else {
+			--stack->n;
+			if (*level == -2) {
+				int l = 0;
+				if (VALUE(C, e->a)->idx < 0 && *LEVEL(C, e->a) >= l)
+					l = *LEVEL(C, e->a) + 1;
+				if (VALUE(C, e->b)->idx < 0 && *LEVEL(C, e->b) >= l)
+					l = *LEVEL(C, e->b) + 1;
+				*level = l;
+				eval_push(C, order, id);
+			}
+		}
+	}
+}
+
+void
+style_eval_parallel(struct style_cache *C, int n, const style_handle_t h[], int nthread) {
+	assert(!C->reclaim.active);
+	// the levels are kept in the cache, only new pages are initialized
+	paged_array_reserve(&C->level, C->n, C);
+	int cap = paged_array_cap(&C->level);
+	for (;C->level_n < cap;C->level_n += PAGED_ARRAY_PAGE) {
+		memset(LEVEL(C, C->level_n), 0xff, PAGED_ARRAY_PAGE * sizeof(int));
+	}
+	struct eval_buffer stack = { 0, 0, NULL };
+	struct eval_buffer order = { 0, 0, NULL };
+	int i;
+	for (i=0;i<n;i++) {
+		int id = h[i].idx;
+		get_style(C, id);
+		if (VALUE(C, id)->idx < 0 && *LEVEL(C, id) == -1)
+			eval_order(C, id, &stack, &order);
+	}
+	style_free(C, stack.p, stack.cap * sizeof(int));
+	int count = order.n;
+	if (count == 0) {
+		style_free(C, order.p, order.cap * sizeof(int));
+		return;
+	}
+	// sort by level, nodes of the same level don't depend on each other
+	int maxlevel = 0;
+	for (i=0;i<count;i++) {
+		int l = *LEVEL(C, order.p[i]);
+		if (l > maxlevel)
+			maxlevel = l;
+	}
+	int *start = (int *)style_malloc(C, (maxlevel + 2) * sizeof(int));
+	memset(start, 0, (maxlevel + 2) * sizeof(int));
+	for (i=0;i<count;i++) {
+		++start[*LEVEL(C, order.p[i]) + 1];
+	}
+	for (i=0;i<=maxlevel;i++) {
+		start[i+1] += start[i];
+	}
+	int *sorted = (int *)style_malloc(C, count * sizeof(int));
+	for (i=0;i<count;i++) {
+		int id = order.p[i];
+		int *level = LEVEL(C, id);
+		sorted[start[*level]++] = id;
+		*level = -1;
+	}
+	style_free(C, start, (maxlevel + 2) * sizeof(int));
+	style_free(C, order.p, order.cap * sizeof(int));
+
+	int chunk = count < EVAL_CHUNK ? count : EVAL_CHUNK;
+	// no more workers than the batches of the largest chunk
+	int max_thread = (chunk + EVAL_BATCH - 1) / EVAL_BATCH;
+	if (nthread > max_thread)
+		nthread = max_thread;
+	struct eval_job J;
+	J.A = C->A;
+	J.task = (struct eval_task *)style_malloc(C, chunk * sizeof(struct eval_task));
+	J.output = (int *)style_malloc(C, chunk * MAX_KEY * sizeof(int));
+	eval_start(&J, nthread);
+	int begin = 0;
+	while (begin < count) {
+		J.n = 0;
+		while (begin + J.n < count && J.n < chunk) {
+			int id = sorted[begin + J.n];
+			struct style_edge *e = EDGE(C, id);
+			attrib_t a = *VALUE(C, e->a);
+			attrib_t b = *VALUE(C, e->b);
+			if (a.idx < 0 || b.idx < 0)
+				break;	// depends on the current chunk, nodes of the next level are after it
+			struct eval_task *t = &J.task[J.n++];
+			t->id = id;
+			t->a = a;
+			t->b = b;
+			t->withmask = NODE(C, id)->withmask;
+		}
+		assert(J.n > 0);
+		eval_parallel_(&J);
+		// intern results in order, so the ids are stable
+		for (i=0;i<J.n;i++) {
+			struct eval_task *t = &J.task[i];
+			undo_touch(C, t->id);
+			*VALUE(C, t->id) = attrib_inherit_finish(C->A, t->a, t->b, t->withmask, t->n, J.output + i * MAX_KEY, C);
+		}
+		begin += J.n;
+	}
+	eval_stop(&J, nthread);
+	style_free(C, J.task, chunk * sizeof(struct eval_task));
+	style_free(C, J.output, chunk * MAX_KEY * sizeof(int));
+	style_free(C, sorted, count * sizeof(int));
+}
+
+void
+style_reclaim_policy(struct style_cache *C, int frames, size_t bytes) {
+	assert(!C->reclaim.active);
+	attrib_delay_policy(C->A, frames, bytes);
+	C->park.frames = frames;
+	C->park.bytes = bytes;
+}
+
+// release the inputs of dead nodes, the nodes they kill are added to the dead list too.
+// Dead inherit nodes are parked (unless all), and the expired parked nodes die
+static void
+flush_mark_(struct style_cache *C, int all) {
+	int out = -1;
+	for (;;) {
+		int id = C->dead;
+		if (id >= 0) {
+			remove_from(C, id, &C->dead);
+			if (!all && style_index_get(EDGE(C, id)->a) >= 0) {
+				park_link(C, id);
+				continue;
+			}
+		} else if ((id = park_expired(C, all)) < 0) {
+			break;
+		}
+		struct style_node *s = NODE(C, id);
+		assert(s->refcount == 0);
+		s->refcount = -1;
+		link_to(C, id, &out);
+		struct style_edge *e = EDGE(C, id);
+		if (style_index_get(e->a) >= 0)
+			release_(C, e->a);
+		if (style_index_get(e->b) >= 0)
+			release_(C, e->b);
+	}
+	C->dead = out;
+	if (!all)
+		++C->park.frame;
+}
+
+// free the slots of dead list into *freelist, return the first slot freed which is the tail of them
+static int
+reclaim_nodes_(struct style_cache *C, int dead, int *freelist) {
+	int tail = -1;
+	while (dead >= 0) {
+		struct style_node *s = NODE(C, dead);
+		int next = style_index_get(s->next);
+		dirtylist_clear(C->D, dead);
+		if (style_index_get(EDGE(C, dead)->a) >= 0)
+			intern_cache_remove(&C->inherit_i, dead, INHERIT_HASH(C));
+		attrib_t *v = VALUE(C, dead);
+		if (v->idx >= 0) {
+			attrib_release(C->A, *v, C);
+			v->idx = -1;
+		}
+		if (in_frame(C, dead)) {
+			// promoted node returns to frame region
+			s->refcount = 0;
+			s->transient = 1;
+			EDGE(C, dead)->a = -1;
+		} else {
+			s->next = *freelist;
+			*freelist = dead;
+			if (tail < 0)
+				tail = dead;
+		}
+		dead = next;
+	}
+	return tail;
+}
+
+// caches sharing A begin the next frame of A when all of them are flushed
+static int
+ring_flushed(struct style_cache *C) {
+	struct style_cache *O;
+	C->flushed = 1;
+	for (O = C->share; O != C; O = O->share) {
+		if (!O->flushed)
+			return 0;
+	}
+	do {
+		O->flushed = 0;
+		O = O->share;
+	} while (O != C);
+	return 1;
+}
+
+static int
+flush_reclaim_(struct style_cache *C, int dead, int *freelist) {
+	int tail = reclaim_nodes_(C, dead, freelist);
+	frame_reset(C);
+	dirtylist_compact(C->D, 0);
+	attrib_flush(C->A, ring_flushed(C), C);
+	return tail;
+}
+
+static void
+flush_(struct style_cache *C) {
+	flush_mark_(C, 0);
+	int dead = C->dead;
+	C->dead = -1;
+	flush_reclaim_(C, dead, &C->freelist);
+}
+
+// parked nodes hold the references of their inputs, drop them all without a new frame
+static void
+park_drop(struct style_cache *C) {
+	if (C->park.n == 0)
+		return;
+	flush_mark_(C, 1);
+	int dead = C->dead;
+	C->dead = -1;
+	reclaim_nodes_(C, dead, &C->freelist);
+}
+
+#ifndef STYLE_NO_THREAD
+
+static void *
+reclaim_thread(void *ud) {
+	struct style_cache *C = (struct style_cache *)ud;
+	struct style_reclaim *R = &C->reclaim;
+	pthread_mutex_lock(&R->lock);
+	for (;;) {
+		while (!R->pending && !R->quit)
+			pthread_cond_wait(&R->cond, &R->lock);
+		if (!R->pending)
+			break;
+		pthread_mutex_unlock(&R->lock);
+		R->tail = flush_reclaim_(C, R->dead, &R->freelist);
+		R->dead = -1;
+		pthread_mutex_lock(&R->lock);
+		R->pending = 0;
+		pthread_cond_broadcast(&R->cond);
+	}
+	pthread_mutex_unlock(&R->lock);
+	return NULL;
+}
+
+static int
+reclaim_start(struct style_cache *C) {
+	struct style_reclaim *R = &C->reclaim;
+	pthread_mutex_init(&R->lock, NULL);
+	pthread_cond_init(&R->cond, NULL);
+	if (pthread_create(&R->thread, NULL, reclaim_thread, C) != 0) {
+		pthread_mutex_destroy(&R->lock);
+		pthread_cond_destroy(&R->cond);
+		return 0;
+	}
+	R->started = 1;
+	return 1;
+}
+
+#endif
+
+void
+style_flush_wait(struct style_cache *C) {
+#ifndef STYLE_NO_THREAD
+	struct style_reclaim *R = &C->reclaim;
+	if (!R->active)
+		return;
+	pthread_mutex_lock(&R->lock);
+	while (R->pending)
+		pthread_cond_wait(&R->cond, &R->lock);
+	pthread_mutex_unlock(&R->lock);
+	if (R->tail >= 0) {
+		NODE(C, R->tail)->next = C->freelist;
+		C->freelist = R->freelist;
+	}
+	R->active = 0;
+#endif
+}
+
+static void
+reclaim_stop(struct style_cache *C) {
+#ifndef STYLE_NO_THREAD
+	struct style_reclaim *R = &C->reclaim;
+	if (!R->started)
+		return;
+	style_flush_wait(C);
+	pthread_mutex_lock(&R->lock);
+	R->quit = 1;
+	pthread_cond_broadcast(&R->cond);
+	pthread_mutex_unlock(&R->lock);
+	pthread_join(R->thread, NULL);
+	pthread_mutex_destroy(&R->lock);
+	pthread_cond_destroy(&R->cond);
+	R->started = 0;
+#endif
+}
+
+void
+style_flush(struct style_cache *C) {
+	assert(!C->undo.active && C->batch.depth == 0);
+	if (C->journal)
+		journal_forget(C, JOURNAL_FLUSH);
+	style_flush_wait(C);
+	flush_(C);
+}
+
+void
+style_flush_async(struct style_cache *C) {
+	assert(!C->undo.active && C->batch.depth == 0);
+	if (C->journal)
+		journal_forget(C, JOURNAL_FLUSH);
+	style_flush_wait(C);
+#ifndef STYLE_NO_THREAD
+	struct style_reclaim *R = &C->reclaim;
+	// the worker would release tuples of A while other caches use it
+	if (C->share == C && (R->started || reclaim_start(C))) {
+		// the release cascade runs here (it changes the refcounts of live nodes), the dead list goes to
+		// the worker as a whole, and the slots are free after style_flush_wait
+		flush_mark_(C, 0);
+		R->dead = C->dead;
+		C->dead = -1;
+		R->freelist = -1;
+		R->tail = -1;
+		R->active = 1;
+		pthread_mutex_lock(&R->lock);
+		R->pending = 1;
+		pthread_cond_signal(&R->cond);
+		pthread_mutex_unlock(&R->lock);
+		return;
+	}
+#endif
+	flush_(C);
+}
+
+static int
+inherit_bits(int n) {
+	int bits = INHERIT_DEFAULT_BITS;
+	while ((1 << bits) <= n)
+		++bits;
+	return bits;
+}
+
+// post order DFS from id, the inputs of a node are placed before it
+static int
+compact_order(struct style_cache *C, int id, int map[], int stack[], int rev[], int count) {
+	int sp = 0;
+	stack[sp++] = id;
+	while (sp > 0) {
+		id = stack[sp-1];
+		if (map[id] == -1) {
+			map[id] = -2;
+			struct style_edge *e = EDGE(C, id);
+			if (style_index_get(e->b) >= 0 && map[e->b] == -1)
+				stack[sp++] = e->b;
+			if (style_index_get(e->a) >= 0 && map[e->a] == -1)
+				stack[sp++] = e->a;
+		} else {
+			--sp;
+			if (map[id] == -2) {
+				map[id] = count;
+				rev[count++] = id;
+			}
+		}
+	}
+	return count;
+}
+
+void
+style_compact(struct style_cache *C, style_remap remap, void *ud) {
+	struct style_cache *O;
+	for (O = C->share; O != C; O = O->share) {
+		// tuple ids in other caches are remapped, and batch records keep kv ids
+		style_flush_wait(O);
+		assert(O->batch.depth == 0);
+		if (O->journal) {
+			// attrib ids are changed, the handles of O are not
+			journal_forget(O, JOURNAL_COMPACT);
+			journal_list(O, 0, NULL);
+		}
+	}
+	style_flush_wait(C);
+	assert(C->dead < 0 && C->batch.depth == 0 && C->frame.top == 0 && !C->undo.active);
+	park_drop(C);
+	if (C->journal)
+		journal_forget(C, -1);
+	int n = C->n;
+	int i;
+	// each node pushes at most two inputs
+	int *stack = (int *)style_malloc(C, (3 * n + 1) * sizeof(int));
+	int *map = (int *)style_malloc(C, n * sizeof(int));
+	int *rev = (int *)style_malloc(C, n * sizeof(int));
+	for (i=0;i<n;i++) {
+		map[i] = -1;
+	}
+	int count = 0;
+	for (i=0;i<n;i++) {
+		// free slots and frame region are not alive
+		if (map[i] == -1 && NODE(C, i)->refcount > 0)
+			count = compact_order(C, i, map, stack, rev, count);
+	}
+	style_free(C, stack, (3 * n + 1) * sizeof(int));
+
+	int kv_n = attrib_kv_size(C->A);
+	int tuple_n = attrib_tuple_size(C->A);
+	int *kv_remap = (int *)style_malloc(C, kv_n * sizeof(int));
+	int *tuple_remap = (int *)style_malloc(C, tuple_n * sizeof(int));
+	attrib_t *order = (attrib_t *)style_malloc(C, count * sizeof(attrib_t));
+	for (i=0;i<count;i++) {
+		order[i] = *VALUE(C, rev[i]);
+	}
+	attrib_compact(C->A, count, order, kv_remap, tuple_remap, C);
+	style_free(C, order, count * sizeof(attrib_t));
+	snapshot_remap(C, tuple_n, tuple_remap);
+	// the handles are moved, snapshots can't be created from the handles of the old ones
+	++C->changes.epoch;
+	++C->changes.gen;
+	C->changes.limit = -1;
+	C->changes.n = 0;
+	for (O = C->share; O != C; O = O->share) {
+		for (i=0;i<O->n;i++) {
+			attrib_t *v = VALUE(O, i);
+			if (v->idx >= 0)
+				v->idx = tuple_remap[v->idx];
+		}
+		for (i=0;i<O->undo.log_n;i++) {
+			attrib_t *v = &O->undo.log[i].value;
+			if (v->idx >= 0)
+				v->idx = tuple_remap[v->idx];
+		}
+		snapshot_remap(O, tuple_n, tuple_remap);
+	}
+
+	struct paged_array value, edge, node;
+	paged_array_init(&value, sizeof(attrib_t));
+	paged_array_init(&edge, sizeof(struct style_edge));
+	paged_array_init(&node, sizeof(struct style_node));
+	paged_array_reserve(&value, count, C);
+	paged_array_reserve(&edge, count, C);
+	paged_array_reserve(&node, count, C);
+	for (i=0;i<count;i++) {
+		int id = rev[i];
+		attrib_t v = *VALUE(C, id);
+		if (v.idx >= 0)
+			v.idx = tuple_remap[v.idx];
+		*PAGED_ARRAY_GET(&value, attrib_t, i) = v;
+		struct style_edge *e = EDGE(C, id);
+		struct style_edge *ne = PAGED_ARRAY_GET(&edge, struct style_edge, i);
+		ne->a = style_index_get(e->a) >= 0 ? map[e->a] : -1;
+		ne->b = style_index_get(e->b) >= 0 ? map[e->b] : -1;
+		struct style_node *nn = PAGED_ARRAY_GET(&node, struct style_node, i);
+		*nn = *NODE(C, id);
+		nn->transient = 0;
+	}
+	paged_array_deinit(&C->value, C);
+	paged_array_deinit(&C->edge, C);
+	paged_array_deinit(&C->node, C);
+	C->value = value;
+	C->edge = edge;
+	C->node = node;
+	C->n = count;
+	C->freelist = -1;
+	C->live = -1;
+	for (i=count-1;i>=0;i--) {
+		link_to(C, i, &C->live);
+	}
+	C->empty.idx = map[C->empty.idx];
+
+	// rebuild inherit intern and dirty list
+	intern_cache_deinit(C, &C->inherit_i);
+	intern_cache_init(C, &C->inherit_i, inherit_bits(count));
+	dirtylist_release(C->D);
+	C->D = dirtylist_create(C);
+	for (i=0;i<count;i++) {
+		struct style_edge *e = EDGE(C, i);
+		if (style_index_get(e->a) >= 0) {
+			intern_cache_insert(&C->inherit_i, i, INHERIT_HASH(C), C);
+			add_affect(C, e->a, i);
+			add_affect(C, e->b, i);
+		}
+	}
+	dirtylist_compact(C->D, 1);
+
+	style_free(C, C->batch.r, C->batch.cap * sizeof(struct batch_record));
+	C->batch.r = NULL;
+	C->batch.cap = 0;
+	intern_cache_deinit(C, &C->batch.index);
+	intern_cache_init(C, &C->batch.index, BATCH_DEFAULT_BITS);
+
+	// frame region is placed after live nodes
+	int frame_cap = C->frame.cap;
+	if (frame_cap > 0) {
+		C->frame.cap = 0;
+		frame_mode_(C, frame_cap);
+	}
+
+	if (C->journal) {
+		int moved = 0;
+		for (i=0;i<n;i++) {
+			if (map[i] >= 0 && map[i] != i)
+				++moved;
+		}
+		journal_record(C, JOURNAL_COMPACT, 1, &moved);
+		for (i=0;i<n;i++) {
+			if (map[i] >= 0 && map[i] != i) {
+				int v[2] = { i, map[i] };
+				journal_values(C, 2, v);
+			}
+		}
+	}
+	if (remap) {
+		for (i=0;i<n;i++) {
+			if (map[i] >= 0 && map[i] != i)
+				remap(ud, STYLE_REMAP_HANDLE, i, map[i]);
+		}
+		for (i=0;i<kv_n;i++) {
+			if (kv_remap[i] >= 0 && kv_remap[i] != i)
+				remap(ud, STYLE_REMAP_ATTRIB, i, kv_remap[i]);
+		}
+	}
+	style_free(C, map, n * sizeof(int));
+	style_free(C, rev, n * sizeof(int));
+	style_free(C, kv_remap, kv_n * sizeof(int));
+	style_free(C, tuple_remap, tuple_n * sizeof(int));
+}
+
+static int
+merge_attrib(struct style_cache *C, struct style_cache *S, attrib_t v, int kv_map[], int tmp[128]) {
+	int n = attrib_get(S->A, v, tmp);
+	int i;
+	for (i=0;i<n;i++) {
+		int id = tmp[i];
+		if (kv_map[id] < 0)
+			kv_map[id] = attrib_entry_import(C->A, S->A, id, C);
+		tmp[i] = kv_map[id];
+	}
+	return n;
+}
+
+int
+style_merge(struct style_cache *C, struct style_cache *S, style_remap remap, void *ud) {
+	style_flush_wait(C);
+	style_flush_wait(S);
+	assert(C != S && S->batch.depth == 0);
+	if (C->A != S->A && !attrib_importable(S->A))
+		return -1;
+	int n = S->n;
+	int i;
+	int *stack = (int *)style_malloc(C, (3 * n + 1) * sizeof(int));
+	int *map = (int *)style_malloc(C, n * sizeof(int));
+	int *rev = (int *)style_malloc(C, n * sizeof(int));
+	for (i=0;i<n;i++) {
+		map[i] = -1;
+	}
+	int count = 0;
+	for (i=0;i<n;i++) {
+		if (map[i] == -1 && NODE(S, i)->refcount > 0)
+			count = compact_order(S, i, map, stack, rev, count);
+	}
+	style_free(C, stack, (3 * n + 1) * sizeof(int));
+
+	// references held by the user, the others are held by the inherit nodes in S
+	int *ref = (int *)style_malloc(C, count * sizeof(int));
+	for (i=0;i<count;i++) {
+		ref[i] = NODE(S, rev[i])->refcount;
+	}
+	for (i=0;i<count;i++) {
+		struct style_edge *e = EDGE(S, rev[i]);
+		if (style_index_get(e->a) >= 0) {
+			--ref[map[e->a]];
+			--ref[map[e->b]];
+		}
+	}
+	for (i=0;i<n;i++) {
+		// dead and parked inherit nodes are not merged, but they hold their inputs
+		struct style_node *s = NODE(S, i);
+		struct style_edge *e = EDGE(S, i);
+		if (s->refcount == 0 && !s->transient && style_index_get(e->a) >= 0) {
+			--ref[map[e->a]];
+			--ref[map[e->b]];
+		}
+	}
+
+	int kv_n = attrib_kv_size(S->A);
+	int *kv_map = (int *)style_malloc(C, kv_n * sizeof(int));
+	for (i=0;i<kv_n;i++) {
+		kv_map[i] = -1;
+	}
+	style_handle_t *h = (style_handle_t *)style_malloc(C, count * sizeof(style_handle_t));
+	int tmp[128];
+	for (i=0;i<count;i++) {
+		int id = rev[i];
+		if (id == S->empty.idx) {
+			h[i] = C->empty;
+			continue;
+		}
+		struct style_edge *e = EDGE(S, id);
+		attrib_t v = *VALUE(S, id);
+		if (style_index_get(e->a) < 0) {
+			// style_create gives one reference, it's dropped below if the user holds none
+			h[i] = style_create(C, merge_attrib(C, S, v, kv_map, tmp), tmp);
+			int j;
+			for (j=1;j<ref[i];j++) {
+				style_addref(C, h[i]);
+			}
+		} else {
+			h[i] = style_inherit(C, h[map[e->a]], h[map[e->b]], NODE(S, id)->withmask);
+			int j;
+			for (j=0;j<ref[i];j++) {
+				style_addref(C, h[i]);
+			}
+			attrib_t *cv = VALUE(C, h[i].idx);
+			if (v.idx >= 0 && cv->idx < 0) {
+				// reuse the value evaluated in S, the inputs are the same
+				int sz = merge_attrib(C, S, v, kv_map, tmp);
+				undo_touch(C, h[i].idx);
+				*cv = attrib_create(C->A, sz, tmp, C);
+			}
+		}
+	}
+	// the dependents hold them now
+	for (i=0;i<count;i++) {
+		if (ref[i] == 0 && rev[i] != S->empty.idx && style_index_get(EDGE(S, rev[i])->a) < 0)
+			style_release(C, h[i]);
+	}
+
+	if (remap) {
+		for (i=0;i<count;i++) {
+			remap(ud, STYLE_REMAP_HANDLE, rev[i], h[i].idx);
+		}
+		for (i=0;i<kv_n;i++) {
+			if (kv_map[i] >= 0)
+				remap(ud, STYLE_REMAP_ATTRIB, i, kv_map[i]);
+		}
+	}
+	style_free(C, map, n * sizeof(int));
+	style_free(C, rev, n * sizeof(int));
+	style_free(C, ref, count * sizeof(int));
+	style_free(C, kv_map, kv_n * sizeof(int));
+	style_free(C, h, count * sizeof(style_handle_t));
+	return 0;
+}
+
+#define STYLE_IMAGE_VERSION 1
+
+struct style_image_header {
+	char magic[4];
+	int version;
+	int ptr_size;
+	int index_size;
+	int page_bits;
+	uint64_t size;	// the size of the whole image
+	int n;
+	int freelist;
+	int live;
+	int empty;
+	int frame_base;
+	int frame_cap;
+	int park_head;
+	int park_tail;
+	int park_n;
+	unsigned int park_frame;
+	int park_frames;
+	uint64_t park_bytes;
+};
+
+int
+style_cache_save(struct style_cache *C, const char *path, int with_inherit) {
+	// the tuples of other caches would be saved too
+	if (C->share != C)
+		return -1;
+	style_flush_wait(C);
+	assert(C->dead < 0 && C->batch.depth == 0 && C->frame.top == 0 && !C->undo.active);
+	int i;
+	int cap = paged_array_cap(&C->snapshot);
+	for (i=0;i<cap;i++) {
+		// snapshots hold references of tuples
+		assert(*PAGED_ARRAY_GET(&C->snapshot, struct snapshot_record *, i) == NULL);
+	}
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return -1;
+	struct style_image_writer w = { f, 0, 0 };
+	struct style_image_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "STYC", 4);
+	h.version = STYLE_IMAGE_VERSION;
+	h.ptr_size = sizeof(void *);
+	h.index_size = sizeof(style_index_t);
+	h.page_bits = PAGED_ARRAY_BITS;
+	h.n = C->n;
+	h.freelist = C->freelist;
+	h.live = C->live;
+	h.empty = C->empty.idx;
+	h.frame_base = C->frame.base;
+	h.frame_cap = C->frame.cap;
+	h.park_head = C->park.head;
+	h.park_tail = C->park.tail;
+	h.park_n = C->park.n;
+	h.park_frame = C->park.frame;
+	h.park_frames = C->park.frames;
+	h.park_bytes = C->park.bytes;
+	image_write(&w, &h, sizeof(h));
+	int err = attrib_save(C->A, &w, with_inherit, C);
+	image_write_pages(&w, &C->value, NULL, NULL, NULL);
+	image_write_pages(&w, &C->edge, NULL, NULL, NULL);
+	image_write_pages(&w, &C->node, NULL, NULL, NULL);
+	image_write_pages(&w, &C->park.stamp, NULL, NULL, NULL);
+	image_write_intern(&w, &C->inherit_i);
+	// the size is known at last
+	h.size = w.offset;
+	if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1)
+		w.err = 1;
+	if (fclose(f) != 0)
+		w.err = 1;
+	if (err || w.err) {
+		remove(path);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef _WIN32
+
+static void *
+image_map(const char *path, size_t *sz, int shared, style_alloc alloc, void *ud) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+	void *ptr = NULL;
+	long len;
+	if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+		ptr = alloc(ud, NULL, 0, len);
+		if (ptr && fread(ptr, 1, len, f) != (size_t)len) {
+			alloc(ud, ptr, len, 0);
+			ptr = NULL;
+		}
+		*sz = len;
+	}
+	fclose(f);
+	return ptr;
+}
+
+static void
+image_unmap(void *ptr, size_t sz, style_alloc alloc, void *ud) {
+	alloc(ud, ptr, sz, 0);
+}
+
+#else
+
+// pages are private copy on write (or shared read only), and only read from the file when they are touched
+static void *
+image_map(const char *path, size_t *sz, int shared, style_alloc alloc, void *ud) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void *ptr = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		if (shared)
+			ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		else
+			ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (ptr == MAP_FAILED)
+			ptr = NULL;
+		*sz = st.st_size;
+	}
+	close(fd);
+	return ptr;
+}
+
+static void
+image_unmap(void *ptr, size_t sz, style_alloc alloc, void *ud) {
+	munmap(ptr, sz);
+}
+
+#endif
+
+struct style_cache *
+style_cache_load(const char *path, style_alloc alloc, void *alloc_ud) {
+	if (alloc == NULL) {
+		alloc = default_alloc;
+	}
+	size_t sz = 0;
+	void *image = image_map(path, &sz, 0, alloc, alloc_ud);
+	if (image == NULL)
+		return NULL;
+	struct style_image_header h;
+	if (sz < sizeof(h)) {
+		image_unmap(image, sz, alloc, alloc_ud);
+		return NULL;
+	}
+	memcpy(&h, image, sizeof(h));
+	if (memcmp(h.magic, "STYC", 4) != 0 || h.version != STYLE_IMAGE_VERSION || h.ptr_size != sizeof(void *)
+		|| h.index_size != sizeof(style_index_t) || h.page_bits != PAGED_ARRAY_BITS || h.size != sz) {
+		image_unmap(image, sz, alloc, alloc_ud);
+		return NULL;
+	}
+	struct style_image_reader r = { (uint8_t *)image, sz, sizeof(h) };
+	struct style_cache * c = (struct style_cache *)alloc(alloc_ud, NULL, 0, sizeof(*c));
+	c->alloc = alloc;
+	c->alloc_ud = alloc_ud;
+	c->image = image;
+	c->image_sz = sz;
+	c->A = attrib_load(&r, c);
+	c->share = c;
+	c->flushed = 0;
+	paged_array_init(&c->value, sizeof(attrib_t));
+	paged_array_init(&c->edge, sizeof(struct style_edge));
+	paged_array_init(&c->node, sizeof(struct style_node));
+	image_read_pages(&r, &c->value, c);
+	image_read_pages(&r, &c->edge, c);
+	image_read_pages(&r, &c->node, c);
+	paged_array_init(&c->park.stamp, sizeof(unsigned int));
+	image_read_pages(&r, &c->park.stamp, c);
+	image_read_intern(&r, &c->inherit_i, c);
+	c->n = h.n;
+	c->freelist = h.freelist;
+	c->live = h.live;
+	c->dead = -1;
+	c->empty.idx = h.empty;
+	c->batch.depth = 0;
+	c->batch.n = 0;
+	c->batch.cap = 0;
+	c->batch.r = NULL;
+	intern_cache_init(c, &c->batch.index, BATCH_DEFAULT_BITS);
+	c->frame.base = h.frame_base;
+	c->frame.cap = h.frame_cap;
+	c->frame.top = 0;
+	c->park.head = h.park_head;
+	c->park.tail = h.park_tail;
+	c->park.n = h.park_n;
+	c->park.frame = h.park_frame;
+	c->park.frames = h.park_frames;
+	c->park.bytes = h.park_bytes;
+	paged_array_init(&c->snapshot, sizeof(struct snapshot_record *));
+	changes_init(&c->changes);
+	paged_array_init(&c->level, sizeof(int));
+	c->level_n = 0;
+	c->reclaim.started = 0;
+	c->reclaim.pending = 0;
+	c->reclaim.quit = 0;
+	c->reclaim.active = 0;
+	c->journal = NULL;
+	undo_init(&c->undo);
+	// dirty list is not saved, rebuild it from the live inherit nodes
+	c->D = dirtylist_create(c);
+	int id;
+	for (id = c->live; id >= 0; id = style_index_get(NODE(c, id)->next)) {
+		struct style_edge *e = EDGE(c, id);
+		if (style_index_get(e->a) >= 0) {
+			add_affect(c, e->a, id);
+			add_affect(c, e->b, id);
+		}
+	}
+	for (id = c->park.head; id >= 0; id = style_index_get(NODE(c, id)->next)) {
+		struct style_edge *e = EDGE(c, id);
+		add_affect(c, e->a, id);
+		add_affect(c, e->b, id);
+	}
+	dirtylist_compact(c->D, 1);
+	return c;
+}
+
+struct style_base_header {
+	char magic[4];
+	int version;
+	int ptr_size;
+	int index_size;
+	int page_bits;
+	uint64_t size;
+};
+
+int
+style_base_save(struct style_cache *C, const char *path) {
+	style_flush_wait(C);
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return -1;
+	struct style_image_writer w = { f, 0, 0 };
+	struct style_base_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "STYB", 4);
+	h.version = STYLE_IMAGE_VERSION;
+	h.ptr_size = sizeof(void *);
+	h.index_size = sizeof(style_index_t);
+	h.page_bits = PAGED_ARRAY_BITS;
+	image_write(&w, &h, sizeof(h));
+	int err = attrib_base_save(C->A, &w, C);
+	h.size = w.offset;
+	if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1)
+		w.err = 1;
+	if (fclose(f) != 0)
+		w.err = 1;
+	if (err || w.err) {
+		remove(path);
+		return -1;
+	}
+	return 0;
+}
+
+struct style_base *
+style_base_load(const char *path) {
+	size_t sz = 0;
+	void *image = image_map(path, &sz, 1, default_alloc, NULL);
+	if (image == NULL)
+		return NULL;
+	struct style_base_header h;
+	struct attrib_base *A = NULL;
+	if (sz >= sizeof(h)) {
+		memcpy(&h, image, sizeof(h));
+		if (memcmp(h.magic, "STYB", 4) == 0 && h.version == STYLE_IMAGE_VERSION && h.ptr_size == sizeof(void *)
+			&& h.index_size == sizeof(style_index_t) && h.page_bits == PAGED_ARRAY_BITS && h.size == sz) {
+			struct style_image_reader r = { (uint8_t *)image, sz, sizeof(h) };
+			A = attrib_base_open(&r);
+		}
+	}
+	if (A == NULL) {
+		image_unmap(image, sz, default_alloc, NULL);
+		return NULL;
+	}
+	struct style_base *B = (struct style_base *)malloc(sizeof(*B));
+	B->A = A;
+	B->image = image;
+	B->sz = sz;
+	return B;
+}
+
+void
+style_base_release(struct style_base *B) {
+	if (B == NULL)
+		return;
+	attrib_base_close(B->A);
+	image_unmap(B->image, B->sz, default_alloc, NULL);
+	free(B);
+}
+
+struct style_journal *
+style_journal_create(struct style_cache *C) {
+	assert(!C->reclaim.active);
+	// the replica starts from an empty cache
+	assert(C->journal == NULL && C->n == 1);
+	struct style_journal *J = (struct style_journal *)style_malloc(C, sizeof(*J));
+	J->C = C;
+	J->b.data = NULL;
+	J->b.n = 0;
+	J->b.cap = 0;
+	paged_array_init(&J->seen, sizeof(int));
+	paged_array_init(&J->held, sizeof(int));
+	J->held_n = 0;
+	C->journal = J;
+	journal_record(C, JOURNAL_START, 1, &C->empty.idx);
+	return J;
+}
+
+void
+style_journal_release(struct style_journal *J) {
+	if (J == NULL)
+		return;
+	struct style_cache *C = J->C;
+	journal_forget(C, -1);
+	C->journal = NULL;
+	style_free(C, J->b.data, J->b.cap);
+	paged_array_deinit(&J->seen, C);
+	paged_array_deinit(&J->held, C);
+	style_free(C, J, sizeof(*J));
+}
+
+const void *
+style_journal_data(struct style_journal *J, size_t *sz) {
+	*sz = J->b.n;
+	return J->b.data;
+}
+
+void
+style_journal_clear(struct style_journal *J) {
+	J->b.n = 0;
+}
+
+// The replica holds the attrib ids of JOURNAL_KV until JOURNAL_FLUSH, as the journal does
+struct style_replica {
+	struct style_cache *C;
+	struct paged_array handle;	// int, the handle in C, indexed by the handle of journaled cache
+	struct paged_array kv;	// int, the attrib id in C, indexed by the attrib id of journaled cache
+	struct paged_array held;	// int, the attrib ids of journal in kv
+	int held_n;
+};
+
+struct style_replica *
+style_replica_create(struct style_cache *C) {
+	assert(!C->reclaim.active);
+	struct style_replica *R = (struct style_replica *)style_malloc(C, sizeof(*R));
+	R->C = C;
+	paged_array_init(&R->handle, sizeof(int));
+	paged_array_init(&R->kv, sizeof(int));
+	paged_array_init(&R->held, sizeof(int));
+	R->held_n = 0;
+	return R;
+}
+
+static void
+replica_forget(struct style_replica *R) {
+	int i;
+	for (i=0;i<R->held_n;i++) {
+		int *id = PAGED_ARRAY_GET(&R->kv, int, *PAGED_ARRAY_GET(&R->held, int, i));
+		style_attrib_release(R->C, *id);
+		*id = -1;
+	}
+	R->held_n = 0;
+}
+
+void
+style_replica_release(struct style_replica *R) {
+	if (R == NULL)
+		return;
+	struct style_cache *C = R->C;
+	replica_forget(R);
+	paged_array_deinit(&R->handle, C);
+	paged_array_deinit(&R->kv, C);
+	paged_array_deinit(&R->held, C);
+	style_free(C, R, sizeof(*R));
+}
+
+static style_handle_t
+replica_handle(struct style_replica *R, int h) {
+	assert(h >= 0 && h < paged_array_cap(&R->handle));
+	style_handle_t r = { *PAGED_ARRAY_GET(&R->handle, int, h) };
+	assert(r.idx >= 0);
+	return r;
+}
+
+style_handle_t
+style_replica_handle(struct style_replica *R, style_handle_t h) {
+	return replica_handle(R, h.idx);
+}
+
+static void
+replica_attribs(struct style_replica *R, int n, int id[]) {
+	int i;
+	for (i=0;i<n;i++) {
+		assert(id[i] < paged_array_cap(&R->kv));
+		id[i] = *PAGED_ARRAY_GET(&R->kv, int, id[i]);
+		assert(id[i] >= 0);
+	}
+}
+
+static void
+replica_compact(struct style_replica *R, struct journal_reader *r, int n) {
+	struct style_cache *C = R->C;
+	struct paged_array handle;
+	paged_array_init(&handle, sizeof(int));
+	int cap = paged_array_cap(&R->handle);
+	int i;
+	for (i=0;i<cap;i++) {
+		*map_slot(&handle, i, C) = *PAGED_ARRAY_GET(&R->handle, int, i);
+	}
+	for (i=0;i<n;i++) {
+		int from = journal_read_uint(r);
+		int to = journal_read_uint(r);
+		*map_slot(&handle, to, C) = replica_handle(R, from).idx;
+	}
+	paged_array_deinit(&R->handle, C);
+	R->handle = handle;
+	replica_forget(R);
+}
+
+size_t
+style_replica_apply(struct style_replica *R, const void *data, size_t sz) {
+	struct style_cache *C = R->C;
+	assert(!C->reclaim.active);
+	struct journal_reader r = { (const uint8_t *)data, (const uint8_t *)data + sz, 0 };
+	for (;;) {
+		const uint8_t *record = r.p;
+		if (record == r.end)
+			break;
+		// a record is applied after it's read completely
+		int op = journal_read_uint(&r);
+		int v[4];
+		int id[MAX_KEY], key[MAX_KEY];
+		int n, removed_n;
+		switch (op) {
+		case JOURNAL_START:
+			v[0] = journal_read_uint(&r);
+			if (!r.eof)
+				*map_slot(&R->handle, v[0], C) = style_null(C).idx;
+			break;
+		case JOURNAL_KV: {
+			v[0] = journal_read_uint(&r);
+			v[1] = journal_read_uint(&r);
+			struct style_attrib a;
+			a.data = (void *)journal_read_data(&r, &a.sz);
+			a.key = (uint8_t)v[1];
+			if (!r.eof) {
+				int *slot = map_slot(&R->kv, v[0], C);
+				assert(*slot < 0);
+				*slot = style_attrib_id(C, &a);
+				style_attrib_addref(C, *slot);
+				*map_slot(&R->held, R->held_n++, C) = v[0];
+			}
+			break;
+		}
+		case JOURNAL_CREATE:
+			v[0] = journal_read_uint(&r);
+			n = journal_read_list(&r, id, MAX_KEY);
+			if (!r.eof) {
+				replica_attribs(R, n, id);
+				*map_slot(&R->handle, v[0], C) = style_create(C, n, id).idx;
+			}
+			break;
+		case JOURNAL_MODIFY:
+			v[0] = journal_read_uint(&r);
+			n = journal_read_list(&r, id, MAX_KEY);
+			removed_n = journal_read_list(&r, key, MAX_KEY);
+			if (!r.eof) {
+				replica_attribs(R, n, id);
+				style_modify(C, replica_handle(R, v[0]), n, id, removed_n, key);
+			}
+			break;
+		case JOURNAL_ASSIGN:
+			v[0] = journal_read_uint(&r);
+			v[1] = journal_read_uint(&r);
+			if (!r.eof)
+				style_assign(C, replica_handle(R, v[0]), replica_handle(R, v[1]));
+			break;
+		case JOURNAL_INHERIT:
+			v[0] = journal_read_uint(&r);
+			v[1] = journal_read_uint(&r);
+			v[2] = journal_read_uint(&r);
+			v[3] = journal_read_uint(&r);
+			if (!r.eof)
+				*map_slot(&R->handle, v[0], C) = style_inherit(C, replica_handle(R, v[1]), replica_handle(R, v[2]), v[3]).idx;
+			break;
+		case JOURNAL_ADDREF:
+		case JOURNAL_RELEASE:
+			v[0] = journal_read_uint(&r);
+			if (!r.eof) {
+				if (op == JOURNAL_ADDREF)
+					style_addref(C, replica_handle(R, v[0]));
+				else
+					style_release(C, replica_handle(R, v[0]));
+			}
+			break;
+		case JOURNAL_FLUSH:
+			replica_forget(R);
+			style_flush(C);
+			break;
+		case JOURNAL_COMPACT: {
+			n = journal_read_uint(&r);
+			// check the pairs before applying them
+			const uint8_t *pairs = r.p;
+			int i;
+			for (i=0;i<n*2 && !r.eof;i++) {
+				journal_read_uint(&r);
+			}
+			if (!r.eof) {
+				r.p = pairs;
+				replica_compact(R, &r, n);
+			}
+			break;
+		}
+		case JOURNAL_FRAME:
+			v[0] = journal_read_uint(&r);
+			if (!r.eof)
+				style_frame_mode(C, v[0]);
+			break;
+		case JOURNAL_BEGIN:
+			style_begin(C);
+			break;
+		case JOURNAL_COMMIT:
+			style_commit(C);
+			break;
+		case JOURNAL_CHECKPOINT:
+			style_checkpoint(C);
+			break;
+		case JOURNAL_ROLLBACK:
+			style_rollback(C);
+			break;
+		case JOURNAL_CHECKPOINT_END:
+			style_checkpoint_end(C);
+			break;
+		default:
+			assert(0);
+		}
+		if (r.eof)
+			return record - (const uint8_t *)data;
+	}
+	return sz;
+}
+
+#ifdef STYLE_TEST_MAIN
+
+struct test_alloc {
+	size_t sz;
+};
+
+static void *
+test_alloc_func(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct test_alloc *a = (struct test_alloc *)ud;
+	if (nsize == 0) {
+		a->sz -= osize;
+		free(ptr);
+		return NULL;
+	} else {
+		a->sz += nsize;
+		a->sz -= osize;
+		return realloc(ptr, nsize);
+	}
+}
+
+#define STR(s) s, sizeof(s"")
+
+static void
+print_handle(struct style_cache *C, style_handle_t handle) {
+	printf("HANDLE = %d\n", handle.idx);
+
+	int i;
+	for (i=0;;i++) {
+		int id = style_index(C, handle, i);
+		if (id >= 0) {
+			struct style_attrib attr;
+			style_attrib_value(C, id, &attr);
+			printf("\tKey = %d , Value = %s\n", attr.key, (const char *)attr.data);
+		}
+		else {
+			break;
+		}
+	}
+}
+
+static void
+test_frame(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	style_frame_mode(C, 4);
+
+	struct style_attrib a = { STR("parent"), 1 };
+	struct style_attrib b = { STR("child"), 2 };
+	int ida = style_attrib_id(C, &a);
+	int idb = style_attrib_id(C, &b);
+	style_handle_t parent = style_create(C, 1, &ida);
+	style_handle_t child = style_create(C, 1, &idb);
+
+	int frame;
+	for (frame=0;frame<3;frame++) {
+		style_handle_t t1 = style_inherit(C, child, parent, 0);
+		style_handle_t t2 = style_inherit(C, style_null(C), t1, 0);
+		// transient nodes are reused in the frame
+		assert(style_inherit(C, child, parent, 0).idx == t1.idx);
+		assert(C->frame.top == 2);
+		assert(style_find(C, t2, 1) == ida);
+		assert(style_find(C, t2, 2) == idb);
+		style_flush(C);
+	}
+
+	// promote t2 (and t1) to regular nodes
+	style_handle_t t1 = style_inherit(C, child, parent, 0);
+	style_handle_t t2 = style_inherit(C, style_null(C), t1, 0);
+	style_addref(C, t2);
+	style_flush(C);
+	assert(style_find(C, t2, 1) == ida);
+
+	struct style_attrib c = { STR("modified"), 1 };
+	int patch[] = { style_attrib_id(C, &c) };
+	style_modify(C, parent, 1, patch, 0, NULL);
+	struct style_attrib v;
+	style_attrib_value(C, style_find(C, t2, 1), &v);
+	assert(strcmp((const char *)v.data, "modified") == 0);
+
+	style_release(C, t2);
+	style_flush(C);
+
+	// more transient nodes than the frame region
+	style_handle_t h = child;
+	int i;
+	for (i=0;i<10;i++) {
+		h = style_inherit(C, h, parent, 0);
+	}
+	assert(style_find(C, h, 2) == idb);
+	style_flush(C);
+
+	// resize the frame region, and turn it off
+	t1 = style_inherit(C, child, parent, 0);
+	style_addref(C, t1);
+	style_flush(C);
+	style_frame_mode(C, 8);
+	t2 = style_inherit(C, style_null(C), t1, 0);
+	assert(NODE(C, t2.idx)->transient && style_find(C, t2, 2) == idb);
+	style_flush(C);
+	style_frame_mode(C, 0);
+	t2 = style_inherit(C, style_null(C), t1, 0);
+	assert(!NODE(C, t2.idx)->transient && style_find(C, t2, 2) == idb);
+	style_flush(C);
+
+	// unreferenced inherit nodes are parked, and reused with their values for 2 frames
+	style_reclaim_policy(C, 0, 0);
+	style_flush(C);
+	assert(C->park.n == 0);
+	style_reclaim_policy(C, 2, 0);
+	style_handle_t p1 = style_inherit(C, parent, child, 0);
+	assert(style_find(C, p1, 2) == idb);
+	attrib_t pv = *VALUE(C, p1.idx);
+	style_flush(C);
+	assert(NODE(C, p1.idx)->parked);
+	assert(style_inherit(C, parent, child, 0).idx == p1.idx && VALUE(C, p1.idx)->idx == pv.idx);
+	style_flush(C);
+	style_flush(C);
+	assert(NODE(C, p1.idx)->parked);
+	style_flush(C);
+	assert(NODE(C, p1.idx)->refcount < 0 && C->park.n == 0);
+	// over the budget, the oldest one dies
+	style_reclaim_policy(C, -1, PARK_NODE_SIZE);
+	p1 = style_inherit(C, parent, child, 0);
+	style_flush(C);
+	style_handle_t p2 = style_inherit(C, parent, t1, 0);
+	style_flush(C);
+	assert(NODE(C, p1.idx)->refcount < 0 && NODE(C, p2.idx)->parked);
+	// at once
+	style_reclaim_policy(C, 0, 0);
+	style_flush(C);
+	assert(NODE(C, p2.idx)->refcount < 0 && C->park.n == 0);
+	style_reclaim_policy(C, 2, 0);
+
+	style_release(C, t1);
+	style_flush(C);
+
+	style_release(C, parent);
+	style_release(C, child);
+	style_flush(C);
+	style_deletecache(C);
+	assert(info.sz == 0);
+}
+
+#define COMPACT_N 64
+
+struct compact_test {
+	style_handle_t h[COMPACT_N];
+	int id[COMPACT_N];
+	style_handle_t old_h[COMPACT_N];
+	int old_id[COMPACT_N];
+};
+
+static void
+compact_remap(void *ud, int kind, int old_id, int new_id) {
+	struct compact_test *t = (struct compact_test *)ud;
+	int i;
+	for (i=0;i<COMPACT_N;i++) {
+		// match the ids before compact, the new id may be an old id of another one
+		if (kind == STYLE_REMAP_HANDLE && t->old_h[i].idx == old_id)
+			t->h[i].idx = new_id;
+		else if (kind == STYLE_REMAP_ATTRIB && t->old_id[i] == old_id)
+			t->id[i] = new_id;
+	}
+}
+
+static int
+compact_value(struct style_cache *C, style_handle_t h, uint8_t key) {
+	int id = style_find(C, h, key);
+	if (id < 0)
+		return -1;
+	struct style_attrib v;
+	style_attrib_value(C, id, &v);
+	return *(const int *)v.data;
+}
+
+static void
+test_compact(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	style_frame_mode(C, 8);
+	struct compact_test t;
+	int i;
+	for (i=0;i<COMPACT_N;i++) {
+		struct style_attrib a = { &i, sizeof(i), (uint8_t)(i % 4) };
+		t.id[i] = style_attrib_id(C, &a);
+		t.h[i] = style_create(C, 1, &t.id[i]);
+	}
+	// inherit nodes are kept in t.h[i] for even i
+	for (i=2;i<COMPACT_N;i+=2) {
+		style_handle_t r = style_inherit(C, t.h[i-1], t.h[i-2], 0);
+		style_addref(C, r);
+		style_release(C, t.h[i]);
+		t.h[i] = r;
+	}
+	for (i=1;i<COMPACT_N;i+=4) {
+		style_release(C, t.h[i]);
+		t.h[i].idx = -1;
+	}
+	// an id not referenced yet is kept
+	struct style_attrib fa = { STR("fresh"), 5 };
+	style_attrib_id(C, &fa);
+	style_flush(C);
+
+	int expect[COMPACT_N][4];
+	int j;
+	for (i=0;i<COMPACT_N;i++) {
+		for (j=0;j<4;j++) {
+			expect[i][j] = t.h[i].idx >= 0 ? compact_value(C, t.h[i], j) : -1;
+		}
+	}
+	memcpy(t.old_h, t.h, sizeof(t.h));
+	memcpy(t.old_id, t.id, sizeof(t.id));
+	style_compact(C, compact_remap, &t);
+	printf("COMPACT %d styles\n", C->n);
+	int kv_n = attrib_kv_size(C->A);
+	style_attrib_id(C, &fa);
+	assert(attrib_kv_size(C->A) == kv_n);
+	for (i=0;i<COMPACT_N;i++) {
+		for (j=0;j<4;j++) {
+			if (t.h[i].idx >= 0)
+				assert(compact_value(C, t.h[i], j) == expect[i][j]);
+		}
+	}
+
+	// dirty list and intern are rebuilt
+	int v = 1000;
+	struct style_attrib a = { &v, sizeof(v), 0 };
+	int patch = style_attrib_id(C, &a);
+	style_modify(C, t.h[0], 1, &patch, 0, NULL);
+	assert(compact_value(C, t.h[COMPACT_N-2], 0) == 1000);
+	style_handle_t r = style_inherit(C, t.h[COMPACT_N-5], t.h[COMPACT_N-6], 0);
+	assert(r.idx == t.h[COMPACT_N-4].idx);
+	// transient nodes still work
+	r = style_inherit(C, t.h[0], t.h[3], 1);
+	assert(compact_value(C, r, 3) == 3);
+
+	for (i=0;i<COMPACT_N;i++) {
+		if (t.h[i].idx >= 0)
+			style_release(C, t.h[i]);
+	}
+	style_flush(C);
+	style_deletecache(C);
+	assert(info.sz == 0);
+}
+
+// more edges than 16bit slot ids in one frame, with (frame > 0) or without transient nodes
+#define WIDE_N 200
+#define WIDE_EDGE 0x10400
+
+static void
+wide_tree(int frame) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	int n = WIDE_EDGE / 2;
+	if (frame)
+		style_frame_mode(C, n);
+	style_handle_t h[WIDE_N];
+	int i, v;
+	for (i=0;i<WIDE_N;i++) {
+		struct style_attrib a = { &i, sizeof(i), 1 };
+		int id = style_attrib_id(C, &a);
+		h[i] = style_create(C, 1, &id);
+	}
+	style_handle_t *t = (style_handle_t *)malloc(n * sizeof(style_handle_t));
+	for (i=0;i<n;i++) {
+		t[i] = style_inherit(C, h[i % WIDE_N], h[i / WIDE_N % WIDE_N], i / (WIDE_N * WIDE_N));
+		if (!frame)
+			style_addref(C, t[i]);
+		style_find(C, t[i], 1);
+	}
+	v = -1;
+	struct style_attrib a = { &v, sizeof(v), 1 };
+	int id = style_attrib_id(C, &a);
+	style_modify(C, h[0], 1, &id, 0, NULL);
+	id = style_attrib_id(C, &a);
+	for (i=0;i<n;i++) {
+		int r = style_find(C, t[i], 1);
+		assert((r == id) == (i % WIDE_N == 0));
+	}
+	free(t);
+	style_deletecache(C);
+	assert(info.sz == 0);
+}
+
+static void
+test_wide(void) {
+	wide_tree(0);
+	wide_tree(1);
+}
+
+struct extern_payload {
+	int refcount;
+	char data[64];
+};
+
+static int
+extern_equal(void *ud, const void *a, const void *b, size_t sz) {
+	return memcmp(((const struct extern_payload *)a)->data, ((const struct extern_payload *)b)->data, sizeof(((const struct extern_payload *)a)->data)) == 0;
+}
+
+static void
+extern_release(void *ud, void *ptr, size_t sz) {
+	struct extern_payload *p = (struct extern_payload *)ptr;
+	--p->refcount;
+	++*(int *)ud;
+}
+
+static void
+extern_addref(void *ud, void *ptr, size_t sz) {
+	++((struct extern_payload *)ptr)->refcount;
+}
+
+static void
+merge_handle(void *ud, int kind, int old_id, int new_id) {
+	int *h = (int *)ud;
+	if (kind == STYLE_REMAP_HANDLE && h[0] == old_id)
+		h[1] = new_id;
+}
+
+static void
+test_merge(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	int main_id[COMPACT_N/2];
+	style_handle_t main_h[COMPACT_N/2];
+	int i, j;
+	for (i=0;i<COMPACT_N/2;i++) {
+		struct style_attrib a = { &i, sizeof(i), (uint8_t)(i % 4) };
+		main_id[i] = style_attrib_id(C, &a);
+		main_h[i] = style_create(C, 1, &main_id[i]);
+	}
+
+	// staging cache, the same layout as test_compact
+	struct style_cache * S = style_newcache(NULL, NULL, NULL);
+	struct compact_test t;
+	for (i=0;i<COMPACT_N;i++) {
+		struct style_attrib a = { &i, sizeof(i), (uint8_t)(i % 4) };
+		t.id[i] = style_attrib_id(S, &a);
+		t.h[i] = style_create(S, 1, &t.id[i]);
+	}
+	for (i=2;i<COMPACT_N;i+=2) {
+		style_handle_t r = style_inherit(S, t.h[i-1], t.h[i-2], 0);
+		style_addref(S, r);
+		style_release(S, t.h[i]);
+		t.h[i] = r;
+	}
+	for (i=1;i<COMPACT_N;i+=4) {
+		style_release(S, t.h[i]);
+		t.h[i].idx = -1;
+	}
+	style_flush(S);
+	int expect[COMPACT_N][4];
+	for (i=0;i<COMPACT_N;i++) {
+		for (j=0;j<4;j++) {
+			expect[i][j] = t.h[i].idx >= 0 ? compact_value(S, t.h[i], j) : -1;
 		}
 	}
-	dump_key(indent+2, C, s->a, key, fmt);
-	dump_key(indent+2, C, s->b, key, fmt);
+	memcpy(t.old_h, t.h, sizeof(t.h));
+	memcpy(t.old_id, t.id, sizeof(t.id));
+	memset(t.id, -1, sizeof(t.id));
+	assert(style_merge(C, S, compact_remap, &t) == 0);
+	style_deletecache(S);
+
+	for (i=0;i<COMPACT_N;i++) {
+		struct style_attrib a = { &i, sizeof(i), (uint8_t)(i % 4) };
+		// the attribs of odd i are in use, they are interned by the main cache
+		assert(t.id[i] >= 0 || i % 2 == 0);
+		if (t.id[i] >= 0)
+			assert(t.id[i] == style_attrib_id(C, &a));
+		if (t.id[i] >= 0 && i < COMPACT_N/2)
+			assert(t.id[i] == main_id[i]);
+		if (t.h[i].idx < 0)
+			continue;
+		// inherit values evaluated in S are kept
+		assert(VALUE(C, t.h[i].idx)->idx >= 0);
+		for (j=0;j<4;j++) {
+			assert(compact_value(C, t.h[i], j) == expect[i][j]);
+		}
+	}
+	for (i=0;i<COMPACT_N;i++) {
+		if (t.h[i].idx >= 0)
+			style_release(C, t.h[i]);
+	}
+	for (i=0;i<COMPACT_N/2;i++) {
+		style_release(C, main_h[i]);
+	}
+	style_flush(C);
+	style_deletecache(C);
+	assert(info.sz == 0);
 }
 
-void
-style_dump_key(struct style_cache *C, style_handle_t h, uint8_t key, char fmt) {
-	dump_key(0, C, h.idx, key, fmt);
+static void
+test_extern(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	int released = 0;
+	struct style_extern by_value = { extern_equal, extern_release, &released };
+	struct style_extern by_ptr = { NULL, extern_release, &released };
+	struct extern_payload p1 = { 0, "large payload" };
+	struct extern_payload p2 = { 0, "large payload" };
+	// the cache takes one reference each time
+	p1.refcount++;
+	int id1 = style_attrib_extern(C, 1, &p1, sizeof(p1), 42, &by_value);
+	p2.refcount++;
+	int id2 = style_attrib_extern(C, 1, &p2, sizeof(p2), 42, &by_value);
+	assert(id1 == id2);
+	assert(p2.refcount == 0 && released == 1);
+	p2.refcount++;
+	int id3 = style_attrib_extern(C, 1, &p2, sizeof(p2), 42, &by_ptr);
+	assert(id3 != id1);
+
+	struct style_attrib v;
+	style_attrib_value(C, id1, &v);
+	assert(v.data == &p1 && v.sz == sizeof(p1) && v.key == 1);
+
+	style_handle_t h = style_create(C, 1, &id3);
+	assert(style_find(C, h, 1) == id3);
+	style_attrib_value(C, style_find(C, h, 1), &v);
+	assert(v.data == &p2);
+	style_release(C, h);
+	style_reclaim_policy(C, 0, 0);
+	style_flush(C);
+	assert(p2.refcount == 0 && released == 2);
+
+	style_deletecache(C);
+	assert(p1.refcount == 0 && released == 3);
+	assert(info.sz == 0);
+
+	// style_merge takes one more reference by addref, or fails
+	C = style_newcache(NULL, test_alloc_func, &info);
+	struct style_extern shared = { NULL, extern_release, &released, extern_addref };
+	struct style_cache * S = style_newcache(NULL, NULL, NULL);
+	p2.refcount++;
+	id3 = style_attrib_extern(S, 1, &p2, sizeof(p2), 42, &by_ptr);
+	h = style_create(S, 1, &id3);
+	assert(style_merge(C, S, NULL, NULL) == -1);
+	style_deletecache(S);
+	assert(p2.refcount == 0);
+	S = style_newcache(NULL, NULL, NULL);
+	p2.refcount++;
+	id3 = style_attrib_extern(S, 1, &p2, sizeof(p2), 42, &shared);
+	h = style_create(S, 1, &id3);
+	int merged[2] = { h.idx, -1 };
+	assert(style_merge(C, S, merge_handle, merged) == 0);
+	style_deletecache(S);
+	assert(p2.refcount == 1);
+	h.idx = merged[1];
+	style_attrib_value(C, style_find(C, h, 1), &v);
+	assert(v.data == &p2);
+	style_deletecache(C);
+	assert(p2.refcount == 0);
+	assert(info.sz == 0);
 }
 
-int
-style_index(struct style_cache *C, style_handle_t h, int i) {
-	attrib_t a = get_value(C, h);
-	return attrib_index(C->A, a, i);
+#define SNAPSHOT_N (SNAPSHOT_PAGE * 3)
+
+static int
+snapshot_value(const struct style_snapshot *S, int i, uint8_t key) {
+	struct style_attrib v;
+	if (!style_snapshot_find(S, i, key, &v))
+		return -1;
+	return *(const int *)v.data;
 }
 
-void
-style_flush(struct style_cache *C) {
-	int dead = C->dead;
-	if (dead < 0)
-		return;
+static void
+test_snapshot(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	style_handle_t h[SNAPSHOT_N];
+	int i;
+	for (i=0;i<SNAPSHOT_N;i++) {
+		struct style_attrib a[2] = {
+			{ &i, sizeof(i), 0 },
+			{ &i, sizeof(i), 2 },
+		};
+		int id[2] = { style_attrib_id(C, &a[0]), style_attrib_id(C, &a[1]) };
+		h[i] = style_create(C, 2, id);
+	}
+	struct style_snapshot *s1 = style_snapshot_create(C, NULL, SNAPSHOT_N, h);
+	int v = -100;
+	struct style_attrib a = { &v, sizeof(v), 2 };
+	int patch = style_attrib_id(C, &a);
+	style_modify(C, h[SNAPSHOT_PAGE + 1], 1, &patch, 0, NULL);
+	struct style_snapshot *s2 = style_snapshot_create(C, s1, SNAPSHOT_N, h);
+	// unchanged pages are shared
+	assert(s2->page[0] == s1->page[0]);
+	assert(s2->page[1] != s1->page[1]);
+	assert(s2->page[2] == s1->page[2]);
+	assert(s2->page[1]->r[0] == s1->page[1]->r[0]);
+	// the live cache keeps changing
+	for (i=0;i<SNAPSHOT_N;i++) {
+		style_release(C, h[i]);
+	}
+	style_flush(C);
+	style_compact(C, NULL, NULL);
+	assert(snapshot_value(s1, SNAPSHOT_PAGE + 1, 2) == SNAPSHOT_PAGE + 1);
+	assert(snapshot_value(s2, SNAPSHOT_PAGE + 1, 2) == -100);
+	assert(snapshot_value(s2, 5, 0) == 5);
+	assert(snapshot_value(s2, 5, 1) == -1);
+	struct style_attrib output[MAX_KEY];
+	assert(style_snapshot_export(s2, 7, output) == 2);
+	assert(*(const int *)output[2].data == 7 && output[1].data == NULL);
+	style_snapshot_release(s1);
+	style_snapshot_release(s2);
+	style_flush(C);
+	style_deletecache(C);
+	assert(info.sz == 0);
+}
 
-	for (;;) {
-		struct style *s = &C->s[dead];
-		if (s->refcount < 0)
-			break;
-		do {
-			struct style *s = &C->s[dead];
-			if (s->refcount < 0)
-				break;
-			assert(s->refcount == 0);
-			s->refcount = -1;
-			if (s->a >= 0) {
-				style_handle_t t = { s->a };
-				style_release(C, t);
-			}
-			if (s->b >= 0) {
-				style_handle_t t = { s->b };
-				style_release(C, t);
-			}
-			dead = s->next;
-		} while (dead >= 0);
-		dead = C->dead;
+// h[0, SNAPSHOT_N) : values, h[SNAPSHOT_N + i] : h[i] inherits key 1 from h[0]
+static void
+test_snapshot_changes(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	style_handle_t h[SNAPSHOT_N * 2];
+	int i;
+	for (i=0;i<SNAPSHOT_N;i++) {
+		struct style_attrib a[2] = {
+			{ &i, sizeof(i), 0 },
+			{ &i, sizeof(i), 1 },
+		};
+		int id[2] = { style_attrib_id(C, &a[0]), style_attrib_id(C, &a[1]) };
+		h[i] = style_create(C, i == 0 ? 2 : 1, id);
+	}
+	for (i=0;i<SNAPSHOT_N;i++) {
+		h[SNAPSHOT_N + i] = style_inherit(C, h[i], h[0], 0);
+		style_addref(C, h[SNAPSHOT_N + i]);
+	}
+	struct style_snapshot *s1 = style_snapshot_create(C, NULL, SNAPSHOT_N * 2, h);
+	assert(snapshot_value(s1, SNAPSHOT_N + 5, 1) == 0);
+	// the parent changes, all the inherit nodes are dirty
+	int v = -100;
+	struct style_attrib a = { &v, sizeof(v), 1 };
+	int patch = style_attrib_id(C, &a);
+	// style_modify writes the patch array
+	int p;
+	p = patch;
+	style_modify(C, h[0], 1, &p, 0, NULL);
+	struct style_snapshot *s2 = style_snapshot_create(C, s1, 0, NULL);
+	assert(s2->handles == s1->handles && C->changes.n == 0);
+	for (i=0;i<SNAPSHOT_N/SNAPSHOT_PAGE;i++) {
+		assert(s2->page[i] == s1->page[i] || i == 0);
+		assert(s2->page[SNAPSHOT_N/SNAPSHOT_PAGE + i] != s1->page[SNAPSHOT_N/SNAPSHOT_PAGE + i]);
 	}
+	assert(snapshot_value(s2, 0, 1) == -100);
+	assert(snapshot_value(s2, SNAPSHOT_N + 5, 1) == -100);
+	assert(snapshot_value(s2, SNAPSHOT_N + 5, 0) == 5);
+	assert(snapshot_value(s1, SNAPSHOT_N + 5, 1) == 0);
+	assert(s2->page[2]->r[0] == s1->page[2]->r[0]);
+	// a reverted change is read again
+	style_checkpoint(C);
+	p = patch;
+	style_modify(C, h[7], 1, &p, 0, NULL);
+	struct style_snapshot *s3 = style_snapshot_create(C, s2, 0, NULL);
+	assert(snapshot_value(s3, 7, 1) == -100);
+	style_rollback(C);
+	struct style_snapshot *s4 = style_snapshot_create(C, s3, 0, NULL);
+	assert(snapshot_value(s4, 7, 1) == -1);
+	assert(s4->page[0] != s3->page[0] && s4->page[1] == s3->page[1]);
+	style_snapshot_release(s3);
+	// s2 is not the last one, all the handles are read
+	p = patch;
+	style_modify(C, h[SNAPSHOT_PAGE], 1, &p, 0, NULL);
+	struct style_snapshot *s5 = style_snapshot_create(C, s2, 0, NULL);
+	assert(snapshot_value(s5, SNAPSHOT_PAGE, 1) == -100);
+	assert(snapshot_value(s5, 7, 1) == -1);
+	assert(s5->page[2] == s2->page[2]);
+	// too many changes, all the handles are read
+	v = -200;
+	int patch2 = style_attrib_id(C, &a);
+	for (i=0;i<SNAPSHOT_N;i++) {
+		p = patch2;
+		style_modify(C, h[i], 1, &p, 0, NULL);
+	}
+	for (i=0;i<SNAPSHOT_N;i++) {
+		p = patch;
+		style_modify(C, h[i], 1, &p, 0, NULL);
+	}
+	assert(C->changes.n > C->changes.limit);
+	struct style_snapshot *s6 = style_snapshot_create(C, s5, 0, NULL);
+	assert(snapshot_value(s6, SNAPSHOT_N - 1, 1) == -100);
+	assert(snapshot_value(s6, SNAPSHOT_N * 2 - 1, 1) == -100);
+	style_snapshot_release(s1);
+	style_snapshot_release(s2);
+	style_snapshot_release(s4);
+	style_snapshot_release(s5);
+	style_snapshot_release(s6);
+	for (i=0;i<SNAPSHOT_N*2;i++) {
+		style_release(C, h[i]);
+	}
+	style_flush(C);
+	style_deletecache(C);
+	assert(info.sz == 0);
+}
 
-	for (;;) {
-		struct style *s = &C->s[dead];
-		dirtylist_clear(C->D, dead);
-		if (s->next < 0) {
-			s->next = C->freelist;
-			C->freelist = C->dead;
-			C->dead = -1;
-			return;
+static void
+test_flush_async(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	style_frame_mode(C, 16);
+	// the inherit nodes are not parked
+	style_reclaim_policy(C, 0, 0);
+	style_handle_t h[SNAPSHOT_N];
+	int i;
+	for (i=0;i<SNAPSHOT_N;i++) {
+		struct style_attrib a = { &i, sizeof(i), 0 };
+		int id = style_attrib_id(C, &a);
+		h[i] = style_create(C, 1, &id);
+	}
+	struct style_snapshot *s = style_snapshot_create(C, NULL, SNAPSHOT_N, h);
+	style_handle_t r = h[0];
+	style_addref(C, r);
+	for (i=1;i<SNAPSHOT_N;i++) {
+		style_handle_t t = style_inherit(C, h[i], r, 0);
+		style_addref(C, t);
+		style_release(C, r);
+		r = t;
+	}
+	assert(compact_value(C, r, 0) == SNAPSHOT_N - 1);
+	style_release(C, r);
+	for (i=0;i<SNAPSHOT_N;i++) {
+		style_release(C, h[i]);
+	}
+	int n = C->n;
+	style_flush_async(C);
+	// the dead list is handed to the worker
+	assert(C->dead < 0);
+	// snapshots don't touch the cache, read them while the dead nodes are reclaimed
+	for (i=0;i<SNAPSHOT_N;i++) {
+		assert(snapshot_value(s, i, 0) == i);
+	}
+	style_flush_wait(C);
+	assert(C->dead < 0);
+	style_snapshot_release(s);
+	// the slots are reusable now
+	style_handle_t x = style_create(C, 0, NULL);
+	assert(x.idx < n);
+	style_release(C, x);
+	style_flush_async(C);
+	// style_deletecache waits for the worker
+	style_deletecache(C);
+	assert(info.sz == 0);
+}
+
+#define IMAGE_N 2000
+
+static void
+test_image(void) {
+	const char *path = "test_image.tmp";
+	struct style_cache * C = style_newcache(NULL, NULL, NULL);
+	style_handle_t h[IMAGE_N];
+	int id[IMAGE_N];
+	char buf[32];
+	int i;
+	for (i=0;i<IMAGE_N;i++) {
+		// a blob and an embedded value
+		snprintf(buf, sizeof(buf), "image string %d", i % 100);
+		struct style_attrib a[2] = {
+			{ buf, strlen(buf) + 1, 1 },
+			{ &i, sizeof(i), 2 },
+		};
+		int kv[2] = { style_attrib_id(C, &a[0]), style_attrib_id(C, &a[1]) };
+		id[i] = kv[1];
+		h[i] = style_create(C, 2, kv);
+	}
+	// a binary tree, h[0] is the root
+	for (i=1;i<IMAGE_N;i++) {
+		style_handle_t r = style_inherit(C, h[i], h[(i-1)/2], 0);
+		style_addref(C, r);
+		style_release(C, h[i]);
+		h[i] = r;
+	}
+	// evaluated values are saved too
+	assert(compact_value(C, h[IMAGE_N-1], 2) == IMAGE_N-1);
+	style_flush(C);
+	assert(style_cache_save(C, path, 1) == 0);
+	style_deletecache(C);
+
+	struct test_alloc info = { 0 };
+	C = style_cache_load(path, test_alloc_func, &info);
+	assert(C != NULL);
+	for (i=0;i<IMAGE_N;i++) {
+		struct style_attrib a = { &i, sizeof(i), 2 };
+		// lookup by the saved intern table
+		assert(style_attrib_id(C, &a) == id[i]);
+		assert(compact_value(C, h[i], 2) == i);
+		struct style_attrib v;
+		style_attrib_value(C, style_find(C, h[i], 1), &v);
+		snprintf(buf, sizeof(buf), "image string %d", i % 100);
+		assert(strcmp((const char *)v.data, buf) == 0);
+	}
+	// the loaded cache can be changed
+	int v = -1;
+	struct style_attrib a = { &v, sizeof(v), 2 };
+	int patch = style_attrib_id(C, &a);
+	assert(style_modify(C, h[0], 1, &patch, 0, NULL));
+	assert(compact_value(C, h[1], 2) == 1);
+	style_release(C, h[0]);
+	assert(compact_value(C, h[IMAGE_N-1], 2) == IMAGE_N-1);
+	for (i=1;i<IMAGE_N;i++) {
+		style_release(C, h[i]);
+	}
+	style_flush(C);
+	style_compact(C, NULL, NULL);
+	style_deletecache(C);
+	assert(info.sz == 0);
+	remove(path);
+}
+
+#define BASE_N 1000
+
+static void
+test_base(void) {
+	const char *path = "test_base.tmp";
+	struct style_cache * C = style_newcache(NULL, NULL, NULL);
+	int id[BASE_N][2];
+	char buf[32];
+	int i, j;
+	for (i=0;i<BASE_N;i++) {
+		snprintf(buf, sizeof(buf), "base string %d", i);
+		struct style_attrib a[2] = {
+			{ buf, strlen(buf) + 1, 1 },
+			{ &i, sizeof(i), 2 },
+		};
+		id[i][0] = style_attrib_id(C, &a[0]);
+		id[i][1] = style_attrib_id(C, &a[1]);
+		style_create(C, 2, id[i]);
+	}
+	assert(style_base_save(C, path) == 0);
+	style_deletecache(C);
+
+	struct style_base *B = style_base_load(path);
+	assert(B != NULL);
+	struct test_alloc info[2] = { { 0 }, { 0 } };
+	struct style_cache *S[2];
+	int v = -1;
+	struct style_attrib a = { &v, sizeof(v), 2 };
+	int newid[2];
+	for (j=0;j<2;j++) {
+		C = S[j] = style_newcache_base(NULL, B, test_alloc_func, &info[j]);
+		// new ids are after base
+		newid[j] = style_attrib_id(C, &a);
+		for (i=0;i<BASE_N;i++) {
+			snprintf(buf, sizeof(buf), "base string %d", i);
+			struct style_attrib e[2] = {
+				{ buf, strlen(buf) + 1, 1 },
+				{ &i, sizeof(i), 2 },
+			};
+			assert(style_attrib_id(C, &e[0]) == id[i][0]);
+			assert(style_attrib_id(C, &e[1]) == id[i][1]);
+			assert(newid[j] > id[i][0] && newid[j] > id[i][1]);
+		}
+	}
+	assert(newid[0] == newid[1]);
+	for (j=0;j<2;j++) {
+		C = S[j];
+		style_handle_t h[BASE_N];
+		for (i=0;i<BASE_N;i++) {
+			h[i] = style_create(C, 2, id[i]);
+			assert(compact_value(C, h[i], 2) == i);
+		}
+		// the base is mapped read only, values are changed in the cache
+		assert(style_modify(C, h[0], 1, &newid[j], 0, NULL));
+		assert(compact_value(C, h[0], 2) == -1);
+		style_handle_t r = style_inherit(C, h[1], h[0], 0);
+		assert(compact_value(C, r, 2) == 1);
+		for (i=0;i<BASE_N;i++) {
+			style_release(C, h[i]);
 		}
-		dead = s->next;
+		style_flush(C);
+		style_flush(C);
+		style_flush(C);
+		style_compact(C, NULL, NULL);
+		struct style_attrib e = { &i, sizeof(i), 2 };
+		for (i=0;i<BASE_N;i++) {
+			assert(style_attrib_id(C, &e) == id[i][1]);
+		}
+		// a cache with base can't be saved
+		assert(style_cache_save(C, "test_base_cache.tmp", 0) != 0);
+	}
+	for (j=0;j<2;j++) {
+		style_deletecache(S[j]);
+		assert(info[j].sz == 0);
 	}
+	style_base_release(B);
+	remove(path);
 }
 
-#ifdef STYLE_TEST_MAIN
+static void
+test_shared(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	struct style_cache * S = style_newcache_shared(C);
+	int v[3] = { 1, 2, 3 };
+	struct style_attrib a[3] = {
+		{ &v[0], sizeof(int), 1 },
+		{ &v[1], sizeof(int), 2 },
+		{ STR("shared"), 3 },
+	};
+	int id[3];
+	int i;
+	for (i=0;i<3;i++) {
+		id[i] = style_attrib_id(C, &a[i]);
+		assert(style_attrib_id(S, &a[i]) == id[i]);
+	}
+	// some garbage before the live styles, so compact moves them
+	style_handle_t g[10];
+	for (i=0;i<10;i++) {
+		g[i] = style_create(C, 1, &id[i % 2]);
+	}
+	style_handle_t c1 = style_create(C, 2, id);
+	style_handle_t c2 = style_create(C, 1, &id[2]);
+	for (i=0;i<10;i++) {
+		style_release(C, g[i]);
+	}
+	style_handle_t s1 = style_create(S, 2, id);
+	style_handle_t s2 = style_create(S, 1, &id[2]);
+	assert(!style_compare_shared(C, c1, S, s1));
+	assert(style_compare_shared(C, c1, S, s2));
+	style_handle_t cr = style_inherit(C, c2, c1, 0);
+	style_handle_t sr = style_inherit(S, s2, s1, 0);
+	style_addref(C, cr);
+	style_addref(S, sr);
+	assert(!style_compare_shared(C, cr, S, sr));
+	assert(style_cache_save(S, "test_shared.tmp", 0) != 0);
 
-struct test_alloc {
-	size_t sz;
-};
+	int nv = 9;
+	struct style_attrib na = { &nv, sizeof(nv), 1 };
+	int patch = style_attrib_id(S, &na);
+	assert(style_modify(S, s2, 1, &patch, 0, NULL));
+	assert(style_compare_shared(C, cr, S, sr));
+	assert(compact_value(C, c2, 1) < 0);
 
-static void *
-test_alloc_func(void *ud, void *ptr, size_t osize, size_t nsize) {
-	struct test_alloc *a = (struct test_alloc *)ud;
-	if (nsize == 0) {
-		a->sz -= osize;
-		free(ptr);
-		return NULL;
-	} else {
-		a->sz += nsize;
-		a->sz -= osize;
-		return realloc(ptr, nsize);
+	style_flush_async(S);
+	style_flush(C);
+	static struct compact_test t;
+	memset(&t, -1, sizeof(t));
+	t.old_h[0] = t.h[0] = c1;
+	t.old_h[1] = t.h[1] = c2;
+	t.old_h[2] = t.h[2] = cr;
+	style_compact(C, compact_remap, &t);
+	c1 = t.h[0];
+	c2 = t.h[1];
+	cr = t.h[2];
+	assert(c1.idx != t.old_h[0].idx);
+	// tuple ids in S are remapped too
+	assert(compact_value(S, sr, 2) == 2);
+	assert(compact_value(S, sr, 1) == 9);
+	assert(compact_value(C, cr, 1) == 1);
+	assert(!style_compare_shared(S, s1, C, c1));
+
+	// a frame of attribs passes when both of them are flushed
+	style_flush(C);
+	style_flush(S);
+	style_reclaim_policy(C, 1, 0);
+	char big[256] = "frame";
+	struct style_attrib fa = { big, sizeof(big), 4 };
+	int fid = style_attrib_id(C, &fa);
+	style_attrib_addref(C, fid);
+	style_attrib_release(C, fid);
+	size_t sz = info.sz;
+	style_flush(C);
+	style_flush(C);
+	assert(info.sz == sz);
+	style_flush(S);
+	assert(info.sz == sz);
+	style_flush(C);
+	assert(info.sz < sz);
+	style_release(C, c2);
+
+	// the tuples of C are released, S keeps its references
+	style_deletecache(C);
+	assert(attrib_refcount(S->A, *VALUE(S, s1.idx)) == 1);
+	assert(compact_value(S, sr, 3) == compact_value(S, s2, 3));
+	style_flush(S);
+	style_deletecache(S);
+	assert(info.sz == 0);
+}
+
+#define JOURNAL_N 32
+
+static void
+journal_sync(struct style_journal *J, struct style_replica *R, int chunk) {
+	size_t sz;
+	const uint8_t *data = (const uint8_t *)style_journal_data(J, &sz);
+	// feed it in small chunks, as a stream
+	size_t offset = 0, pending = 0;
+	while (offset + pending < sz) {
+		pending += chunk;
+		if (offset + pending > sz)
+			pending = sz - offset;
+		size_t n = style_replica_apply(R, data + offset, pending);
+		offset += n;
+		pending -= n;
 	}
+	assert(pending == 0);
+	style_journal_clear(J);
 }
 
-#define STR(s) s, sizeof(s"")
+static void
+journal_check(struct style_cache *P, struct style_cache *C, struct style_replica *R, int n, style_handle_t h[]) {
+	int i, k;
+	for (i=0;i<n;i++) {
+		struct style_attrib a[128], b[128];
+		int count = style_export(P, h[i], a);
+		assert(style_export(C, style_replica_handle(R, h[i]), b) == count);
+		for (k=0;k<128;k++) {
+			assert((a[k].data == NULL) == (b[k].data == NULL));
+			if (a[k].data)
+				assert(a[k].sz == b[k].sz && memcmp(a[k].data, b[k].data, a[k].sz) == 0);
+		}
+	}
+}
 
 static void
-print_handle(struct style_cache *C, style_handle_t handle) {
-	printf("HANDLE = %d\n", handle.idx);
+test_journal(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * P = style_newcache(NULL, test_alloc_func, &info);
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	struct style_journal *J = style_journal_create(P);
+	struct style_replica *R = style_replica_create(C);
+	style_handle_t h[JOURNAL_N];
+	char buf[32];
+	int i, round;
+	for (i=0;i<JOURNAL_N;i++) {
+		snprintf(buf, sizeof(buf), "journal %d", i);
+		struct style_attrib a[2] = {
+			{ buf, strlen(buf) + 1, 1 },
+			{ &i, sizeof(i), 2 },
+		};
+		int id[2] = { style_attrib_id(P, &a[0]), style_attrib_id(P, &a[1]) };
+		h[i] = style_create(P, 2, id);
+	}
+	journal_sync(J, R, 3);
+	journal_check(P, C, R, JOURNAL_N, h);
+	for (round=0;round<20;round++) {
+		style_begin(P);
+		for (i=0;i<JOURNAL_N;i+=3) {
+			int v = round * 100 + i;
+			struct style_attrib a = { &v, sizeof(v), 3 };
+			int id = style_attrib_id(P, &a);
+			int removed = 1;
+			style_modify(P, h[i], 1, &id, round % 2, &removed);
+		}
+		style_commit(P);
+		style_assign(P, h[round % JOURNAL_N], h[(round * 7 + 1) % JOURNAL_N]);
+		style_handle_t t[JOURNAL_N];
+		for (i=1;i<JOURNAL_N;i++) {
+			t[i] = style_inherit(P, h[i], h[(i - 1) / 2], i % 2);
+		}
+		journal_sync(J, R, 7);
+		journal_check(P, C, R, JOURNAL_N - 1, t + 1);
+		// replace one style
+		i = round % JOURNAL_N;
+		snprintf(buf, sizeof(buf), "round %d", round);
+		struct style_attrib a = { buf, strlen(buf) + 1, 1 };
+		int id = style_attrib_id(P, &a);
+		style_release(P, h[i]);
+		h[i] = style_create(P, 1, &id);
+		style_addref(P, t[JOURNAL_N - 1]);
+		style_release(P, t[JOURNAL_N - 1]);
+		style_flush(P);
+		if (round == 5)
+			style_frame_mode(P, 16);
+		if (round % 4 == 3) {
+			struct compact_test ct;
+			memset(&ct, -1, sizeof(ct));
+			for (i=0;i<JOURNAL_N;i++) {
+				ct.old_h[i] = ct.h[i] = h[i];
+			}
+			style_compact(P, compact_remap, &ct);
+			memcpy(h, ct.h, sizeof(h));
+		}
+		journal_sync(J, R, 1 + round);
+		journal_check(P, C, R, JOURNAL_N, h);
+	}
+	for (i=0;i<JOURNAL_N;i++) {
+		style_release(P, h[i]);
+	}
+	style_flush(P);
+	journal_sync(J, R, 64);
+	style_replica_release(R);
+	style_deletecache(P);
+	style_deletecache(C);
+	assert(info.sz == 0);
+}
+
+#define CHECKPOINT_N 16
 
+static int
+checkpoint_attrib(struct style_cache *C, int key, int v) {
+	struct style_attrib a = { &v, sizeof(v), key };
+	return style_attrib_id(C, &a);
+}
+
+// the styles must be the same as the saved state, except the nodes after n
+static void
+checkpoint_check(struct style_cache *C, int n, const struct undo_record s[]) {
 	int i;
-	for (i=0;;i++) {
-		int id = style_index(C, handle, i);
-		if (id >= 0) {
-			struct style_attrib attr;
-			style_attrib_value(C, id, &attr);
-			printf("\tKey = %d , Value = %s\n", attr.key, (const char *)attr.data);
+	assert(C->n == n);
+	for (i=0;i<n;i++) {
+		struct style_node *node = NODE(C, i);
+		struct style_edge *edge = EDGE(C, i);
+		assert(VALUE(C, i)->idx == s[i].value.idx);
+		assert(edge->a == s[i].edge.a && edge->b == s[i].edge.b);
+		assert(node->prev == s[i].node.prev && node->next == s[i].node.next);
+		assert(node->refcount == s[i].node.refcount);
+		assert(node->withmask == s[i].node.withmask && node->transient == s[i].node.transient);
+	}
+}
+
+static void
+test_checkpoint(void) {
+	struct test_alloc info = { 0 };
+	struct style_cache * C = style_newcache(NULL, test_alloc_func, &info);
+	struct style_cache * R = style_newcache(NULL, test_alloc_func, &info);
+	struct style_journal *J = style_journal_create(C);
+	struct style_replica *RR = style_replica_create(R);
+	style_frame_mode(C, CHECKPOINT_N * 2);
+	style_handle_t h[CHECKPOINT_N], t[CHECKPOINT_N];
+	int i, round;
+	for (i=0;i<CHECKPOINT_N;i++) {
+		int id = checkpoint_attrib(C, 1, i);
+		h[i] = style_create(C, 1, &id);
+	}
+	for (i=1;i<CHECKPOINT_N;i++) {
+		t[i] = style_inherit(C, h[i], h[(i - 1) / 2], 0);
+		style_addref(C, t[i]);
+	}
+	for (round=0;round<4;round++) {
+		// free slots for style_create in checkpoint
+		int id = checkpoint_attrib(C, 2, round);
+		style_release(C, style_create(C, 1, &id));
+		style_release(C, style_create(C, 1, &id));
+		style_flush(C);
+		style_handle_t u = style_inherit(C, h[3], h[1], 1);
+		int value[CHECKPOINT_N];
+		for (i=1;i<CHECKPOINT_N;i++) {
+			value[i] = style_find(C, t[i], 1);
 		}
-		else {
-			break;
+		int n = C->n;
+		int freelist = C->freelist, live = C->live, dead = C->dead, top = C->frame.top;
+		struct undo_record *s = (struct undo_record *)malloc(n * sizeof(*s));
+		for (i=0;i<n;i++) {
+			s[i].value = *VALUE(C, i);
+			s[i].edge = *EDGE(C, i);
+			s[i].node = *NODE(C, i);
+		}
+
+		style_checkpoint(C);
+		// the patch is overwritten by style_modify
+		id = checkpoint_attrib(C, 1, 100 + round);
+		style_modify(C, h[0], 1, &id, 0, NULL);
+		id = checkpoint_attrib(C, 1, 100 + round);
+		style_modify(C, h[5], 1, &id, 0, NULL);
+		style_begin(C);
+		id = checkpoint_attrib(C, 3, round);
+		style_modify(C, h[6], 1, &id, 0, NULL);
+		style_commit(C);
+		style_assign(C, h[7], h[8]);
+		id = checkpoint_attrib(C, 3, round);
+		style_handle_t x = style_create(C, 1, &id);
+		style_handle_t y = style_create(C, 1, &id);
+		style_handle_t xy = style_inherit(C, x, t[3], 0);
+		style_addref(C, xy);
+		style_addref(C, u);
+		style_release(C, t[4]);
+		style_release(C, y);
+		// the frame is full, the others are new nodes
+		for (i=1;i<CHECKPOINT_N;i++) {
+			style_addref(C, style_inherit(C, t[i], x, 0));
+			style_addref(C, style_inherit(C, t[i], x, 1));
+		}
+		for (i=1;i<CHECKPOINT_N;i++) {
+			style_find(C, t[i], 1);
+		}
+		assert(style_find(C, t[5], 1) != value[5]);
+		assert(style_find(C, xy, 3) >= 0);
+		style_rollback(C);
+
+		checkpoint_check(C, n, s);
+		assert(C->freelist == freelist && C->live == live && C->dead == dead && C->frame.top == top);
+		for (i=1;i<CHECKPOINT_N;i++) {
+			assert(style_find(C, t[i], 1) == value[i]);
 		}
+		free(s);
+
+		// keep the changes
+		style_checkpoint(C);
+		id = checkpoint_attrib(C, 4, round);
+		style_modify(C, h[round], 1, &id, 0, NULL);
+		style_checkpoint_end(C);
+		assert(style_find(C, h[round], 4) == checkpoint_attrib(C, 4, round));
+		style_flush(C);
+		journal_sync(J, RR, 5);
+		journal_check(C, R, RR, CHECKPOINT_N, h);
+		journal_check(C, R, RR, CHECKPOINT_N - 1, t + 1);
+	}
+	for (i=1;i<CHECKPOINT_N;i++) {
+		style_release(C, t[i]);
+	}
+	for (i=0;i<CHECKPOINT_N;i++) {
+		style_release(C, h[i]);
+	}
+	style_flush(C);
+	journal_sync(J, RR, 64);
+	style_replica_release(RR);
+	style_deletecache(C);
+	style_deletecache(R);
+	assert(info.sz == 0);
+}
+
+#define EVAL_W 5000	// more than EVAL_CHUNK in a level, the workers run several chunks
+
+static struct style_cache *
+eval_tree(style_handle_t h[EVAL_W], int nthread) {
+	struct style_cache * C = style_newcache(NULL, NULL, NULL);
+	int v = 0;
+	struct style_attrib a = { &v, sizeof(v), 0 };
+	int id = style_attrib_id(C, &a);
+	style_handle_t root = style_create(C, 1, &id);
+	int i;
+	for (i=0;i<EVAL_W;i++) {
+		struct style_attrib k1 = { &i, sizeof(i), 1 };
+		struct style_attrib k2 = { &i, sizeof(i), 2 };
+		int id1 = style_attrib_id(C, &k1);
+		int id2 = style_attrib_id(C, &k2);
+		style_handle_t m = style_inherit(C, style_create(C, 1, &id1), root, 0);
+		h[i] = style_inherit(C, style_create(C, 1, &id2), m, 0);
+		style_addref(C, h[i]);
+	}
+	// theme changes, all the inherit nodes are dirty
+	v = 42;
+	id = style_attrib_id(C, &a);
+	style_modify(C, root, 1, &id, 0, NULL);
+	style_eval_parallel(C, EVAL_W, h, nthread);
+	return C;
+}
+
+static void
+test_eval_parallel(void) {
+	style_handle_t h1[EVAL_W];
+	style_handle_t h8[EVAL_W];
+	struct style_cache *C1 = eval_tree(h1, 1);
+	struct style_cache *C8 = eval_tree(h8, 8);
+	int i;
+	for (i=0;i<EVAL_W;i++) {
+		// evaluated, and the ids don't depend on threads
+		assert(VALUE(C8, h8[i].idx)->idx >= 0);
+		assert(VALUE(C1, h1[i].idx)->idx == VALUE(C8, h8[i].idx)->idx);
+		assert(compact_value(C8, h8[i], 0) == 42);
+		assert(compact_value(C8, h8[i], 1) == i);
+		assert(compact_value(C8, h8[i], 2) == i);
 	}
+	// the levels are kept for the next call
+	for (i=0;i<C8->n;i++) {
+		assert(*LEVEL(C8, i) == -1);
+	}
+	int v = 43;
+	struct style_attrib a = { &v, sizeof(v), 0 };
+	int id = style_attrib_id(C8, &a);
+	// h = inherit(k2, inherit(k1, root))
+	style_handle_t root = { EDGE(C8, EDGE(C8, h8[0].idx)->b)->b };
+	style_modify(C8, root, 1, &id, 0, NULL);
+	style_eval_parallel(C8, EVAL_W, h8, 8);
+	for (i=0;i<EVAL_W;i++) {
+		assert(compact_value(C8, h8[i], 0) == 43);
+		assert(*LEVEL(C8, h8[i].idx) == -1);
+	}
+	style_deletecache(C1);
+	style_deletecache(C8);
 }
 
 int
 main() {
 	unsigned char inherit_mask[MAX_KEY] = { 0 };
-	struct test_alloc info;
+	struct test_alloc info = { 0 };
 	struct style_cache * C = style_newcache(inherit_mask, test_alloc_func, &info);
 
 	struct style_attrib a[] = {
@@ -584,7 +4506,8 @@ main() {
 	printf("h1 = %d, h2 = %d\n", h1.idx, h2.idx);
 
 	style_handle_t h3 = style_inherit(C, h1, h2, 0);
-	style_handle_t h4 = style_inherit(C, h1, h2, 0);	// will release after style_flush()
+	style_handle_t h4 = style_inherit(C, h1, h2, 0);	// the same node of h3
+	assert(h3.idx == h4.idx);
 	style_inherit(C, h4, h3, 0);	// will release after style_flush()
 
 	style_addref(C, h3);
@@ -618,6 +4541,101 @@ main() {
 
 	print_handle(C, h5);
 
+	uint8_t keys[] = { 2, 3, 1 };
+	int ids[3];
+	int found = style_find_many(C, h5, 3, keys, ids);
+	assert(found == 2);
+	assert(ids[0] == style_find(C, h5, 2));
+	assert(ids[1] < 0);
+	assert(ids[2] == style_find(C, h5, 1));
+
+	struct style_attrib all[MAX_KEY];
+	int count = style_export(C, h5, all);
+	assert(count == 2);
+	assert(all[0].data == NULL);
+	printf("EXPORT [1] = %s , [2] = %s\n", (const char *)all[1].data, (const char *)all[2].data);
+
+	struct fetch_test {
+		char key1[16];
+		int missing;
+		char key2[4];
+	} ft;
+	int missing_default = 42;
+	struct style_schema_field fields[] = {
+		{ 2, offsetof(struct fetch_test, key2), sizeof(ft.key2), NULL },
+		{ 3, offsetof(struct fetch_test, missing), sizeof(ft.missing), &missing_default },
+		{ 1, offsetof(struct fetch_test, key1), sizeof(ft.key1), NULL },
+	};
+	struct style_schema *schema = style_schema_create(C, sizeof(fields)/sizeof(fields[0]), fields);
+	found = style_fetch(C, h5, schema, &ft);
+	assert(found == 2);
+	assert(ft.missing == 42);
+	assert(strcmp(ft.key1, "hello world") == 0);
+	assert(memcmp(ft.key2, "WORL", 4) == 0);
+	style_schema_release(C, schema);
+
+	int before = style_find(C, h5, 2);
+	style_begin(C);
+	struct style_attrib kv2 = { STR("BATCH"), 2 };
+	int patch2[] = { style_attrib_id(C, &kv2) };
+	style_modify(C, h1, 1, patch2, 0, NULL);
+	patch2[0] = style_attrib_id(C, &kv);
+	style_modify(C, h1, 1, patch2, 0, NULL);
+	assert(style_find(C, h5, 2) == before);
+	style_commit(C);
+	assert(style_find(C, h5, 2) == before);
+	style_attrib_value(C, style_find(C, h5, 2), &kv2);
+	assert(strcmp((const char *)kv2.data, "WORLD") == 0);
+
+	style_begin(C);
+	struct style_attrib kv3 = { STR("COMMIT"), 2 };
+	int patch3[] = { style_attrib_id(C, &kv3) };
+	style_modify(C, h1, 1, patch3, 0, NULL);
+	style_commit(C);
+	style_attrib_value(C, style_find(C, h5, 2), &kv3);
+	assert(strcmp((const char *)kv3.data, "COMMIT") == 0);
+
+	// the ids staged hold references, so they survive the release by others
+	style_reclaim_policy(C, 0, 1);
+	struct style_attrib kv4 = { STR("STAGED"), 2 };
+	int patch4[] = { style_attrib_id(C, &kv4) };
+	style_begin(C);
+	style_modify(C, h1, 1, patch4, 0, NULL);
+	style_attrib_addref(C, patch4[0]);
+	style_attrib_release(C, patch4[0]);
+	style_commit(C);
+	style_attrib_value(C, style_find(C, h5, 2), &kv4);
+	assert(strcmp((const char *)kv4.data, "STAGED") == 0);
+	style_reclaim_policy(C, 2, 0);
+
+	// assign is staged too, the node and its dependents change together at commit
+	struct style_attrib kv5 = { STR("ASSIGN"), 2 };
+	int id5 = style_attrib_id(C, &kv5);
+	style_handle_t h6 = style_create(C, 1, &id5);
+	before = style_find(C, h5, 2);
+	style_begin(C);
+	assert(style_assign(C, h1, h6) == 1);
+	assert(style_assign(C, h1, h6) == 0);
+	assert(style_find(C, h1, 2) == before);
+	assert(style_find(C, h5, 2) == before);
+	style_commit(C);
+	assert(style_find(C, h1, 2) == id5);
+	assert(style_find(C, h5, 2) == id5);
+	style_release(C, h6);
+
+	// unreferenced inherit nodes are parked, and reused with their values for 2 frames
+	style_handle_t p1 = style_inherit(C, h1, h2, 1);
+	style_find(C, p1, 2);
+	attrib_t pv = *VALUE(C, p1.idx);
+	style_flush(C);
+	assert(NODE(C, p1.idx)->parked);
+	assert(style_inherit(C, h1, h2, 1).idx == p1.idx && VALUE(C, p1.idx)->idx == pv.idx);
+	style_flush(C);
+	style_flush(C);
+	assert(NODE(C, p1.idx)->parked);
+	style_flush(C);
+	assert(NODE(C, p1.idx)->refcount < 0 && !NODE(C, p1.idx)->parked);
+
 	style_release(C, h3);
 
 	style_flush(C);
@@ -626,6 +4644,21 @@ main() {
 
 	assert(info.sz == 0);
 
+	test_frame();
+	test_compact();
+	test_wide();
+	test_merge();
+	test_extern();
+	test_snapshot();
+	test_snapshot_changes();
+	test_flush_async();
+	test_image();
+	test_base();
+	test_shared();
+	test_journal();
+	test_checkpoint();
+	test_eval_parallel();
+
 	return 0;
 }
 #endif
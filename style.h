@@ -13,13 +13,44 @@ struct style_attrib {
 	uint8_t key;
 };
 
+// An extern attrib borrows the pointer instead of copying the value.
+// equal == NULL means pointer identity, release (can be NULL) is called when the entry is freed.
+// addref takes one more reference for style_merge, extern attribs can't be merged when it's NULL
+struct style_extern {
+	int (*equal)(void *ud, const void *a, const void *b, size_t sz);	// return 1 when equal
+	void (*release)(void *ud, void *ptr, size_t sz);
+	void *ud;
+	void (*addref)(void *ud, void *ptr, size_t sz);
+};
+
+struct style_schema;
+struct style_snapshot;
+
+struct style_schema_field {
+	uint8_t key;
+	size_t offset;
+	size_t sz;
+	const void *def;	// NULL means zero
+};
+
 typedef void * (*style_alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 
 struct style_cache * style_newcache(const unsigned char inherit_mask[128], style_alloc alloc, void *ud);
 void style_deletecache(struct style_cache *);
+// The new cache shares the attribs (and inherit results) of from, but has its own styles. Caches sharing attribs are
+// used in the same thread, style_compact remaps all of them, and they can be deleted in any order.
+// A frame of the reclaim policy (for attribs) passes when each of them is flushed
+struct style_cache * style_newcache_shared(struct style_cache *from);
 style_handle_t style_null(struct style_cache *);
 
+// style_attrib_id and style_attrib_extern can be called from any thread (alloc must be thread safe then), except during style_compact.
+// Other functions must be called in the thread of cache (which creates or loads it). In another thread, the id returned holds
+// one reference (a pin), so it stays valid when it's passed to the thread of cache. Release it there by style_attrib_release
+// after it's used (by style_create, style_modify, ...), or when it's not used.
 int style_attrib_id(struct style_cache *, const struct style_attrib *attrib);
+// ptr is immutable and owned by the cache from now on (one reference), ext must outlive the cache.
+// When an equal entry exists, ptr is released at once and the existing id returned
+int style_attrib_extern(struct style_cache *, uint8_t key, void *ptr, size_t sz, uint32_t hash, const struct style_extern *ext);
 void style_attrib_value(struct style_cache *, int id, struct style_attrib *attrib);
 void style_attrib_addref(struct style_cache *, int id);
 void style_attrib_release(struct style_cache *, int id);
@@ -28,6 +59,7 @@ style_handle_t style_create(struct style_cache *, int n, const int a[]);
 int style_modify(struct style_cache *, style_handle_t s, int n, int patch[], int removed_n, int removed_key[]);	// return 0 means not changed
 int style_assign(struct style_cache *c, style_handle_t s, style_handle_t v);	// return 1 : dirty 0 : no change
 int style_compare(struct style_cache *c, style_handle_t s, style_handle_t v);	// return 1 : change 0 : no change
+int style_compare_shared(struct style_cache *c, style_handle_t s, struct style_cache *o, style_handle_t v);	// o shares attribs with c, return 1 : different
 void style_addref(struct style_cache *c, style_handle_t s);
 void style_release(struct style_cache *c, style_handle_t s);
 
@@ -35,9 +67,103 @@ void style_release(struct style_cache *c, style_handle_t s);
 style_handle_t style_inherit(struct style_cache *, style_handle_t child, style_handle_t parent, int with_mask);
 
 void style_flush(struct style_cache *);
+// Flush in a background thread, the slots of dead styles are reusable after style_flush_wait. The dead styles are still
+// released (and parked) in the calling thread, which takes time linear to them, and the worker frees their slots, clears
+// the dirty list, resets the frame and flushes attribs. Until style_flush_wait only snapshots and style_attrib_id can be used
+// (style_flush, style_flush_async, style_compact, style_merge and style_deletecache wait by themselves).
+// It's style_flush when threads are not available or attribs are shared
+void style_flush_async(struct style_cache *);
+void style_flush_wait(struct style_cache *);
+
+// Unused attribs and unreferenced inherit nodes are kept in LRU order, released in style_flush after they are dead
+// for some frames (-1 : no limit), or at once when they take more than bytes (0 : no limit)
+void style_reclaim_policy(struct style_cache *, int frames, size_t bytes);
+
+#define STYLE_REMAP_HANDLE 0
+#define STYLE_REMAP_ATTRIB 1
+
+typedef void (*style_remap)(void *ud, int kind, int old_id, int new_id);
+
+// Move live styles and attrib ids into dense ranges and shrink memory, call it after style_flush.
+// remap is called for each handle (STYLE_REMAP_HANDLE) and attrib id (STYLE_REMAP_ATTRIB) which is moved
+void style_compact(struct style_cache *, style_remap remap, void *ud);
+
+// Merge the live styles of a staging cache S (built in any thread, and not in use now) into the cache.
+// Attribs are interned again and S is unchanged. remap is called for each live handle of S (STYLE_REMAP_HANDLE),
+// and each attrib id they use (STYLE_REMAP_ATTRIB), with the new id in the cache. The user references move along.
+// Extern attribs share the pointer (by style_extern.addref). Return -1 and change nothing when an extern attrib of S
+// has no addref
+int style_merge(struct style_cache *, struct style_cache *S, style_remap remap, void *ud);
+
+// Save the cache into a file, call it after style_flush and release the snapshots before.
+// The inherit cache is saved when with_inherit != 0. Extern attribs and shared attribs can't be saved, return -1 when failed
+int style_cache_save(struct style_cache *, const char *path, int with_inherit);
+// Load a saved cache, the handles and attrib ids are the same. The file is mapped and used in place, pages are read
+// when they are touched. NULL when the file is not an image of the same build
+struct style_cache * style_cache_load(const char *path, style_alloc alloc, void *ud);
+
+// A base is a read only set of attribs and attrib tuples saved from a cache. The file is mapped shared, so the caches
+// created with it (in any process) share the memory. Their attrib ids in base are the same, and new ids are after them.
+// The caches with a base can't be saved by style_cache_save. Release the base after the caches
+struct style_base;
+int style_base_save(struct style_cache *, const char *path);	// -1 : failed, or extern attribs
+struct style_base * style_base_load(const char *path);
+void style_base_release(struct style_base *);
+struct style_cache * style_newcache_base(const unsigned char inherit_mask[128], const struct style_base *base, style_alloc alloc, void *ud);
+
+// A journal records the changes of a new cache (creates, modifies, assigns, inherits, references, flushes, batches,
+// checkpoints, frame mode and compaction) in a compact binary stream, with the values of attribs they use.
+// A replica applies the stream to another new cache (with the same inherit mask), the handles are mapped by style_replica_handle
+struct style_journal;
+struct style_replica;
+struct style_journal * style_journal_create(struct style_cache *);
+void style_journal_release(struct style_journal *);
+const void * style_journal_data(struct style_journal *, size_t *sz);	// the stream since last style_journal_clear
+void style_journal_clear(struct style_journal *);
+struct style_replica * style_replica_create(struct style_cache *);
+void style_replica_release(struct style_replica *);	// before the cache is deleted
+size_t style_replica_apply(struct style_replica *, const void *data, size_t sz);	// return the bytes applied, an incomplete record at the end is left
+style_handle_t style_replica_handle(struct style_replica *, style_handle_t h);
+
+// Evaluate the dirty inherit nodes which h[] depend on, with nthread threads.
+// Independent nodes are merged in parallel and interned in a fixed order, so the attrib ids don't depend on nthread
+void style_eval_parallel(struct style_cache *, int n, const style_handle_t h[], int nthread);
+
+// Reserve n slots for transient inherit nodes, they are dropped at style_flush unless addref.
+// Their dependency edges are dropped at once, but style_flush still sweeps the slots used in the frame
+// to release their values and keys, so it takes time linear to the transient nodes created in the frame.
+// It can be changed between frames (after style_flush), n == 0 turns it off
+void style_frame_mode(struct style_cache *, int n);
+
+// Batch style_modify/style_assign, the changes are visible after style_commit
+void style_begin(struct style_cache *);
+void style_commit(struct style_cache *);
+
+// style_rollback reverts the styles to the checkpoint, in time proportional to the changes since then.
+// style_checkpoint_end keeps the changes. Checkpoints don't nest, and they are not allowed in a batch.
+// style_flush, style_flush_async, style_compact and style_frame_mode can't be called before the checkpoint ends
+void style_checkpoint(struct style_cache *);
+void style_rollback(struct style_cache *);
+void style_checkpoint_end(struct style_cache *);
 
 int style_find(struct style_cache *C, style_handle_t h, uint8_t key);
 int style_index(struct style_cache *, style_handle_t h, int i);
+int style_find_many(struct style_cache *C, style_handle_t h, int n, const uint8_t keys[], int output[]);	// output -1 when not found, return found count
+int style_export(struct style_cache *C, style_handle_t h, struct style_attrib output[128]);	// output[key].data == NULL when not found, return count
+
+struct style_schema * style_schema_create(struct style_cache *, int n, const struct style_schema_field f[]);
+void style_schema_release(struct style_cache *, struct style_schema *);
+int style_fetch(struct style_cache *C, style_handle_t h, const struct style_schema *, void *dst);	// return found count
+
+// Freeze the values of h[0, n), the snapshot is immutable and can be queried from any thread.
+// Values not changed since prev (can be NULL) are shared. Create and release snapshots in the thread of the cache,
+// and release them before style_deletecache.
+// h == NULL uses the handles of prev (until style_compact). When prev is the last snapshot created, only the nodes
+// changed since prev are read then, so it takes time linear to the changes (and the pages of prev), not to n
+struct style_snapshot * style_snapshot_create(struct style_cache *, const struct style_snapshot *prev, int n, const style_handle_t h[]);
+void style_snapshot_release(struct style_snapshot *);
+int style_snapshot_find(const struct style_snapshot *, int i, uint8_t key, struct style_attrib *output);	// i is the index in h[], return 0 when not found
+int style_snapshot_export(const struct style_snapshot *, int i, struct style_attrib output[128]);	// output[key].data == NULL when not found, return count
 
 void style_dump_key(struct style_cache *C, style_handle_t h, uint8_t key, char fmt);
 
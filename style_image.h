@@ -0,0 +1,190 @@
+#ifndef style_image_h
+#define style_image_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "style_alloc.h"
+#include "paged_array.h"
+#include "intern_cache.h"
+
+// A saved cache is a flat image. Sections are aligned, so the pages of paged arrays can be used in place,
+// and pointers inside them are saved as offsets from the beginning of the image.
+// The header is checked by the loader (including the size of image), the sections after it are trusted.
+
+#define STYLE_IMAGE_ALIGN 16
+
+struct style_image_writer {
+	FILE *f;
+	size_t offset;
+	int err;
+};
+
+struct style_image_reader {
+	uint8_t *base;
+	size_t sz;
+	size_t offset;
+};
+
+// return the offset of data
+static inline size_t
+image_write(struct style_image_writer *w, const void *data, size_t sz) {
+	static const uint8_t zero[STYLE_IMAGE_ALIGN] = { 0 };
+	size_t pad = (STYLE_IMAGE_ALIGN - (w->offset & (STYLE_IMAGE_ALIGN - 1))) & (STYLE_IMAGE_ALIGN - 1);
+	if (pad > 0 && fwrite(zero, 1, pad, w->f) != pad)
+		w->err = 1;
+	w->offset += pad;
+	size_t offset = w->offset;
+	if (sz > 0 && fwrite(data, 1, sz, w->f) != sz)
+		w->err = 1;
+	w->offset += sz;
+	return offset;
+}
+
+// only count the offset of sz bytes as image_write does, .f is not used
+static inline size_t
+image_skip(struct style_image_writer *w, size_t sz) {
+	size_t offset = (w->offset + STYLE_IMAGE_ALIGN - 1) & ~(size_t)(STYLE_IMAGE_ALIGN - 1);
+	w->offset = offset + sz;
+	return offset;
+}
+
+static inline void *
+image_read(struct style_image_reader *r, size_t sz) {
+	size_t offset = (r->offset + STYLE_IMAGE_ALIGN - 1) & ~(size_t)(STYLE_IMAGE_ALIGN - 1);
+	assert(offset <= r->sz && r->sz - offset >= sz);
+	r->offset = offset + sz;
+	return r->base + offset;
+}
+
+static inline void
+image_read_value(struct style_image_reader *r, void *data, size_t sz) {
+	memcpy(data, image_read(r, sz), sz);
+}
+
+static inline int
+image_contains(const struct style_image_reader *r, const void *p) {
+	return (uintptr_t)p - (uintptr_t)r->base < r->sz;
+}
+
+static inline size_t
+image_page_size(const struct paged_array *p) {
+	return p->esize * PAGED_ARRAY_PAGE;
+}
+
+// patch (can be NULL) fixes the pointers in a copy of page before writing
+static inline void
+image_write_pages(struct style_image_writer *w, const struct paged_array *p, void (*patch)(void *ud, void *page, int base), void *ud, void *tmp) {
+	image_write(w, &p->npage, sizeof(p->npage));
+	int i;
+	for (i=0;i<p->npage;i++) {
+		void *page = p->page[i];
+		if (patch) {
+			memcpy(tmp, page, image_page_size(p));
+			patch(ud, tmp, i << PAGED_ARRAY_BITS);
+			page = tmp;
+		}
+		image_write(w, page, image_page_size(p));
+	}
+}
+
+// pages are borrowed from the image, p is initialized already
+static inline void
+image_read_pages(struct style_image_reader *r, struct paged_array *p, struct style_cache *C) {
+	int npage;
+	image_read_value(r, &npage, sizeof(npage));
+	assert(p->npage == 0 && npage >= 0);
+	paged_array_reserve_dir(p, npage << PAGED_ARRAY_BITS, C);
+	int i;
+	for (i=0;i<npage;i++) {
+		p->page[i] = image_read(r, image_page_size(p));
+	}
+	p->npage = p->borrow = npage;
+}
+
+static inline void
+image_write_table_(struct style_image_writer *w, const struct intern_table *t) {
+	image_write(w, t, sizeof(*t));
+	image_write(w, t->index, t->size * 2 * sizeof(style_uindex_t));
+}
+
+static inline void
+image_read_table_(struct style_image_reader *r, struct intern_table *t, struct style_cache *C) {
+	image_read_value(r, t, sizeof(*t));
+	size_t sz = t->size * 2 * sizeof(style_uindex_t);
+	// tables are replaced by intern_cache_insert, so they are copied
+	t->index = (style_uindex_t *)style_malloc(C, sz);
+	memcpy(t->index, image_read(r, sz), sz);
+}
+
+static inline void
+image_write_intern(struct style_image_writer *w, const struct intern_cache *c) {
+	image_write(w, &c->migrate, sizeof(c->migrate));
+	image_write(w, &c->n, sizeof(c->n));
+	image_write_table_(w, &c->t);
+	if (c->migrate >= 0)
+		image_write_table_(w, &c->old);
+	image_write(w, &c->npage, sizeof(c->npage));
+	int i;
+	for (i=0;i<c->npage;i++) {
+		int page = c->next[i] != NULL;
+		image_write(w, &page, sizeof(page));
+		if (page)
+			image_write(w, c->next[i], INTERN_NEXT_PAGE * sizeof(style_uindex_t));
+	}
+}
+
+// c is not initialized, the table prepared for growth is not saved
+static inline void
+image_read_intern(struct style_image_reader *r, struct intern_cache *c, struct style_cache *C) {
+	verify_init(c);
+	c->clear = -1;
+	image_read_value(r, &c->migrate, sizeof(c->migrate));
+	image_read_value(r, &c->n, sizeof(c->n));
+	image_read_table_(r, &c->t, C);
+	if (c->migrate >= 0)
+		image_read_table_(r, &c->old, C);
+	c->npage = 0;
+	c->next = NULL;
+	int npage, i;
+	image_read_value(r, &npage, sizeof(npage));
+	for (i=0;i<npage;i++) {
+		int page;
+		image_read_value(r, &page, sizeof(page));
+		if (page)
+			image_read_value(r, intern_next_page(c, i, C), INTERN_NEXT_PAGE * sizeof(style_uindex_t));
+	}
+}
+
+// read only tables, used in place
+static inline void
+image_borrow_table_(struct style_image_reader *r, struct intern_table *t) {
+	image_read_value(r, t, sizeof(*t));
+	t->index = (style_uindex_t *)image_read(r, t->size * 2 * sizeof(style_uindex_t));
+}
+
+// c can only be used by intern_cache_find, free c->next (by free) when it's not used
+static inline void
+image_borrow_intern(struct style_image_reader *r, struct intern_cache *c) {
+	verify_init(c);
+	c->clear = -1;
+	image_read_value(r, &c->migrate, sizeof(c->migrate));
+	image_read_value(r, &c->n, sizeof(c->n));
+	image_borrow_table_(r, &c->t);
+	if (c->migrate >= 0)
+		image_borrow_table_(r, &c->old);
+	int i;
+	image_read_value(r, &c->npage, sizeof(c->npage));
+	// the directory is not counted by the allocator of any cache, as the base layer
+	c->next = (style_uindex_t **)malloc((c->npage + 1) * sizeof(style_uindex_t *));
+	for (i=0;i<c->npage;i++) {
+		int page;
+		image_read_value(r, &page, sizeof(page));
+		c->next[i] = page ? (style_uindex_t *)image_read(r, INTERN_NEXT_PAGE * sizeof(style_uindex_t)) : NULL;
+	}
+}
+
+#endif
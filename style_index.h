@@ -0,0 +1,31 @@
+#ifndef style_index_h
+#define style_index_h
+
+#include <stdint.h>
+
+// Define STYLE_COMPACT_INDEX to store ids in 16 bits, for small caches.
+// Tuples, nodes, dirty lists and intern tables are half size, and any id must be <= STYLE_INDEX_MAX.
+
+#ifdef STYLE_COMPACT_INDEX
+
+typedef uint16_t style_index_t;
+typedef uint16_t style_uindex_t;
+#define STYLE_INDEX_MAX 0xfffe	// 0xffff is -1
+
+#else
+
+typedef int32_t style_index_t;
+typedef uint32_t style_uindex_t;
+#define STYLE_INDEX_MAX 0x7fffffff
+
+#endif
+
+#define STYLE_INDEX_NONE ((style_index_t)-1)
+
+// -1 is stored as STYLE_INDEX_NONE, read the fields which can be -1 by it
+static inline int
+style_index_get(style_index_t v) {
+	return v == STYLE_INDEX_NONE ? -1 : (int)v;
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef style_journal_h
+#define style_journal_h
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "style_alloc.h"
+
+// A record of journal is an op byte and unsigned LEB128 integers. Lists are a count and the items,
+// the value of attrib is its size and the raw bytes.
+
+#define JOURNAL_START 0	// empty
+#define JOURNAL_KV 1	// id key value : the attrib id is used by the records after it
+#define JOURNAL_CREATE 2	// h [ids]
+#define JOURNAL_MODIFY 3	// h [ids] [removed keys]
+#define JOURNAL_ASSIGN 4	// h v
+#define JOURNAL_INHERIT 5	// h child parent withmask
+#define JOURNAL_ADDREF 6	// h
+#define JOURNAL_RELEASE 7	// h
+#define JOURNAL_FLUSH 8	// attrib ids are forgotten
+#define JOURNAL_COMPACT 9	// [old new] : handles are renumbered, attrib ids are forgotten
+#define JOURNAL_FRAME 10	// n
+#define JOURNAL_BEGIN 11
+#define JOURNAL_COMMIT 12
+#define JOURNAL_CHECKPOINT 13
+#define JOURNAL_ROLLBACK 14
+#define JOURNAL_CHECKPOINT_END 15
+
+struct journal_buffer {
+	uint8_t *data;
+	size_t n;
+	size_t cap;
+};
+
+static inline void
+journal_reserve(struct journal_buffer *b, size_t sz, struct style_cache *C) {
+	if (b->n + sz <= b->cap)
+		return;
+	size_t cap = b->cap == 0 ? 256 : b->cap * 2;
+	while (cap < b->n + sz)
+		cap *= 2;
+	b->data = (uint8_t *)style_realloc(C, b->data, b->cap, cap);
+	b->cap = cap;
+}
+
+static inline void
+journal_write_uint(struct journal_buffer *b, uint32_t v, struct style_cache *C) {
+	journal_reserve(b, 5, C);
+	while (v >= 0x80) {
+		b->data[b->n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	b->data[b->n++] = (uint8_t)v;
+}
+
+static inline void
+journal_write_data(struct journal_buffer *b, const void *data, size_t sz, struct style_cache *C) {
+	journal_write_uint(b, (uint32_t)sz, C);
+	journal_reserve(b, sz, C);
+	memcpy(b->data + b->n, data, sz);
+	b->n += sz;
+}
+
+// .eof is set when the record is not complete
+struct journal_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+	int eof;
+};
+
+static inline uint32_t
+journal_read_uint(struct journal_reader *r) {
+	uint32_t v = 0;
+	int shift = 0;
+	for (;;) {
+		if (r->p >= r->end) {
+			r->eof = 1;
+			return 0;
+		}
+		uint8_t c = *r->p++;
+		assert(shift < 32);
+		v |= (uint32_t)(c & 0x7f) << shift;
+		if (c < 0x80)
+			return v;
+		shift += 7;
+	}
+}
+
+static inline const void *
+journal_read_data(struct journal_reader *r, size_t *sz) {
+	*sz = journal_read_uint(r);
+	if (r->eof || (size_t)(r->end - r->p) < *sz) {
+		r->eof = 1;
+		return NULL;
+	}
+	const void *data = r->p;
+	r->p += *sz;
+	return data;
+}
+
+// read a list into v[max], return the count
+static inline int
+journal_read_list(struct journal_reader *r, int v[], int max) {
+	int n = (int)journal_read_uint(r);
+	assert(r->eof || n <= max);
+	int i;
+	for (i=0;i<n && !r->eof;i++) {
+		v[i] = (int)journal_read_uint(r);
+	}
+	return n;
+}
+
+#endif
@@ -0,0 +1,277 @@
+// Intern attribs from many threads while the owner thread keeps using the cache.
+// Usage : testconc.exe [lookups per thread]
+
+#include "style.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define MAX_THREAD 16
+#define VALUE_N 20000
+#define STRESS_THREAD 8
+
+struct loader {
+	struct style_cache *C;
+	int seed;
+	int n;
+	int base;
+	int id[VALUE_N];
+};
+
+static void
+make_value(int v, struct style_attrib *a, char buffer[32]) {
+	// odd values are blobs
+	if (v & 1) {
+		snprintf(buffer, 32, "value string %d", v);
+		a->data = buffer;
+		a->sz = strlen(buffer) + 1;
+	} else {
+		memcpy(buffer, &v, sizeof(v));
+		a->data = buffer;
+		a->sz = sizeof(v);
+	}
+	a->key = (uint8_t)(v % 8);
+}
+
+static void *
+intern_thread(void *ud) {
+	struct loader *L = (struct loader *)ud;
+	int i;
+	for (i=0;i<L->n;i++) {
+		// every thread visits the values in a different order
+		int v = (i * 7919 + L->seed * 104729) % L->n;
+		char buffer[32];
+		struct style_attrib a;
+		make_value(v + L->base, &a, buffer);
+		L->id[v] = style_attrib_id(L->C, &a);
+	}
+	return NULL;
+}
+
+static void
+test_stress(void) {
+	struct style_cache *C = style_newcache(NULL, NULL, NULL);
+	static struct loader L[STRESS_THREAD];
+	pthread_t thread[STRESS_THREAD];
+	int i, j;
+	for (i=0;i<STRESS_THREAD;i++) {
+		L[i].C = C;
+		L[i].seed = i;
+		L[i].n = VALUE_N;
+		L[i].base = 0;
+		pthread_create(&thread[i], NULL, intern_thread, &L[i]);
+	}
+	// the owner thread creates and releases styles at the same time
+	for (i=0;i<2000;i++) {
+		int v = i;
+		struct style_attrib a = { &v, sizeof(v), 100 };
+		int id = style_attrib_id(C, &a);
+		style_handle_t h = style_create(C, 1, &id);
+		assert(style_find(C, h, 100) == id);
+		style_release(C, h);
+		if (i % 100 == 0)
+			style_flush(C);
+	}
+	for (i=0;i<STRESS_THREAD;i++) {
+		pthread_join(thread[i], NULL);
+	}
+	for (i=0;i<VALUE_N;i++) {
+		for (j=1;j<STRESS_THREAD;j++) {
+			assert(L[j].id[i] == L[0].id[i]);
+		}
+		char buffer[32];
+		struct style_attrib a, r;
+		make_value(i, &a, buffer);
+		style_attrib_value(C, L[0].id[i], &r);
+		assert(r.key == a.key && memcmp(r.data, a.data, a.sz) == 0);
+	}
+	// the ids found by other threads are pinned
+	for (i=0;i<STRESS_THREAD;i++) {
+		for (j=0;j<VALUE_N;j++) {
+			style_attrib_release(C, L[i].id[j]);
+		}
+	}
+	style_flush(C);
+	style_deletecache(C);
+	printf("STRESS %d threads x %d values OK\n", STRESS_THREAD, VALUE_N);
+}
+
+// the owner parks and collects the entries while other threads look them up
+static void
+test_parked(void) {
+	struct style_cache *C = style_newcache(NULL, NULL, NULL);
+	static struct loader L[STRESS_THREAD];
+	static style_handle_t h[VALUE_N];
+	pthread_t thread[STRESS_THREAD];
+	int i, j;
+	style_reclaim_policy(C, 0, 0);
+	for (i=0;i<VALUE_N;i++) {
+		char buffer[32];
+		struct style_attrib a;
+		make_value(i, &a, buffer);
+		int id = style_attrib_id(C, &a);
+		h[i] = style_create(C, 1, &id);
+	}
+	for (i=0;i<STRESS_THREAD;i++) {
+		L[i].C = C;
+		L[i].seed = i;
+		L[i].n = VALUE_N;
+		L[i].base = 0;
+		pthread_create(&thread[i], NULL, intern_thread, &L[i]);
+	}
+	for (i=0;i<VALUE_N;i++) {
+		style_release(C, h[i]);
+		if (i % 50 == 0)
+			style_flush(C);
+	}
+	for (i=0;i<STRESS_THREAD;i++) {
+		pthread_join(thread[i], NULL);
+	}
+	style_flush(C);
+	style_flush(C);
+	// the ids are pinned by the lookups, so they are still valid
+	for (i=0;i<VALUE_N;i++) {
+		for (j=1;j<STRESS_THREAD;j++) {
+			assert(L[j].id[i] == L[0].id[i]);
+		}
+		char buffer[32];
+		struct style_attrib a, r;
+		make_value(i, &a, buffer);
+		style_attrib_value(C, L[0].id[i], &r);
+		assert(r.key == a.key && memcmp(r.data, a.data, a.sz) == 0);
+	}
+	style_deletecache(C);
+	printf("PARKED %d threads x %d values OK\n", STRESS_THREAD, VALUE_N);
+}
+
+static int
+same_value(struct style_cache *C, int id, int v) {
+	char buffer[32];
+	struct style_attrib a, r;
+	make_value(v, &a, buffer);
+	style_attrib_value(C, id, &r);
+	return r.key == a.key && r.sz == a.sz && memcmp(r.data, a.data, a.sz) == 0;
+}
+
+// the pin of another thread is kept when the owner references and releases the entry by itself
+static void
+test_pin(void) {
+	struct style_cache *C = style_newcache(NULL, NULL, NULL);
+	static struct loader L;
+	pthread_t thread;
+	int i;
+	style_reclaim_policy(C, 0, 0);
+	char buffer[32];
+	struct style_attrib a;
+	make_value(1, &a, buffer);
+	int id = style_attrib_id(C, &a);
+	style_handle_t h = style_create(C, 1, &id);
+	L.C = C;
+	L.seed = 0;
+	L.n = 1;
+	L.base = 1;
+	pthread_create(&thread, NULL, intern_thread, &L);
+	pthread_join(thread, NULL);
+	assert(L.id[0] == id);
+	// an unrelated reference of the owner doesn't take over the pin
+	style_attrib_addref(C, id);
+	style_attrib_release(C, id);
+	style_release(C, h);
+	for (i=0;i<3;i++) {
+		style_flush(C);
+	}
+	make_value(2, &a, buffer);
+	assert(style_attrib_id(C, &a) != id);
+	assert(same_value(C, id, 1));
+	make_value(1, &a, buffer);
+	assert(style_attrib_id(C, &a) == id);
+	// the pin is released by the owner, the entry is freed and its id is reused
+	style_attrib_release(C, L.id[0]);
+	style_flush(C);
+	make_value(3, &a, buffer);
+	assert(style_attrib_id(C, &a) == id);
+	assert(same_value(C, id, 3));
+	style_deletecache(C);
+	printf("PIN OK\n");
+}
+
+static double
+now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct lookup {
+	struct style_cache *C;
+	int seed;
+	int n;
+};
+
+static void *
+lookup_thread(void *ud) {
+	struct lookup *L = (struct lookup *)ud;
+	int i;
+	for (i=0;i<L->n;i++) {
+		char buffer[32];
+		struct style_attrib a;
+		make_value((i + L->seed * 4099) % VALUE_N, &a, buffer);
+		style_attrib_id(L->C, &a);
+	}
+	return NULL;
+}
+
+static double
+run(struct style_cache *C, int nthread, int n, int base, void *(*f)(void *)) {
+	pthread_t thread[MAX_THREAD];
+	struct loader *L = (struct loader *)malloc(nthread * sizeof(struct loader));
+	struct lookup H[MAX_THREAD];
+	int i;
+	double t = now_sec();
+	for (i=0;i<nthread;i++) {
+		if (f == lookup_thread) {
+			H[i].C = C;
+			H[i].seed = i;
+			H[i].n = n;
+			pthread_create(&thread[i], NULL, f, &H[i]);
+		} else {
+			L[i].C = C;
+			L[i].seed = 0;
+			L[i].n = n;
+			L[i].base = base + i * n;
+			pthread_create(&thread[i], NULL, f, &L[i]);
+		}
+	}
+	for (i=0;i<nthread;i++) {
+		pthread_join(thread[i], NULL);
+	}
+	t = now_sec() - t;
+	free(L);
+	return (double)n * nthread / t / 1e6;
+}
+
+int
+main(int argc, char *argv[]) {
+	int n = 50000;
+	if (argc > 1)
+		n = atoi(argv[1]);
+	test_stress();
+	test_parked();
+	test_pin();
+	printf("%8s %16s %16s\n", "threads", "lookup(Mops/s)", "insert(Mops/s)");
+	int nthread;
+	for (nthread=1;nthread<=MAX_THREAD;nthread*=2) {
+		struct style_cache *C = style_newcache(NULL, NULL, NULL);
+		// values are interned before, lookups never take the write lock
+		run(C, 1, VALUE_N, 0, intern_thread);
+		double lookup = run(C, nthread, n, 0, lookup_thread);
+		// each thread adds its own new values
+		double insert = run(C, nthread, VALUE_N, VALUE_N, intern_thread);
+		printf("%8d %16.2f %16.2f\n", nthread, lookup, insert);
+		style_deletecache(C);
+	}
+	return 0;
+}
@@ -32,6 +32,58 @@ print_value(struct intern_cache *cache, struct node *array, int value) {
 	}
 }
 
+static int
+count_value(struct intern_cache *cache, struct node *array, int value) {
+	struct intern_cache_iterator iter;
+	int n = 0;
+	if (intern_cache_find(cache, int32_hash(value/4), &iter, get_hash, array)) {
+		do {
+			if (array[iter.result].value == value)
+				++n;
+		} while (intern_cache_find_next(cache, &iter, get_hash, array));
+	}
+	return n;
+}
+
+#define MIGRATE_N 2000
+
+// lookups and removes while the table is migrating
+static void
+test_migrate(struct style_cache *C) {
+	static struct node array[MIGRATE_N];
+	struct intern_cache cache;
+	int i,j;
+	intern_cache_init(C, &cache, 2);
+	for (i=0;i<MIGRATE_N;i++) {
+		array[i].hash = int32_hash(i/4);
+		array[i].value = i;
+		array[i].index = i;
+		intern_cache_insert(&cache, i, get_hash, array, C);
+		if (i % 3 == 2) {
+			// remove an earlier one, it may be in the old table
+			int r = i / 3;
+			if (array[r].index >= 0) {
+				intern_cache_remove(&cache, r, get_hash, array);
+				array[r].index = -1;
+			}
+		}
+		if (cache.migrate >= 0) {
+			for (j=0;j<=i;j++) {
+				assert(count_value(&cache, array, j) == (array[j].index >= 0));
+			}
+		}
+	}
+	int n = 0;
+	for (i=0;i<MIGRATE_N;i++) {
+		int c = count_value(&cache, array, i);
+		assert(c == (array[i].index >= 0));
+		n += c;
+	}
+	assert(n == cache.n);
+	printf("MIGRATE %d\n", n);
+	intern_cache_deinit(C, &cache);
+}
+
 int
 main() {
 	struct style_cache *C = style_newcache(NULL, NULL, NULL);
@@ -66,6 +118,8 @@ main() {
 
 	intern_cache_deinit(C, &cache);
 
+	test_migrate(C);
+
 	style_deletecache(C);
 	return 0;
 }
\ No newline at end of file